@@ -0,0 +1,128 @@
+#include "adaptive_threshold.h"
+
+#include <string.h>
+
+static int clamp_gray(const int value) {
+    return value < 0 ? 0 : (value > 255 ? 255 : value);
+}
+
+/**
+ * @brief Splits one axis into equal tiles of about tile_size pixels.
+ * @return The number of tiles.
+ */
+static int split_axis(const int size, const int tile_size, int* tile_start) {
+    int tiles = size / tile_size;
+    tiles = tiles < 1 ? 1 : (tiles > THRESHOLD_MAX_TILES ? THRESHOLD_MAX_TILES : tiles);
+    for (int i = 0; i <= tiles; i++) {
+        tile_start[i] = i * size / tiles;
+    }
+    return tiles;
+}
+
+/**
+ * @brief For every pixel of an axis, finds the tile center at or before it and how far it is towards the next one,
+ * in 1/256 of the distance between the two centers.
+ */
+static void interpolation_weights(const int* tile_start, const int tiles, const int size, unsigned char* lower,
+                                  unsigned short* weight) {
+    int tile = 0;
+    for (int p = 0; p < size; p++) {
+        while (tile + 1 < tiles && p >= (tile_start[tile + 1] + tile_start[tile + 2]) / 2) {
+            tile++;
+        }
+        const int center = (tile_start[tile] + tile_start[tile + 1]) / 2;
+        lower[p] = tile;
+        if (p <= center || tile + 1 == tiles) {
+            // Before the first center and past the last one the nearest center's threshold holds
+            weight[p] = 0;
+        } else {
+            const int next_center = (tile_start[tile + 1] + tile_start[tile + 2]) / 2;
+            weight[p] = (p - center) * 256 / (next_center - center);
+        }
+    }
+}
+
+void compute_threshold_map(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT], const int tile_size,
+                           const int min_separation, const int offset, Threshold_map* map) {
+    map->tiles_x = split_axis(BMP_WIDTH, tile_size, map->tile_start_x);
+    map->tiles_y = split_axis(BMP_HEIGHT, tile_size, map->tile_start_y);
+
+    // Every pixel is counted once, into its tile's histogram, which costs what the global histogram does
+    int histogram[256];
+    int global_histogram[256] = {0};
+    int separations[THRESHOLD_MAX_TILES][THRESHOLD_MAX_TILES];
+    for (int tile_x = 0; tile_x < map->tiles_x; tile_x++) {
+        for (int tile_y = 0; tile_y < map->tiles_y; tile_y++) {
+            const Image_region tile = {map->tile_start_x[tile_x], map->tile_start_x[tile_x + 1],
+                                       map->tile_start_y[tile_y], map->tile_start_y[tile_y + 1]};
+            memset(histogram, 0, sizeof(histogram));
+            add_to_histogram(input_image, &tile, histogram);
+            map->thresholds[tile_x][tile_y] = otsu_threshold_with_separation(histogram,
+                                                                             &separations[tile_x][tile_y]);
+            for (int i = 0; i < 256; i++) {
+                global_histogram[i] += histogram[i];
+            }
+        }
+    }
+
+    map->global_threshold = clamp_gray(otsu_threshold_from_histogram(global_histogram) + offset);
+    map->fallback_tiles = 0;
+    for (int tile_x = 0; tile_x < map->tiles_x; tile_x++) {
+        for (int tile_y = 0; tile_y < map->tiles_y; tile_y++) {
+            if (separations[tile_x][tile_y] < min_separation) {
+                map->thresholds[tile_x][tile_y] = map->global_threshold;
+                map->fallback_tiles++;
+            } else {
+                map->thresholds[tile_x][tile_y] = clamp_gray(map->thresholds[tile_x][tile_y] + offset);
+            }
+        }
+    }
+}
+
+void binary_threshold_map_into(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT],
+                               unsigned char output_image[BMP_WIDTH][BMP_HEIGHT], Threshold_map* map) {
+    unsigned char lower_x[BMP_WIDTH];
+    unsigned short weight_x[BMP_WIDTH];
+    unsigned char lower_y[BMP_HEIGHT];
+    unsigned short weight_y[BMP_HEIGHT];
+    interpolation_weights(map->tile_start_x, map->tiles_x, BMP_WIDTH, lower_x, weight_x);
+    interpolation_weights(map->tile_start_y, map->tiles_y, BMP_HEIGHT, lower_y, weight_y);
+
+    // Interpolating down the columns of tile centers first leaves one blend of two columns per pixel
+    for (int tile_x = 0; tile_x < map->tiles_x; tile_x++) {
+        const unsigned char* thresholds = map->thresholds[tile_x];
+        for (int y = 0; y < BMP_HEIGHT; y++) {
+            const int tile_y = lower_y[y];
+            const int next_y = tile_y + 1 < map->tiles_y ? tile_y + 1 : tile_y;
+            const int blend = thresholds[tile_y] * (256 - weight_y[y]) + thresholds[next_y] * weight_y[y];
+            map->columns[tile_x][y] = (short)((blend + 2) >> 2);
+        }
+    }
+    for (int tile_x = 0; tile_x < map->tiles_x; tile_x++) {
+        const int next_x = tile_x + 1 < map->tiles_x ? tile_x + 1 : tile_x;
+        for (int y = 0; y < BMP_HEIGHT; y++) {
+            map->steps[tile_x][y] = (short)(2 * (map->columns[next_x][y] - map->columns[tile_x][y]));
+        }
+    }
+
+    for (int x = 0; x < BMP_WIDTH; x++) {
+        if (x < BORDER || x >= BMP_WIDTH - BORDER) {
+            memset(output_image[x], 0, BMP_HEIGHT);
+            continue;
+        }
+        // Everything stays in 16 bits, so a vector holds eight pixels and the blend is one high-half multiply
+        const short* restrict column = map->columns[lower_x[x]];
+        const short* restrict step = map->steps[lower_x[x]];
+        const unsigned char* restrict input = input_image[x];
+        unsigned char* restrict output = output_image[x];
+        const short weight = (short)(weight_x[x] * 128);
+        for (int y = 0; y < BMP_HEIGHT; y++) {
+            const short blend = (short)(column[y] + (short)((step[y] * weight) >> 16));
+            // Rounded to whole gray levels, so a flat region compares exactly as binary_threshold would
+            const unsigned char threshold = (unsigned char)((blend + 32) >> 6);
+            output[y] = input[y] > threshold ? 255 : 0;
+        }
+        memset(output_image[x], 0, BORDER);
+        memset(&output_image[x][BMP_HEIGHT - BORDER], 0, BORDER);
+    }
+}
@@ -0,0 +1,55 @@
+#ifndef CELL_DETECTION_ADAPTIVE_THRESHOLD_H
+#define CELL_DETECTION_ADAPTIVE_THRESHOLD_H
+
+#include "cbmp.h"
+#include "image_processing.h"
+
+// Most tiles a tiled threshold splits the image into along each axis
+#define THRESHOLD_MAX_TILES 32
+// Smallest tile size, which keeps a tile's histogram meaningful
+#define THRESHOLD_MIN_TILE_SIZE 32
+
+// One Otsu threshold per tile, interpolated between the tile centers when binarizing.
+// Lives in the pipeline's arena, together with the interpolation scratch memory.
+typedef struct {
+    int tiles_x;
+    int tiles_y;
+    // First pixel of every tile, with the image size as the last entry
+    int tile_start_x[THRESHOLD_MAX_TILES + 1];
+    int tile_start_y[THRESHOLD_MAX_TILES + 1];
+    unsigned char thresholds[THRESHOLD_MAX_TILES][THRESHOLD_MAX_TILES];
+    // Otsu threshold of the whole image, given to tiles that are too flat to have one of their own
+    int global_threshold;
+    int fallback_tiles;
+    // The tile thresholds interpolated down every column of tile centers, in 1/64 gray levels,
+    // and twice the difference to the next column
+    short columns[THRESHOLD_MAX_TILES][BMP_HEIGHT];
+    short steps[THRESHOLD_MAX_TILES][BMP_HEIGHT];
+} Threshold_map;
+
+/**
+ * @brief Computes an Otsu threshold for every tile in one pass over the image.
+ * The whole image's histogram is the sum of the tiles', so the global threshold comes for free.
+ *
+ * @param input_image The grayscale image.
+ * @param tile_size The approximate tile size. The image is split into equal tiles of about this size.
+ * @param min_separation Tiles whose two classes are closer than this many gray levels use the global threshold,
+ * since Otsu splits the noise of a flat background tile.
+ * @param offset Added to every threshold, which is then clamped to 0-255.
+ * @param map The map to fill.
+ */
+void compute_threshold_map(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT], int tile_size, int min_separation,
+                           int offset, Threshold_map* map);
+
+/**
+ * @brief Same as binary_threshold, with every pixel compared to the tile thresholds bilinearly interpolated
+ * at its position. Pixels outside the outermost tile centers take the nearest center's value.
+ *
+ * @param input_image The grayscale image.
+ * @param output_image The binary image, with the same black border binary_threshold leaves.
+ * @param map The thresholds from compute_threshold_map. Its interpolation memory is overwritten.
+ */
+void binary_threshold_map_into(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT],
+                               unsigned char output_image[BMP_WIDTH][BMP_HEIGHT], Threshold_map* map);
+
+#endif // CELL_DETECTION_ADAPTIVE_THRESHOLD_H
@@ -0,0 +1,377 @@
+#include "batch.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+
+#define FILENAME_BUFFER_SIZE 256
+
+// One image in flight, reused once the writer is done with it
+typedef struct {
+    unsigned char grayscale[BMP_WIDTH][BMP_HEIGHT];
+    unsigned char rgb[BMP_WIDTH][BMP_HEIGHT][BMP_CHANNELS];
+    int index;
+    // False if the input could not be read, the slot then only passes through
+    bool valid;
+    int threshold;
+    int cells;
+    // Set when the deadline stopped the erosion loop, after erosion_passes passes
+    bool deadline_expired;
+    int erosion_passes;
+} Batch_slot;
+
+// Bounded blocking queue of slots. A NULL slot marks the end of the batch.
+typedef struct {
+    Batch_slot** items;
+    int capacity;
+    int head;
+    int count;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} Slot_queue;
+
+typedef struct {
+    const Pipeline* pipeline;
+    const Batch_options* options;
+    const char* output_directory;
+    char** input_paths;
+    int input_amount;
+
+    Slot_queue free_slots;
+    Slot_queue to_compute;
+    Slot_queue to_write;
+
+    // The io_uring rings of the reader and the writer, or NULL for blocking I/O
+    Uring_io* read_io;
+    Uring_io* write_io;
+    // The files the blocking reader reads an input into and the blocking writer encodes an output into,
+    // of BATCH_IO_BUFFER_SIZE bytes each
+    unsigned char* read_buffer;
+    unsigned char* write_buffer;
+    // Files that could not be read or written
+    int read_errors;
+    int write_errors;
+
+    // Time each stage spent working rather than waiting on a queue
+    double reader_busy;
+    double writer_busy;
+} Batch_run;
+
+static bool init_queue(Slot_queue* queue, const int capacity) {
+    queue->items = malloc(sizeof(Batch_slot*) * capacity);
+    if (queue->items == NULL) {
+        fprintf(stderr, "Failed to allocate batch queue\n");
+        return false;
+    }
+    queue->capacity = capacity;
+    queue->head = 0;
+    queue->count = 0;
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->not_empty, NULL);
+    pthread_cond_init(&queue->not_full, NULL);
+    return true;
+}
+
+static void destroy_queue(Slot_queue* queue) {
+    pthread_cond_destroy(&queue->not_full);
+    pthread_cond_destroy(&queue->not_empty);
+    pthread_mutex_destroy(&queue->lock);
+    free(queue->items);
+}
+
+static void push_slot(Slot_queue* queue, Batch_slot* slot) {
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == queue->capacity) {
+        pthread_cond_wait(&queue->not_full, &queue->lock);
+    }
+    queue->items[(queue->head + queue->count) % queue->capacity] = slot;
+    queue->count++;
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+static Batch_slot* pop_slot(Slot_queue* queue) {
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0) {
+        pthread_cond_wait(&queue->not_empty, &queue->lock);
+    }
+    Batch_slot* slot = queue->items[queue->head];
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count--;
+    pthread_cond_signal(&queue->not_full);
+    pthread_mutex_unlock(&queue->lock);
+    return slot;
+}
+
+static void print_slot_result(const char* input_path, const Batch_slot* slot) {
+    if (slot->deadline_expired) {
+        printf("%s: threshold %d, %d cells, deadline expired after %d erosion passes\n", input_path,
+               slot->threshold, slot->cells, slot->erosion_passes);
+    } else {
+        printf("%s: threshold %d, %d cells\n", input_path, slot->threshold, slot->cells);
+    }
+}
+
+static void* reader_stage(void* argument) {
+    Batch_run* run = argument;
+    for (int i = 0; i < run->input_amount; i++) {
+        Batch_slot* slot = pop_slot(&run->free_slots);
+        const double started = now_seconds();
+        slot->index = i;
+        slot->valid = read_bitmap_file(run->input_paths[i], run->read_buffer, slot->grayscale,
+                                       run->options->annotate ? slot->rgb : NULL);
+        if (!slot->valid) {
+            fprintf(stderr, "Skipping %s\n", run->input_paths[i]);
+            run->read_errors++;
+        }
+        run->reader_busy += now_seconds() - started;
+        push_slot(&run->to_compute, slot);
+    }
+    push_slot(&run->to_compute, NULL);
+    return NULL;
+}
+
+// Image i is read into buffer i % io_depth, so the reads of the next io_depth images are in flight
+// while one is decoded, and the images still come out in order
+static void* uring_reader_stage(void* argument) {
+    Batch_run* run = argument;
+    const int depth = run->options->io_depth;
+    int submitted = 0;
+    for (int i = 0; i < run->input_amount; i++) {
+        const double started = now_seconds();
+        for (; submitted < run->input_amount && submitted < i + depth; submitted++) {
+            submit_uring_read(run->read_io, submitted % depth, run->input_paths[submitted]);
+        }
+        const long size = wait_uring_buffer(run->read_io, i % depth);
+        run->reader_busy += now_seconds() - started;
+
+        Batch_slot* slot = pop_slot(&run->free_slots);
+        const double decode_started = now_seconds();
+        slot->index = i;
+        slot->valid = size >= 0 && decode_bitmap_grayscale(uring_io_buffer(run->read_io, i % depth),
+                                                           (unsigned int)size, slot->grayscale,
+                                                           run->options->annotate ? slot->rgb : NULL);
+        if (!slot->valid) {
+            fprintf(stderr, "Skipping %s\n", run->input_paths[i]);
+            run->read_errors++;
+        }
+        run->reader_busy += now_seconds() - decode_started;
+        push_slot(&run->to_compute, slot);
+    }
+    push_slot(&run->to_compute, NULL);
+    return NULL;
+}
+
+static void* writer_stage(void* argument) {
+    Batch_run* run = argument;
+    char output_path[FILENAME_BUFFER_SIZE];
+    Batch_slot* slot;
+    while ((slot = pop_slot(&run->to_write)) != NULL) {
+        const double started = now_seconds();
+        const char* input_path = run->input_paths[slot->index];
+        const char* file_name = strrchr(input_path, '/');
+        file_name = file_name != NULL ? file_name + 1 : input_path;
+
+        if (run->options->annotate && slot->valid) {
+            snprintf(output_path, sizeof(output_path), "%s/%s", run->output_directory, file_name);
+            if (!write_bitmap_file(output_path, slot->rgb, run->write_buffer)) {
+                run->write_errors++;
+            }
+        }
+        if (slot->valid) {
+            print_slot_result(input_path, slot);
+        }
+        run->writer_busy += now_seconds() - started;
+        push_slot(&run->free_slots, slot);
+    }
+    return NULL;
+}
+
+// Output n is encoded into buffer n % io_depth once that buffer's previous write is done, so io_depth
+// writes run behind the writer and the slot goes back to the reader as soon as it is encoded
+static void* uring_writer_stage(void* argument) {
+    Batch_run* run = argument;
+    const int depth = run->options->io_depth;
+    char output_path[FILENAME_BUFFER_SIZE];
+    int written = 0;
+    Batch_slot* slot;
+    while ((slot = pop_slot(&run->to_write)) != NULL) {
+        const double started = now_seconds();
+        const char* input_path = run->input_paths[slot->index];
+        const char* file_name = strrchr(input_path, '/');
+        file_name = file_name != NULL ? file_name + 1 : input_path;
+
+        if (run->options->annotate && slot->valid) {
+            const int buffer = written % depth;
+            if (written >= depth && wait_uring_buffer(run->write_io, buffer) < 0) {
+                run->write_errors++;
+            }
+            unsigned char* file_bytes = uring_io_buffer(run->write_io, buffer);
+            const unsigned int size = encode_bitmap(slot->rgb, file_bytes, BATCH_IO_BUFFER_SIZE);
+            snprintf(output_path, sizeof(output_path), "%s/%s", run->output_directory, file_name);
+            submit_uring_write(run->write_io, buffer, output_path, size);
+            written++;
+        }
+        if (slot->valid) {
+            print_slot_result(input_path, slot);
+        }
+        run->writer_busy += now_seconds() - started;
+        push_slot(&run->free_slots, slot);
+    }
+
+    const double started = now_seconds();
+    for (int i = written > depth ? written - depth : 0; i < written; i++) {
+        if (wait_uring_buffer(run->write_io, i % depth) < 0) {
+            run->write_errors++;
+        }
+    }
+    run->writer_busy += now_seconds() - started;
+    return NULL;
+}
+
+static void destroy_batch_run(Batch_run* run, Scratch_arena* arena, Batch_slot* slots) {
+    destroy_uring_io(run->write_io);
+    destroy_uring_io(run->read_io);
+    free(run->read_buffer);
+    free(run->write_buffer);
+
+    destroy_queue(&run->to_write);
+    destroy_queue(&run->to_compute);
+    destroy_queue(&run->free_slots);
+    destroy_scratch_arena(arena);
+    free(slots);
+}
+
+int run_batch(const Pipeline* pipeline, const Batch_options* options, const char* output_directory,
+              char** input_paths, const int input_amount) {
+    if (options->queue_depth < 1 || options->buffer_count < 1 || options->io_depth < 1) {
+        fprintf(stderr, "Queue depth, buffer count and I/O depth must be at least 1\n");
+        return 1;
+    }
+
+    Batch_run run = {
+        .pipeline = pipeline,
+        .options = options,
+        .output_directory = output_directory,
+        .input_paths = input_paths,
+        .input_amount = input_amount,
+    };
+    // The pool is a queue too, large enough to hold every buffer at once
+    Batch_slot* slots = malloc(sizeof(Batch_slot) * options->buffer_count);
+    Scratch_arena* arena = create_scratch_arena();
+    if (slots == NULL || arena == NULL || !init_queue(&run.free_slots, options->buffer_count) ||
+        !init_queue(&run.to_compute, options->queue_depth) || !init_queue(&run.to_write, options->queue_depth)) {
+        fprintf(stderr, "Failed to allocate %d batch buffers\n", options->buffer_count);
+        free(run.to_write.items);
+        free(run.to_compute.items);
+        free(run.free_slots.items);
+        destroy_scratch_arena(arena);
+        free(slots);
+        return 1;
+    }
+    for (int i = 0; i < options->buffer_count; i++) {
+        push_slot(&run.free_slots, &slots[i]);
+    }
+
+    if (options->io_backend == IO_BACKEND_URING) {
+        // Each thread gets its own ring, since a ring is not safe to share
+        run.read_io = create_uring_io(options->io_depth);
+        run.write_io = run.read_io != NULL ? create_uring_io(options->io_depth) : NULL;
+        if (run.write_io == NULL) {
+            destroy_uring_io(run.read_io);
+            run.read_io = NULL;
+            fprintf(stderr, "Falling back to blocking I/O\n");
+        }
+    }
+    if (run.read_io == NULL) {
+        run.read_buffer = malloc(BATCH_IO_BUFFER_SIZE);
+        run.write_buffer = malloc(BATCH_IO_BUFFER_SIZE);
+        if (run.read_buffer == NULL || run.write_buffer == NULL) {
+            fprintf(stderr, "Failed to allocate the I/O buffers\n");
+            destroy_batch_run(&run, arena, slots);
+            return 1;
+        }
+    }
+    if (options->cold_cache) {
+        for (int i = 0; i < input_amount; i++) {
+            evict_from_page_cache(input_paths[i]);
+        }
+    }
+
+    const double started = now_seconds();
+    pthread_t reader;
+    pthread_t writer;
+    // The writer starts first, since an idle writer stops at the end marker while a reader would run on
+    int error = pthread_create(&writer, NULL, run.write_io != NULL ? uring_writer_stage : writer_stage, &run);
+    if (error == 0) {
+        error = pthread_create(&reader, NULL, run.read_io != NULL ? uring_reader_stage : reader_stage, &run);
+        if (error != 0) {
+            push_slot(&run.to_write, NULL);
+            pthread_join(writer, NULL);
+        }
+    }
+    if (error != 0) {
+        fprintf(stderr, "Failed to start the batch threads: %s\n", strerror(error));
+        destroy_batch_run(&run, arena, slots);
+        return 1;
+    }
+
+    // The compute stage runs on the calling thread, with the one arena it needs
+    double compute_busy = 0;
+    int expired = 0;
+    Batch_slot* slot;
+    while ((slot = pop_slot(&run.to_compute)) != NULL) {
+        if (!slot->valid) {
+            push_slot(&run.to_write, slot);
+            continue;
+        }
+        const double compute_started = now_seconds();
+        slot->deadline_expired = false;
+        Cell_list* cell_list = create_cell_list();
+        const unsigned long long cache_key =
+            options->cache != NULL ? result_cache_key(slot->grayscale, &pipeline->config) : 0;
+        if (options->cache == NULL || !lookup_result_cache(options->cache, cache_key, cell_list, &slot->threshold)) {
+            memcpy(arena->front, slot->grayscale, sizeof(slot->grayscale));
+            Pipeline_stats stats;
+            slot->threshold = run_pipeline(pipeline, arena, cell_list, NULL, &stats);
+            slot->deadline_expired = stats.deadline_expired;
+            slot->erosion_passes = stats.erosion_passes;
+            expired += stats.deadline_expired;
+            if (options->cache != NULL && !stats.deadline_expired) {
+                store_result_cache(options->cache, cache_key, cell_list, slot->threshold);
+            }
+        }
+        slot->cells = cell_list->cell_amount;
+        if (options->annotate) {
+            draw_points(slot->rgb, cell_list);
+        }
+        destroy_cell_list(cell_list);
+        compute_busy += now_seconds() - compute_started;
+        push_slot(&run.to_write, slot);
+    }
+    push_slot(&run.to_write, NULL);
+
+    pthread_join(reader, NULL);
+    pthread_join(writer, NULL);
+    const double elapsed = now_seconds() - started;
+
+    printf("Processed %d images in %.3f s (%.1f images/s) with %s I/O. Busy: reader %.0f%%, compute %.0f%%, "
+           "writer %.0f%%\n", input_amount, elapsed, elapsed > 0 ? input_amount / elapsed : 0,
+           run.read_io != NULL ? "io_uring" : "blocking", 100 * run.reader_busy / elapsed,
+           100 * compute_busy / elapsed, 100 * run.writer_busy / elapsed);
+    if (pipeline->config.deadline_ms > 0) {
+        printf("The %d ms deadline cut %d of %d images short\n", pipeline->config.deadline_ms, expired,
+               input_amount - run.read_errors);
+    }
+    if (run.read_errors > 0 || run.write_errors > 0) {
+        fprintf(stderr, "%d inputs could not be read and %d outputs could not be written\n", run.read_errors,
+                run.write_errors);
+    }
+
+    destroy_batch_run(&run, arena, slots);
+    return run.read_errors > 0 || run.write_errors > 0 ? 1 : 0;
+}
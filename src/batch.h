@@ -0,0 +1,51 @@
+#ifndef CELL_DETECTION_BATCH_H
+#define CELL_DETECTION_BATCH_H
+
+#include <stdbool.h>
+
+#include "batch_io.h"
+#include "cbmp.h"
+#include "pipeline.h"
+#include "result_cache.h"
+
+// How a batch run overlaps reading, computing and writing
+typedef struct {
+    // Capacity of each queue between two stages
+    int queue_depth;
+    // Image buffers shared by all stages. Reading stalls when all of them are in flight,
+    // so this bounds the memory of the run.
+    int buffer_count;
+    // Write the input with the detected cells marked
+    bool annotate;
+    // Cache the compute stage looks images up in before running the pipeline, or NULL
+    Result_cache* cache;
+    // Falls back to blocking I/O if io_uring is unavailable
+    Io_backend io_backend;
+    // With io_uring: files read ahead of the reader and written behind the writer
+    int io_depth;
+    // Drop the inputs from the page cache before the run, to measure reads from the disk
+    bool cold_cache;
+} Batch_options;
+
+/**
+ * @brief Processes many images with a reader, a compute and a writer thread connected by bounded queues,
+ * so image N + 1 is decoded while image N is eroded and image N - 1 is encoded.
+ *
+ * With the io_uring backend the reader keeps io_depth reads of upcoming images in flight and decodes them from
+ * its ring's buffers, and the writer encodes into its own ring's buffers and lets io_depth writes run behind it.
+ *
+ * Only the reader thread reads bitmaps and only the writer thread writes them. The first image read becomes
+ * the write template in cbmp and reaches the writer through the queues, so the two never race on it.
+ * Debug images are not written, since they would be written from the compute thread.
+ *
+ * @param pipeline The pipeline to run on every image.
+ * @param options The queue depth, buffer count and annotation setting.
+ * @param output_directory The directory the outputs are written to, under the input file names.
+ * @param input_paths The images to process.
+ * @param input_amount The number of images.
+ * @return 0 on success, 1 if the run could not be set up or a file could not be read or written.
+ */
+int run_batch(const Pipeline* pipeline, const Batch_options* options, const char* output_directory,
+              char** input_paths, int input_amount);
+
+#endif // CELL_DETECTION_BATCH_H
@@ -0,0 +1,400 @@
+#include "batch_io.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+
+#define REQUEST_PATH_SIZE 256
+
+void evict_from_page_cache(const char* path) {
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0) return;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+bool read_bitmap_file(const char* path, unsigned char* file_bytes,
+                      unsigned char output_grayscale[BMP_WIDTH][BMP_HEIGHT],
+                      unsigned char output_image_array[BMP_WIDTH][BMP_HEIGHT][BMP_CHANNELS]) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    const size_t size = fread(file_bytes, 1, BATCH_IO_BUFFER_SIZE, file);
+    const bool whole = !ferror(file) && fgetc(file) == EOF;
+    fclose(file);
+    if (!whole) {
+        fprintf(stderr, "Failed to read %s, or it is larger than the %d byte I/O buffers\n", path,
+                BATCH_IO_BUFFER_SIZE);
+        return false;
+    }
+    return decode_bitmap_grayscale(file_bytes, (unsigned int)size, output_grayscale, output_image_array);
+}
+
+bool write_bitmap_file(const char* path, unsigned char input_image_array[BMP_WIDTH][BMP_HEIGHT][BMP_CHANNELS],
+                       unsigned char* file_bytes) {
+    const unsigned int size = encode_bitmap(input_image_array, file_bytes, BATCH_IO_BUFFER_SIZE);
+    if (size == 0) {
+        fprintf(stderr, "The bitmap for %s is larger than the %d byte I/O buffers\n", path, BATCH_IO_BUFFER_SIZE);
+        return false;
+    }
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    const bool written = fwrite(file_bytes, 1, size, file) == size;
+    // Buffered data is only flushed by fclose, so its result counts too
+    if (fclose(file) != 0 || !written) {
+        fprintf(stderr, "Failed to write %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+#ifdef HAVE_IO_URING
+
+// The file transfer going on in one buffer
+typedef struct {
+    char path[REQUEST_PATH_SIZE];
+    int fd;
+    bool writing;
+    // Submitted and not yet complete
+    bool pending;
+    bool failed;
+    size_t size;
+    size_t done;
+} Uring_request;
+
+struct Uring_io {
+    int ring_fd;
+    // Shared with the kernel: the submission ring indexes into sqes, the completion ring holds cqes
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    struct io_uring_sqe* sqes;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+
+    unsigned char* buffers;
+    int buffer_amount;
+    // Registered buffers are pinned once, instead of on every transfer
+    bool registered;
+    Uring_request* requests;
+};
+
+static int io_uring_setup(const unsigned entries, struct io_uring_params* params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(const int ring_fd, const unsigned to_submit, const unsigned min_complete,
+                          const unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int io_uring_register(const int ring_fd, const unsigned opcode, const void* arguments,
+                             const unsigned argument_amount) {
+    return (int)syscall(__NR_io_uring_register, ring_fd, opcode, arguments, argument_amount);
+}
+
+static bool map_rings(Uring_io* io, const struct io_uring_params* params) {
+    io->sq_ring_size = params->sq_off.array + params->sq_entries * sizeof(unsigned);
+    io->cq_ring_size = params->cq_off.cqes + params->cq_entries * sizeof(struct io_uring_cqe);
+    // Newer kernels map both rings at once
+    const bool single_mmap = (params->features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_mmap) {
+        if (io->cq_ring_size > io->sq_ring_size) io->sq_ring_size = io->cq_ring_size;
+        io->cq_ring_size = io->sq_ring_size;
+    }
+
+    io->sq_ring = mmap(NULL, io->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, io->ring_fd,
+                       IORING_OFF_SQ_RING);
+    if (io->sq_ring == MAP_FAILED) return false;
+    if (single_mmap) {
+        io->cq_ring = io->sq_ring;
+    } else {
+        io->cq_ring = mmap(NULL, io->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, io->ring_fd,
+                           IORING_OFF_CQ_RING);
+        if (io->cq_ring == MAP_FAILED) {
+            munmap(io->sq_ring, io->sq_ring_size);
+            return false;
+        }
+    }
+    io->sqes_size = params->sq_entries * sizeof(struct io_uring_sqe);
+    io->sqes = mmap(NULL, io->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, io->ring_fd,
+                    IORING_OFF_SQES);
+    if (io->sqes == MAP_FAILED) {
+        if (io->cq_ring != io->sq_ring) munmap(io->cq_ring, io->cq_ring_size);
+        munmap(io->sq_ring, io->sq_ring_size);
+        return false;
+    }
+
+    unsigned char* sq = io->sq_ring;
+    unsigned char* cq = io->cq_ring;
+    io->sq_head = (unsigned*)(sq + params->sq_off.head);
+    io->sq_tail = (unsigned*)(sq + params->sq_off.tail);
+    io->sq_mask = (unsigned*)(sq + params->sq_off.ring_mask);
+    io->sq_array = (unsigned*)(sq + params->sq_off.array);
+    io->cq_head = (unsigned*)(cq + params->cq_off.head);
+    io->cq_tail = (unsigned*)(cq + params->cq_off.tail);
+    io->cq_mask = (unsigned*)(cq + params->cq_off.ring_mask);
+    io->cqes = (struct io_uring_cqe*)(cq + params->cq_off.cqes);
+    return true;
+}
+
+Uring_io* create_uring_io(const int buffer_amount) {
+    Uring_io* io = calloc(1, sizeof(Uring_io));
+    if (io == NULL) {
+        fprintf(stderr, "Failed to allocate the io_uring state\n");
+        return NULL;
+    }
+    io->buffer_amount = buffer_amount;
+    io->requests = calloc(buffer_amount, sizeof(Uring_request));
+    io->buffers = aligned_alloc(4096, (size_t)buffer_amount * BATCH_IO_BUFFER_SIZE);
+    if (io->requests == NULL || io->buffers == NULL) {
+        fprintf(stderr, "Failed to allocate %d I/O buffers\n", buffer_amount);
+        free(io->buffers);
+        free(io->requests);
+        free(io);
+        return NULL;
+    }
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    // Every buffer has at most one request in flight, so the rings never fill up
+    io->ring_fd = io_uring_setup(buffer_amount, &params);
+    if (io->ring_fd < 0 || !map_rings(io, &params)) {
+        fprintf(stderr, "io_uring is unavailable: %s\n", strerror(errno));
+        if (io->ring_fd >= 0) close(io->ring_fd);
+        free(io->buffers);
+        free(io->requests);
+        free(io);
+        return NULL;
+    }
+
+    struct iovec* iovecs = malloc(sizeof(struct iovec) * buffer_amount);
+    if (iovecs != NULL) {
+        for (int i = 0; i < buffer_amount; i++) {
+            iovecs[i].iov_base = uring_io_buffer(io, i);
+            iovecs[i].iov_len = BATCH_IO_BUFFER_SIZE;
+        }
+        // Pinning counts against the locked memory limit, plain reads and writes work without it
+        io->registered = io_uring_register(io->ring_fd, IORING_REGISTER_BUFFERS, iovecs, buffer_amount) == 0;
+        free(iovecs);
+    }
+    for (int i = 0; i < buffer_amount; i++) {
+        io->requests[i].fd = -1;
+    }
+    return io;
+}
+
+void destroy_uring_io(Uring_io* io) {
+    if (io == NULL) return;
+    munmap(io->sqes, io->sqes_size);
+    if (io->cq_ring != io->sq_ring) munmap(io->cq_ring, io->cq_ring_size);
+    munmap(io->sq_ring, io->sq_ring_size);
+    // Closing the ring also unregisters the buffers
+    close(io->ring_fd);
+    for (int i = 0; i < io->buffer_amount; i++) {
+        if (io->requests[i].fd >= 0) close(io->requests[i].fd);
+    }
+    free(io->buffers);
+    free(io->requests);
+    free(io);
+}
+
+unsigned char* uring_io_buffer(Uring_io* io, const int buffer) {
+    return io->buffers + (size_t)buffer * BATCH_IO_BUFFER_SIZE;
+}
+
+/**
+ * @brief Queues the rest of a buffer's transfer and hands it to the kernel.
+ */
+static bool submit_request(Uring_io* io, const int buffer) {
+    Uring_request* request = &io->requests[buffer];
+    const unsigned tail = *io->sq_tail;
+    const unsigned index = tail & *io->sq_mask;
+    struct io_uring_sqe* sqe = &io->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    if (io->registered) {
+        sqe->opcode = request->writing ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+        sqe->buf_index = buffer;
+    } else {
+        sqe->opcode = request->writing ? IORING_OP_WRITE : IORING_OP_READ;
+    }
+    sqe->fd = request->fd;
+    sqe->off = request->done;
+    sqe->addr = (unsigned long)(uring_io_buffer(io, buffer) + request->done);
+    sqe->len = (unsigned)(request->size - request->done);
+    sqe->user_data = buffer;
+    io->sq_array[index] = index;
+    // The kernel must see the entry before the new tail
+    __atomic_store_n(io->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    if (io_uring_enter(io->ring_fd, 1, 0, 0) < 0) {
+        fprintf(stderr, "Failed to submit I/O for %s: %s\n", request->path, strerror(errno));
+        return false;
+    }
+    request->pending = true;
+    return true;
+}
+
+static void finish_request(Uring_request* request, const bool failed) {
+    request->pending = false;
+    request->failed = failed;
+    if (request->fd >= 0) {
+        close(request->fd);
+        request->fd = -1;
+    }
+}
+
+static bool start_request(Uring_io* io, const int buffer, const char* path, const int fd, const bool writing,
+                          const size_t size) {
+    Uring_request* request = &io->requests[buffer];
+    snprintf(request->path, sizeof(request->path), "%s", path);
+    request->fd = fd;
+    request->writing = writing;
+    request->size = size;
+    request->done = 0;
+    request->pending = false;
+    request->failed = fd < 0;
+    if (request->failed) {
+        fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    if (size == 0) {
+        finish_request(request, false);
+        return true;
+    }
+    if (!submit_request(io, buffer)) {
+        finish_request(request, true);
+        return false;
+    }
+    return true;
+}
+
+bool submit_uring_read(Uring_io* io, const int buffer, const char* path) {
+    const int fd = open(path, O_RDONLY);
+    struct stat status;
+    if (fd >= 0 && (fstat(fd, &status) != 0 || status.st_size > BATCH_IO_BUFFER_SIZE)) {
+        fprintf(stderr, "%s is larger than the %d byte I/O buffers\n", path, BATCH_IO_BUFFER_SIZE);
+        close(fd);
+        start_request(io, buffer, path, -1, false, 0);
+        return false;
+    }
+    return start_request(io, buffer, path, fd, false, fd >= 0 ? (size_t)status.st_size : 0);
+}
+
+bool submit_uring_write(Uring_io* io, const int buffer, const char* path, const size_t size) {
+    const int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    return start_request(io, buffer, path, fd, true, size);
+}
+
+/**
+ * @brief Takes one completion off the ring, waiting for it if there is none yet.
+ */
+static bool reap_completion(Uring_io* io) {
+    unsigned head = *io->cq_head;
+    while (head == __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE)) {
+        if (io_uring_enter(io->ring_fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+            fprintf(stderr, "Failed to wait for I/O: %s\n", strerror(errno));
+            return false;
+        }
+    }
+    const struct io_uring_cqe* cqe = &io->cqes[head & *io->cq_mask];
+    const int buffer = (int)cqe->user_data;
+    const int result = cqe->res;
+    __atomic_store_n(io->cq_head, head + 1, __ATOMIC_RELEASE);
+
+    Uring_request* request = &io->requests[buffer];
+    if (result < 0 || (result == 0 && !request->writing)) {
+        fprintf(stderr, "Error %s %s: %s\n", request->writing ? "writing" : "reading", request->path,
+                result < 0 ? strerror(-result) : "the file ended early");
+        finish_request(request, true);
+        return true;
+    }
+    request->done += result;
+    if (request->done < request->size) {
+        // Short transfer, the rest goes in another request
+        if (!submit_request(io, buffer)) finish_request(request, true);
+    } else {
+        finish_request(request, false);
+    }
+    return true;
+}
+
+long wait_uring_buffer(Uring_io* io, const int buffer) {
+    Uring_request* request = &io->requests[buffer];
+    while (request->pending) {
+        if (!reap_completion(io)) return -1;
+    }
+    return request->failed ? -1 : (long)request->done;
+}
+
+#else
+
+Uring_io* create_uring_io(const int buffer_amount) {
+    (void)buffer_amount;
+    fprintf(stderr, "io_uring is unavailable on this platform\n");
+    return NULL;
+}
+
+void destroy_uring_io(Uring_io* io) {
+    (void)io;
+}
+
+unsigned char* uring_io_buffer(Uring_io* io, const int buffer) {
+    (void)io;
+    (void)buffer;
+    return NULL;
+}
+
+bool submit_uring_read(Uring_io* io, const int buffer, const char* path) {
+    (void)io;
+    (void)buffer;
+    (void)path;
+    return false;
+}
+
+bool submit_uring_write(Uring_io* io, const int buffer, const char* path, const size_t size) {
+    (void)io;
+    (void)buffer;
+    (void)path;
+    (void)size;
+    return false;
+}
+
+long wait_uring_buffer(Uring_io* io, const int buffer) {
+    (void)io;
+    (void)buffer;
+    return -1;
+}
+
+#endif
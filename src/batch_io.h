@@ -0,0 +1,105 @@
+#ifndef CELL_DETECTION_BATCH_IO_H
+#define CELL_DETECTION_BATCH_IO_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "cbmp.h"
+
+// Size of every I/O buffer, enough for a 950x950 bitmap at 32 bits
+#define BATCH_IO_BUFFER_SIZE (4 * 1024 * 1024)
+
+// How batch mode reads its inputs and writes its outputs
+typedef enum {
+    // fopen, fread and fwrite through cbmp, one file at a time
+    IO_BACKEND_BLOCKING,
+    // Reads and writes submitted to io_uring, several files in flight
+    IO_BACKEND_URING
+} Io_backend;
+
+// An io_uring ring with one file request per buffer. The ring is used from a single thread.
+typedef struct Uring_io Uring_io;
+
+/**
+ * @brief Sets up a ring with its buffers, registered with the kernel when the locked memory limit allows.
+ * Prints why and returns NULL if io_uring is unavailable, so the caller can fall back to blocking I/O.
+ *
+ * @param buffer_amount The number of buffers, which is the number of requests in flight at most.
+ * @return The ring, or NULL.
+ */
+Uring_io* create_uring_io(int buffer_amount);
+
+/**
+ * @brief Closes the ring and frees its buffers. Requests still in flight must have been waited for.
+ */
+void destroy_uring_io(Uring_io* io);
+
+/**
+ * @brief Returns one of the ring's buffers, which holds BATCH_IO_BUFFER_SIZE bytes.
+ */
+unsigned char* uring_io_buffer(Uring_io* io, int buffer);
+
+/**
+ * @brief Opens a file and submits a read of all of it into a buffer that has no request in flight.
+ *
+ * @param io The ring.
+ * @param buffer The buffer to read into.
+ * @param path The file to read.
+ * @return False if the file could not be opened or is larger than a buffer. wait_uring_buffer then fails too.
+ */
+bool submit_uring_read(Uring_io* io, int buffer, const char* path);
+
+/**
+ * @brief Creates a file and submits a write of the first size bytes of a buffer that has no request in flight.
+ *
+ * @param io The ring.
+ * @param buffer The buffer to write.
+ * @param path The file to create or truncate.
+ * @param size The number of bytes to write.
+ * @return False if the file could not be created. wait_uring_buffer then fails too.
+ */
+bool submit_uring_write(Uring_io* io, int buffer, const char* path, size_t size);
+
+/**
+ * @brief Waits until the request on a buffer is complete, handling the completions of the others meanwhile.
+ * Short transfers are resubmitted for the rest, and the file is closed once it is done.
+ *
+ * @param io The ring.
+ * @param buffer The buffer to wait for.
+ * @return The number of bytes transferred, or -1 if the request failed.
+ */
+long wait_uring_buffer(Uring_io* io, int buffer);
+
+/**
+ * @brief Asks the kernel to drop a file's cached pages, so the next read of it comes from the disk.
+ * Dirty pages and pages of files mapped elsewhere stay cached.
+ */
+void evict_from_page_cache(const char* path);
+
+/**
+ * @brief Reads a whole bitmap file with blocking I/O and decodes it, like read_bitmap_grayscale, but reports
+ * a missing, oversized or invalid file instead of exiting.
+ *
+ * @param path The file to read.
+ * @param file_bytes A buffer of BATCH_IO_BUFFER_SIZE bytes the file is read into.
+ * @param output_grayscale The decoded grayscale image.
+ * @param output_image_array The decoded RGB image, or NULL.
+ * @return True if the file was read and decoded, false otherwise.
+ */
+bool read_bitmap_file(const char* path, unsigned char* file_bytes,
+                      unsigned char output_grayscale[BMP_WIDTH][BMP_HEIGHT],
+                      unsigned char output_image_array[BMP_WIDTH][BMP_HEIGHT][BMP_CHANNELS]);
+
+/**
+ * @brief Encodes an RGB image like write_bitmap and writes it with blocking I/O, but reports a file that
+ * could not be created or written instead of crashing.
+ *
+ * @param path The file to write.
+ * @param input_image_array The RGB image to encode.
+ * @param file_bytes A buffer of BATCH_IO_BUFFER_SIZE bytes the file is encoded into.
+ * @return True if the whole file was written, false otherwise.
+ */
+bool write_bitmap_file(const char* path, unsigned char input_image_array[BMP_WIDTH][BMP_HEIGHT][BMP_CHANNELS],
+                       unsigned char* file_bytes);
+
+#endif // CELL_DETECTION_BATCH_IO_H
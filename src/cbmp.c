@@ -4,6 +4,7 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include "cbmp.h"
 
 // Constants
@@ -27,6 +28,16 @@
 #define DEPTH_BYTES 2
 #define DEPTH_OFFSET 28
 
+#define FILE_SIZE_BYTES 4
+#define FILE_SIZE_OFFSET 2
+
+// The file header, and the end of the info header fields read above
+#define FILE_HEADER_BYTES 14
+#define INFO_HEADER_END 54
+
+// Larger sizes in a streamed header are taken as a corrupt stream rather than allocated
+#define MAX_STREAMED_BYTES (64 * 1024 * 1024)
+
 
 // Pixel structure
 typedef struct pixel_data
@@ -56,6 +67,7 @@ BMP* out_bmp = NULL;
 
 // Private (ex-public) function declarations
 BMP* bopen(const char* file_path);
+BMP* bopen_header(const char* file_path);
 BMP* b_deep_copy(const BMP* to_copy);
 int get_width(const BMP* bmp);
 int get_height(const BMP* bmp);
@@ -64,6 +76,7 @@ void get_pixel_rgb(const BMP* bmp, int x, int y, unsigned char* r, unsigned char
 void set_pixel_rgb(const BMP* bmp, int x, int y, unsigned char r, unsigned char g, unsigned char b);
 void bwrite(BMP* bmp, const char* file_name);
 void bclose(BMP* bmp);
+unsigned char* get_pixel_bytes(const BMP* bmp, int x, int y);
 
 // Private function declarations
 void _throw_error(char* message);
@@ -75,6 +88,7 @@ unsigned char* _get_file_byte_contents(FILE* fp, unsigned int file_byte_number);
 int _validate_file_type(const unsigned char* file_byte_contents);
 int _validate_depth(unsigned int depth);
 unsigned int _get_pixel_array_start(const unsigned char* file_byte_contents);
+bool _pixel_array_fits(const BMP* bmp);
 int _get_width(const unsigned char* file_byte_contents);
 int _get_height(const unsigned char* file_byte_contents);
 unsigned int _get_depth(const unsigned char* file_byte_contents);
@@ -82,58 +96,124 @@ void _update_file_byte_contents(BMP* bmp, int index, int offset, int channel);
 void _populate_pixel_array(BMP* bmp);
 void _map(BMP* bmp, void (*f)(BMP* bmp, int, int, int));
 void _get_pixel(BMP* bmp, int index, int offset, int channel);
+BMP* _open_for_reading(const char* file_path);
+BMP* _read_from_stream(FILE* stream, int* status);
+bool _parse_header(BMP* bmp);
+void _encode_rgb(const BMP* bmp, unsigned char input_image_array[BMP_WIDTH][BMP_HEIGHT][BMP_CHANNELS]);
+void _decode_scanlines(const BMP* bmp, unsigned char grayscale[BMP_WIDTH][BMP_HEIGHT],
+                       unsigned char rgb[BMP_WIDTH][BMP_HEIGHT][BMP_CHANNELS]);
 
 // Public function implementations
 void read_bitmap(char * input_file_path, unsigned char output_image_array[BMP_WIDTH][BMP_HEIGHT][BMP_CHANNELS]){
-  // Read image into BMP struct
-  BMP* in_bmp = bopen(input_file_path);
-  const int width = get_width(in_bmp);
-  const int height = get_height(in_bmp);
-  if (width != BMP_WIDTH || height != BMP_HEIGHT) {
-    _throw_error("Invalid bitmap width and/or height. Must be 950x950 pixels.");
+  BMP* in_bmp = _open_for_reading(input_file_path);
+  _decode_scanlines(in_bmp, NULL, output_image_array);
+  if (in_bmp != out_bmp) {
+    bclose(in_bmp);
   }
-  if (out_bmp==NULL) {
-    out_bmp = b_deep_copy(in_bmp);
+}
+
+void read_bitmap_grayscale(char * input_file_path, unsigned char output_grayscale[BMP_WIDTH][BMP_HEIGHT],
+                           unsigned char output_image_array[BMP_WIDTH][BMP_HEIGHT][BMP_CHANNELS]){
+  BMP* in_bmp = _open_for_reading(input_file_path);
+  _decode_scanlines(in_bmp, output_grayscale, output_image_array);
+  if (in_bmp != out_bmp) {
+    bclose(in_bmp);
   }
-  // Convert to RGB array
-  unsigned char r;
-  unsigned char g;
-  unsigned char b;
-  for (int x = 0; x < BMP_WIDTH; x++)
-  {
-      for (int y = 0; y < BMP_HEIGHT; y++)
-      {
-          get_pixel_rgb(in_bmp, x, y, &r, &g, &b);
-          output_image_array[x][BMP_HEIGHT-1-y][0] = r;
-          output_image_array[x][BMP_HEIGHT-1-y][1] = g;
-          output_image_array[x][BMP_HEIGHT-1-y][2] = b;
-      }
+}
+
+int read_bitmap_stream(FILE* stream, unsigned char output_grayscale[BMP_WIDTH][BMP_HEIGHT],
+                       unsigned char output_image_array[BMP_WIDTH][BMP_HEIGHT][BMP_CHANNELS]){
+  int status;
+  BMP* in_bmp = _read_from_stream(stream, &status);
+  if (in_bmp == NULL) {
+    return status;
   }
-  bclose(in_bmp);
+  _decode_scanlines(in_bmp, output_grayscale, output_image_array);
+  if (in_bmp != out_bmp) {
+    bclose(in_bmp);
+  }
+  return 1;
+}
+
+bool decode_bitmap_grayscale(const unsigned char* file_bytes, const unsigned int file_size,
+                             unsigned char output_grayscale[BMP_WIDTH][BMP_HEIGHT],
+                             unsigned char output_image_array[BMP_WIDTH][BMP_HEIGHT][BMP_CHANNELS]){
+  // The bytes belong to the caller, so the bitmap only borrows them
+  BMP bmp;
+  bmp.file_byte_number = file_size;
+  bmp.file_byte_contents = (unsigned char*) file_bytes;
+  bmp.pixels = NULL;
+  if (!_parse_header(&bmp)) {
+    return false;
+  }
+  _decode_scanlines(&bmp, output_grayscale, output_image_array);
+  if (out_bmp == NULL) {
+    out_bmp = b_deep_copy(&bmp);
+  }
+  return true;
 }
 
 void write_bitmap(unsigned char input_image_array[BMP_WIDTH][BMP_HEIGHT][BMP_CHANNELS], char * output_file_path){
   if (out_bmp == NULL) {
     _throw_error("The function 'read_bitmap' must be called at least once before calling the function 'write_bitmap'.");
   }
-  unsigned char r;
-  unsigned char g;
-  unsigned char b;
+  _encode_rgb(out_bmp, input_image_array);
+  bwrite(out_bmp, output_file_path);
+}
+
+void write_bitmap_grayscale(unsigned char input_image_array[BMP_WIDTH][BMP_HEIGHT], char * output_file_path){
+  if (out_bmp == NULL) {
+    _throw_error("The function 'read_bitmap' must be called at least once before calling the function 'write_bitmap_grayscale'.");
+  }
   for (int x = 0; x < BMP_WIDTH; x++)
   {
     for (int y = 0; y < BMP_HEIGHT; y++)
     {
-      r = input_image_array[x][BMP_HEIGHT-1-y][0];
-      g = input_image_array[x][BMP_HEIGHT-1-y][1];
-      b = input_image_array[x][BMP_HEIGHT-1-y][2];
-      set_pixel_rgb(out_bmp, x, y, r, g, b);
+      unsigned char* bytes = get_pixel_bytes(out_bmp, x, y);
+      const unsigned char value = input_image_array[x][BMP_HEIGHT-1-y];
+      bytes[RED] = value;
+      bytes[GREEN] = value;
+      bytes[BLUE] = value;
     }
   }
   bwrite(out_bmp, output_file_path);
 }
 
+unsigned int encode_bitmap(unsigned char input_image_array[BMP_WIDTH][BMP_HEIGHT][BMP_CHANNELS],
+                           unsigned char* file_bytes, const unsigned int capacity){
+  if (out_bmp == NULL) {
+    _throw_error("The function 'read_bitmap' must be called at least once before calling the function 'encode_bitmap'.");
+  }
+  if (out_bmp->file_byte_number > capacity) {
+    return 0;
+  }
+  // The template's headers and row padding, then the pixels
+  memcpy(file_bytes, out_bmp->file_byte_contents, out_bmp->file_byte_number);
+  BMP target = *out_bmp;
+  target.file_byte_contents = file_bytes;
+  _encode_rgb(&target, input_image_array);
+  return out_bmp->file_byte_number;
+}
+
+bool write_bitmap_stream(unsigned char input_image_array[BMP_WIDTH][BMP_HEIGHT][BMP_CHANNELS], FILE* stream){
+  if (out_bmp == NULL) {
+    _throw_error("The function 'read_bitmap' must be called at least once before calling the function 'write_bitmap_stream'.");
+  }
+  _encode_rgb(out_bmp, input_image_array);
+  const size_t written = fwrite(out_bmp->file_byte_contents, sizeof(char), out_bmp->file_byte_number, stream);
+  return fflush(stream) == 0 && written == out_bmp->file_byte_number;
+}
+
 // Private (ex-public) function declarations
 BMP* bopen(const char* file_path)
+{
+    BMP* bmp = bopen_header(file_path);
+    _populate_pixel_array(bmp);
+    return bmp;
+}
+
+// Reads the file and its header, without decoding the pixel array
+BMP* bopen_header(const char* file_path)
 {
     FILE* fp = fopen(file_path, "rb");
 
@@ -148,7 +228,7 @@ BMP* bopen(const char* file_path)
     bmp->file_byte_contents = _get_file_byte_contents(fp, bmp->file_byte_number);
     fclose(fp);
 
-    if(!_validate_file_type(bmp->file_byte_contents))
+    if(bmp->file_byte_number < INFO_HEADER_END || !_validate_file_type(bmp->file_byte_contents))
     {
         _throw_error("Invalid file type");
     }
@@ -168,7 +248,12 @@ BMP* bopen(const char* file_path)
         _throw_error("Invalid file depth");
     }
 
-    _populate_pixel_array(bmp);
+    if (!_pixel_array_fits(bmp))
+    {
+        _throw_error("The pixel array is truncated");
+    }
+
+    bmp->pixels = NULL;
 
     return bmp;
 }
@@ -183,27 +268,10 @@ BMP* b_deep_copy(const BMP* to_copy)
     copy->depth = to_copy->depth;
 
     copy->file_byte_contents = (unsigned char*) malloc(copy->file_byte_number * sizeof(unsigned char));
+    memcpy(copy->file_byte_contents, to_copy->file_byte_contents, copy->file_byte_number);
 
-    unsigned int i;
-    for (i = 0; i < copy->file_byte_number; i++)
-    {
-        copy->file_byte_contents[i] = to_copy->file_byte_contents[i];
-    }
-
-    copy->pixels = (pixel*) malloc(copy->width * copy->height * sizeof(pixel));
-
-    unsigned int x, y;
-    for (y = 0; y < copy->height; y++)
-    {
-        for (x = 0; x < copy->width; x++)
-        {
-            const int index = y * copy->width + x;
-            copy->pixels[index].red = to_copy->pixels[index].red;
-            copy->pixels[index].green = to_copy->pixels[index].green;
-            copy->pixels[index].blue = to_copy->pixels[index].blue;
-            copy->pixels[index].alpha = to_copy->pixels[index].alpha;
-        }
-    }
+    // The copy is only written through get_pixel_bytes, so it needs no decoded pixel array
+    copy->pixels = NULL;
 
     return copy;
 }
@@ -239,9 +307,20 @@ void set_pixel_rgb(const BMP* bmp, const int x, const int y, const unsigned char
     bmp->pixels[index].blue = b;
 }
 
+unsigned char* get_pixel_bytes(const BMP* bmp, const int x, const int y)
+{
+    const int channels = bmp->depth / (sizeof(unsigned char) * BITS_PER_BYTE);
+    const int row_size = ((int) (bmp->depth * bmp->width + 31) / 32) * 4;
+    return bmp->file_byte_contents + bmp->pixel_array_start + y * row_size + x * channels;
+}
+
 void bwrite(BMP* bmp, const char* file_name)
 {
-    _map(bmp, _update_file_byte_contents);
+    // Bitmaps with a decoded pixel array are encoded first, the others are already up to date
+    if (bmp->pixels != NULL)
+    {
+        _map(bmp, _update_file_byte_contents);
+    }
 
     FILE* fp = fopen(file_name, "wb");
     fwrite(bmp->file_byte_contents, sizeof(char), bmp->file_byte_number, fp);
@@ -322,6 +401,19 @@ unsigned int _get_pixel_array_start(const unsigned char* file_byte_contents)
     return _get_int_from_buffer(PIXEL_ARRAY_START_BYTES, PIXEL_ARRAY_START_OFFSET, file_byte_contents);
 }
 
+// Checks that the pixel array lies inside the file. The offset comes from the file, so it is bounded
+// before the size is compared against what follows it, and neither sum can wrap around.
+bool _pixel_array_fits(const BMP* bmp)
+{
+    if (bmp->pixel_array_start < INFO_HEADER_END || bmp->pixel_array_start > bmp->file_byte_number)
+    {
+        return false;
+    }
+    const unsigned long long row_size = ((bmp->depth * (unsigned long long) bmp->width + 31) / 32) * 4;
+    const unsigned long long available = bmp->file_byte_number - bmp->pixel_array_start;
+    return bmp->height == 0 || row_size <= available / bmp->height;
+}
+
 int _get_width(const unsigned char* file_byte_contents)
 {
     return (int) _get_int_from_buffer(WIDTH_BYTES, WIDTH_OFFSET, file_byte_contents);
@@ -412,3 +504,197 @@ void _get_pixel(BMP* bmp, int index, int offset, int channel)
             break;
     }
 }
+
+BMP* _open_for_reading(const char* file_path)
+{
+    BMP* bmp = bopen_header(file_path);
+    if (get_width(bmp) != BMP_WIDTH || get_height(bmp) != BMP_HEIGHT) {
+        _throw_error("Invalid bitmap width and/or height. Must be 950x950 pixels.");
+    }
+    if (out_bmp == NULL) {
+        // The first bitmap read becomes the template for writing, written pixels are encoded straight into it
+        out_bmp = bmp;
+    }
+    return bmp;
+}
+
+// Reads exactly size bytes, returns false if the stream ends first
+static bool _read_exactly(FILE* stream, unsigned char* buffer, const unsigned int size)
+{
+    return fread(buffer, 1, size, stream) == size;
+}
+
+// Reads one bitmap from a stream in two steps, since only the headers tell how long it is: the file header and
+// the info header up to the pixel array, then the rest. Sets status to 0 at the end of the stream, -1 on errors.
+BMP* _read_from_stream(FILE* stream, int* status)
+{
+    unsigned char file_header[FILE_HEADER_BYTES];
+    const size_t header_read = fread(file_header, 1, FILE_HEADER_BYTES, stream);
+    *status = -1;
+    if (header_read == 0 && feof(stream))
+    {
+        *status = 0;
+        return NULL;
+    }
+    if (header_read != FILE_HEADER_BYTES || !_validate_file_type(file_header))
+    {
+        fprintf(stderr, "The stream does not continue with a bitmap file header\n");
+        return NULL;
+    }
+
+    const unsigned int declared_size = _get_int_from_buffer(FILE_SIZE_BYTES, FILE_SIZE_OFFSET, file_header);
+    const unsigned int pixel_array_start = _get_pixel_array_start(file_header);
+    if (pixel_array_start < INFO_HEADER_END || pixel_array_start > MAX_STREAMED_BYTES)
+    {
+        fprintf(stderr, "Invalid pixel array offset %u in the streamed bitmap\n", pixel_array_start);
+        return NULL;
+    }
+
+    unsigned char* contents = (unsigned char*) malloc(pixel_array_start);
+    if (contents == NULL)
+    {
+        fprintf(stderr, "Failed to allocate the streamed bitmap\n");
+        return NULL;
+    }
+    memcpy(contents, file_header, FILE_HEADER_BYTES);
+    if (!_read_exactly(stream, contents + FILE_HEADER_BYTES, pixel_array_start - FILE_HEADER_BYTES))
+    {
+        fprintf(stderr, "The stream ends inside a bitmap header\n");
+        free(contents);
+        return NULL;
+    }
+
+    const int width = _get_width(contents);
+    const int height = _get_height(contents);
+    const unsigned int depth = _get_depth(contents);
+    if (!_validate_depth(depth) || width != BMP_WIDTH || height != BMP_HEIGHT)
+    {
+        fprintf(stderr, "Invalid streamed bitmap: %dx%d pixels at %u bits. Must be 950x950 pixels at 24 or 32 bits.\n",
+                width, height, depth);
+        free(contents);
+        return NULL;
+    }
+
+    // Writers may leave the file size at 0, and any bytes it declares past the pixel array are consumed
+    // too, so the next bitmap starts where this one's file ends
+    const unsigned int row_size = ((depth * width + 31) / 32) * 4;
+    const unsigned int needed_size = pixel_array_start + row_size * height;
+    const unsigned int file_size = declared_size > needed_size ? declared_size : needed_size;
+    if (file_size > MAX_STREAMED_BYTES)
+    {
+        fprintf(stderr, "Invalid file size %u in the streamed bitmap\n", declared_size);
+        free(contents);
+        return NULL;
+    }
+    unsigned char* grown = (unsigned char*) realloc(contents, file_size);
+    if (grown == NULL)
+    {
+        fprintf(stderr, "Failed to allocate the streamed bitmap\n");
+        free(contents);
+        return NULL;
+    }
+    contents = grown;
+    if (!_read_exactly(stream, contents + pixel_array_start, file_size - pixel_array_start))
+    {
+        fprintf(stderr, "The stream ends inside a bitmap pixel array\n");
+        free(contents);
+        return NULL;
+    }
+
+    BMP* bmp = (BMP*) malloc(sizeof(BMP));
+    bmp->file_byte_number = file_size;
+    bmp->file_byte_contents = contents;
+    bmp->pixel_array_start = pixel_array_start;
+    bmp->width = width;
+    bmp->height = height;
+    bmp->depth = depth;
+    bmp->pixels = NULL;
+    if (out_bmp == NULL) {
+        out_bmp = bmp;
+    }
+    *status = 1;
+    return bmp;
+}
+
+// Validates the headers of a bitmap read into memory and fills in its fields, without exiting on errors
+bool _parse_header(BMP* bmp)
+{
+    if (bmp->file_byte_number < INFO_HEADER_END || !_validate_file_type(bmp->file_byte_contents))
+    {
+        fprintf(stderr, "Invalid file type\n");
+        return false;
+    }
+    bmp->pixel_array_start = _get_pixel_array_start(bmp->file_byte_contents);
+    bmp->width = _get_width(bmp->file_byte_contents);
+    bmp->height = _get_height(bmp->file_byte_contents);
+    bmp->depth = _get_depth(bmp->file_byte_contents);
+    if (!_validate_depth(bmp->depth) || bmp->width != BMP_WIDTH || bmp->height != BMP_HEIGHT)
+    {
+        fprintf(stderr, "Invalid bitmap: %ux%u pixels at %u bits. Must be 950x950 pixels at 24 or 32 bits.\n",
+                bmp->width, bmp->height, bmp->depth);
+        return false;
+    }
+    if (!_pixel_array_fits(bmp))
+    {
+        fprintf(stderr, "The pixel array is truncated\n");
+        return false;
+    }
+    return true;
+}
+
+// Encodes an RGB image into the bytes of a bitmap
+void _encode_rgb(const BMP* bmp, unsigned char input_image_array[BMP_WIDTH][BMP_HEIGHT][BMP_CHANNELS])
+{
+    for (int x = 0; x < BMP_WIDTH; x++)
+    {
+        for (int y = 0; y < BMP_HEIGHT; y++)
+        {
+            unsigned char* bytes = get_pixel_bytes(bmp, x, y);
+            bytes[RED] = input_image_array[x][BMP_HEIGHT-1-y][0];
+            bytes[GREEN] = input_image_array[x][BMP_HEIGHT-1-y][1];
+            bytes[BLUE] = input_image_array[x][BMP_HEIGHT-1-y][2];
+        }
+    }
+}
+
+// Decodes rows straight from the file bytes. Inlined per depth so the channel count is a constant.
+static inline __attribute__((always_inline)) void _decode_rows(const BMP* bmp,
+                                                               unsigned char grayscale[BMP_WIDTH][BMP_HEIGHT],
+                                                               unsigned char rgb[BMP_WIDTH][BMP_HEIGHT][BMP_CHANNELS],
+                                                               const int channels)
+{
+    const int row_size = ((int) (bmp->depth * bmp->width + 31) / 32) * 4;
+    for (int y = 0; y < BMP_HEIGHT; y++)
+    {
+        // Rows are stored bottom-up
+        const unsigned char* row = bmp->file_byte_contents + bmp->pixel_array_start + y * row_size;
+        const int image_y = BMP_HEIGHT - 1 - y;
+        for (int x = 0; x < BMP_WIDTH; x++)
+        {
+            const unsigned char* bytes = row + x * channels;
+            if (grayscale != NULL)
+            {
+                grayscale[x][image_y] = (bytes[RED] + bytes[GREEN] + bytes[BLUE]) / 3;
+            }
+            if (rgb != NULL)
+            {
+                rgb[x][image_y][0] = bytes[RED];
+                rgb[x][image_y][1] = bytes[GREEN];
+                rgb[x][image_y][2] = bytes[BLUE];
+            }
+        }
+    }
+}
+
+void _decode_scanlines(const BMP* bmp, unsigned char grayscale[BMP_WIDTH][BMP_HEIGHT],
+                       unsigned char rgb[BMP_WIDTH][BMP_HEIGHT][BMP_CHANNELS])
+{
+    if (bmp->depth == 32)
+    {
+        _decode_rows(bmp, grayscale, rgb, 4);
+    }
+    else
+    {
+        _decode_rows(bmp, grayscale, rgb, 3);
+    }
+}
@@ -1,6 +1,9 @@
 #ifndef OS_CHALLENGE_CBMP_H
 #define OS_CHALLENGE_CBMP_H
 
+#include <stdbool.h>
+#include <stdio.h>
+
 // Image dimensions
 #define BMP_WIDTH 950
 #define BMP_HEIGHT 950
@@ -9,8 +12,34 @@
 // Function to read a bitmap file
 void read_bitmap(char* input_file_path, unsigned char output_image_array[BMP_WIDTH][BMP_HEIGHT][BMP_CHANNELS]);
 
+// Function to read a bitmap file straight into a grayscale image, the RGB copy is only filled if it is not NULL
+void read_bitmap_grayscale(char* input_file_path, unsigned char output_grayscale[BMP_WIDTH][BMP_HEIGHT],
+                           unsigned char output_image_array[BMP_WIDTH][BMP_HEIGHT][BMP_CHANNELS]);
+
+// Function to read the next bitmap of a stream of concatenated bitmap files, without seeking, so it can be a pipe.
+// Returns 1 if a bitmap was read, 0 at the end of the stream and -1 if the stream does not continue with a valid bitmap.
+int read_bitmap_stream(FILE* stream, unsigned char output_grayscale[BMP_WIDTH][BMP_HEIGHT],
+                       unsigned char output_image_array[BMP_WIDTH][BMP_HEIGHT][BMP_CHANNELS]);
+
+// Function to decode a bitmap file already read into memory, like read_bitmap_grayscale. The first bitmap decoded
+// is copied to become the template for writing. Returns false if the bytes are not a valid bitmap.
+bool decode_bitmap_grayscale(const unsigned char* file_bytes, unsigned int file_size,
+                             unsigned char output_grayscale[BMP_WIDTH][BMP_HEIGHT],
+                             unsigned char output_image_array[BMP_WIDTH][BMP_HEIGHT][BMP_CHANNELS]);
+
 // Function to write a bitmap file
 void write_bitmap(unsigned char input_image_array[BMP_WIDTH][BMP_HEIGHT][BMP_CHANNELS], char* output_file_path);
 
+// Function to write a grayscale image as a bitmap file, without an RGB copy
+void write_bitmap_grayscale(unsigned char input_image_array[BMP_WIDTH][BMP_HEIGHT], char* output_file_path);
+
+// Function to encode a bitmap file into memory instead of writing it, with the bytes write_bitmap would write.
+// Returns the file size, or 0 if it does not fit into the buffer.
+unsigned int encode_bitmap(unsigned char input_image_array[BMP_WIDTH][BMP_HEIGHT][BMP_CHANNELS],
+                           unsigned char* file_bytes, unsigned int capacity);
+
+// Function to write a bitmap to a stream and flush it, returns false if the stream could not be written
+bool write_bitmap_stream(unsigned char input_image_array[BMP_WIDTH][BMP_HEIGHT][BMP_CHANNELS], FILE* stream);
+
 
 #endif //OS_CHALLENGE_CBMP_H
\ No newline at end of file
@@ -0,0 +1,208 @@
+#include "denoise.h"
+
+#include <math.h>
+#include <string.h>
+
+// Window histogram of the median filter. The coarse bins are kept current for every pixel, each segment of
+// 16 fine bins only when the median falls into it, catching up from the pixel it was last current for.
+typedef struct {
+    unsigned short coarse[COARSE_BINS];
+    unsigned short fine[COARSE_BINS][HISTOGRAM_BINS / COARSE_BINS];
+    int current_at[COARSE_BINS];
+} Median_window;
+
+static inline int clamp_index(const int index, const int size) {
+    return index < 0 ? 0 : (index >= size ? size - 1 : index);
+}
+
+/**
+ * @brief Adds the coarse bins of one strip to the window and removes those of another.
+ */
+static inline void slide_coarse(Median_window* restrict window, const Histogram* restrict added,
+                                const Histogram* restrict removed) {
+    for (int i = 0; i < COARSE_BINS; i++) {
+        window->coarse[i] += added->coarse[i] - removed->coarse[i];
+    }
+}
+
+/**
+ * @brief Adds the fine bins of one coarse bin of a strip to the window and removes those of another.
+ * The 16 bins are independent, so this is a couple of vector operations.
+ */
+static inline void slide_fine(unsigned short* restrict segment, const unsigned short* restrict added,
+                              const unsigned short* restrict removed) {
+    for (int i = 0; i < HISTOGRAM_BINS / COARSE_BINS; i++) {
+        segment[i] += added[i] - removed[i];
+    }
+}
+
+/**
+ * @brief Brings the fine bins of a coarse bin up to date for the window centred on y.
+ */
+static void update_fine_segment(Median_window* window, const Histogram* strips, const int bin, const int y,
+                                const int radius) {
+    const int first = bin << COARSE_SHIFT;
+    unsigned short* segment = window->fine[bin];
+    int at = window->current_at[bin];
+
+    // Catching up costs two strips per pixel, rebuilding one per window line
+    if (at < 0 || y - at > radius + 1) {
+        memset(segment, 0, sizeof(window->fine[bin]));
+        for (int j = -radius; j <= radius; j++) {
+            const unsigned short* strip = &strips[clamp_index(y + j, BMP_HEIGHT)].fine[first];
+            for (int i = 0; i < HISTOGRAM_BINS / COARSE_BINS; i++) {
+                segment[i] += strip[i];
+            }
+        }
+    } else {
+        for (at++; at <= y; at++) {
+            slide_fine(segment, &strips[clamp_index(at + radius, BMP_HEIGHT)].fine[first],
+                       &strips[clamp_index(at - radius - 1, BMP_HEIGHT)].fine[first]);
+        }
+    }
+    window->current_at[bin] = y;
+}
+
+/**
+ * @brief Returns the gray level of the pixel with the given rank, counting from 0, in the window centred on y.
+ * On real images the median stays in the same bins for long stretches, so the scans stop early.
+ */
+static inline unsigned char window_rank(Median_window* window, const Histogram* strips, const int rank,
+                                        const int y, const int radius) {
+    int seen = 0;
+    int bin = 0;
+    while (seen + window->coarse[bin] <= rank) {
+        seen += window->coarse[bin++];
+    }
+    update_fine_segment(window, strips, bin, y, radius);
+    const unsigned short* segment = window->fine[bin];
+    int value = 0;
+    while (seen + segment[value] <= rank) {
+        seen += segment[value++];
+    }
+    return (unsigned char)((bin << COARSE_SHIFT) + value);
+}
+
+void median_filter_into(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT],
+                        unsigned char output_image[BMP_WIDTH][BMP_HEIGHT], const int radius,
+                        Denoise_buffers* buffers) {
+    // One histogram per y over the lines x - radius to x + radius
+    Histogram* strips = buffers->strips;
+    memset(strips, 0, sizeof(buffers->strips));
+    const int size = 2 * radius + 1;
+    const int median_rank = size * size / 2;
+
+    for (int i = -radius; i <= radius; i++) {
+        const unsigned char* line = input_image[clamp_index(i, BMP_WIDTH)];
+        for (int y = 0; y < BMP_HEIGHT; y++) {
+            strips[y].fine[line[y]]++;
+            strips[y].coarse[line[y] >> COARSE_SHIFT]++;
+        }
+    }
+
+    Median_window window;
+    for (int x = 0; x < BMP_WIDTH; x++) {
+        if (x > 0) {
+            const unsigned char* removed = input_image[clamp_index(x - radius - 1, BMP_WIDTH)];
+            const unsigned char* added = input_image[clamp_index(x + radius, BMP_WIDTH)];
+            for (int y = 0; y < BMP_HEIGHT; y++) {
+                strips[y].fine[removed[y]]--;
+                strips[y].coarse[removed[y] >> COARSE_SHIFT]--;
+                strips[y].fine[added[y]]++;
+                strips[y].coarse[added[y] >> COARSE_SHIFT]++;
+            }
+        }
+
+        memset(window.coarse, 0, sizeof(window.coarse));
+        for (int j = -radius; j <= radius; j++) {
+            const Histogram* strip = &strips[clamp_index(j, BMP_HEIGHT)];
+            for (int i = 0; i < COARSE_BINS; i++) {
+                window.coarse[i] += strip->coarse[i];
+            }
+        }
+        for (int i = 0; i < COARSE_BINS; i++) {
+            window.current_at[i] = -1;
+        }
+        for (int y = 0; y < BMP_HEIGHT; y++) {
+            output_image[x][y] = window_rank(&window, strips, median_rank, y, radius);
+            slide_coarse(&window, &strips[clamp_index(y + radius + 1, BMP_HEIGHT)],
+                         &strips[clamp_index(y - radius, BMP_HEIGHT)]);
+        }
+    }
+}
+
+/**
+ * @brief Box mean of the given radius, as a running sum across lines followed by one along each line.
+ * The first pass adds and removes whole lines, which vectorizes; the second is one add and remove per pixel.
+ */
+static void box_mean(float input[BMP_WIDTH][BMP_HEIGHT], float output[BMP_WIDTH][BMP_HEIGHT],
+                     float line[BMP_HEIGHT], const int radius) {
+    const float scale = 1.0f / (float)((2 * radius + 1) * (2 * radius + 1));
+
+    float* restrict sums = line;
+    memset(sums, 0, sizeof(float) * BMP_HEIGHT);
+    for (int i = -radius; i <= radius; i++) {
+        const float* restrict source = input[clamp_index(i, BMP_WIDTH)];
+        for (int y = 0; y < BMP_HEIGHT; y++) {
+            sums[y] += source[y];
+        }
+    }
+    for (int x = 0; x < BMP_WIDTH; x++) {
+        const float* restrict added = input[clamp_index(x + radius + 1, BMP_WIDTH)];
+        const float* restrict removed = input[clamp_index(x - radius, BMP_WIDTH)];
+        float* restrict target = output[x];
+        for (int y = 0; y < BMP_HEIGHT; y++) {
+            target[y] = sums[y];
+            sums[y] += added[y] - removed[y];
+        }
+    }
+
+    for (int x = 0; x < BMP_WIDTH; x++) {
+        memcpy(line, output[x], sizeof(float) * BMP_HEIGHT);
+        float sum = 0;
+        for (int j = -radius; j <= radius; j++) {
+            sum += line[clamp_index(j, BMP_HEIGHT)];
+        }
+        for (int y = 0; y < BMP_HEIGHT; y++) {
+            output[x][y] = sum * scale;
+            sum += line[clamp_index(y + radius + 1, BMP_HEIGHT)] - line[clamp_index(y - radius, BMP_HEIGHT)];
+        }
+    }
+}
+
+void guided_filter_into(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT],
+                        unsigned char output_image[BMP_WIDTH][BMP_HEIGHT], const int radius, const int epsilon,
+                        Denoise_buffers* buffers) {
+    Guided_planes* planes = &buffers->guided;
+
+    // a and b hold the input and its square until their box means are taken
+    for (int x = 0; x < BMP_WIDTH; x++) {
+        for (int y = 0; y < BMP_HEIGHT; y++) {
+            const float value = input_image[x][y];
+            planes->a[x][y] = value;
+            planes->b[x][y] = value * value;
+        }
+    }
+    box_mean(planes->a, planes->mean, planes->line, radius);
+    box_mean(planes->b, planes->mean_square, planes->line, radius);
+
+    for (int x = 0; x < BMP_WIDTH; x++) {
+        for (int y = 0; y < BMP_HEIGHT; y++) {
+            const float mean = planes->mean[x][y];
+            // Running sums can leave a flat window a hair below zero
+            const float variance = fmaxf(planes->mean_square[x][y] - mean * mean, 0.0f);
+            const float a = variance / (variance + (float)epsilon);
+            planes->a[x][y] = a;
+            planes->b[x][y] = mean - a * mean;
+        }
+    }
+    box_mean(planes->a, planes->mean, planes->line, radius);
+    box_mean(planes->b, planes->mean_square, planes->line, radius);
+
+    for (int x = 0; x < BMP_WIDTH; x++) {
+        for (int y = 0; y < BMP_HEIGHT; y++) {
+            const float value = planes->mean[x][y] * input_image[x][y] + planes->mean_square[x][y] + 0.5f;
+            output_image[x][y] = (unsigned char)(value < 0 ? 0 : (value > 255 ? 255 : value));
+        }
+    }
+}
@@ -0,0 +1,68 @@
+#ifndef CELL_DETECTION_DENOISE_H
+#define CELL_DETECTION_DENOISE_H
+
+#include "cbmp.h"
+
+// Largest radius the denoise filters accept, which keeps the window counts in 16 bits
+#define DENOISE_MAX_RADIUS 20
+
+#define HISTOGRAM_BINS 256
+// The median search first finds the coarse bin of 16 gray levels, then the level inside it
+#define COARSE_SHIFT 4
+#define COARSE_BINS (HISTOGRAM_BINS >> COARSE_SHIFT)
+
+// Pixel counts per gray level, at full and at coarse resolution
+typedef struct {
+    unsigned short fine[HISTOGRAM_BINS];
+    unsigned short coarse[COARSE_BINS];
+} Histogram;
+
+// Planes of the guided filter. mean and mean_square hold the box means of I and I * I, then those of a and b.
+typedef struct {
+    float mean[BMP_WIDTH][BMP_HEIGHT];
+    float mean_square[BMP_WIDTH][BMP_HEIGHT];
+    float a[BMP_WIDTH][BMP_HEIGHT];
+    float b[BMP_WIDTH][BMP_HEIGHT];
+    float line[BMP_HEIGHT];
+} Guided_planes;
+
+// Scratch memory of the denoise filters, allocated together with the pipeline's arena
+typedef struct {
+    // One histogram per y of the median filter
+    Histogram strips[BMP_HEIGHT];
+    Guided_planes guided;
+} Denoise_buffers;
+
+/**
+ * @brief Replaces every pixel by the median of the square window of the given radius around it.
+ *
+ * The window histogram slides along the line with one add and one remove of a line histogram per pixel,
+ * and each line histogram moves to the next line the same way, so the cost per pixel does not depend on
+ * the radius. Pixels past the edge repeat the nearest edge pixel.
+ *
+ * @param input_image The grayscale image to filter.
+ * @param output_image Receives the filtered image.
+ * @param radius The window radius, from 1 to DENOISE_MAX_RADIUS.
+ * @param buffers Scratch memory for the histograms.
+ */
+void median_filter_into(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT],
+                        unsigned char output_image[BMP_WIDTH][BMP_HEIGHT], int radius, Denoise_buffers* buffers);
+
+/**
+ * @brief Edge-preserving smoothing with the image as its own guide (He et al., guided image filter).
+ *
+ * Each window fits output = a * input + b. Flat windows, with a variance well below epsilon, are averaged,
+ * while windows across an edge keep it. Everything is built from box means computed with running sums,
+ * so the cost per pixel does not depend on the radius either. Pixels past the edge repeat the nearest edge pixel.
+ *
+ * @param input_image The grayscale image to filter.
+ * @param output_image Receives the filtered image.
+ * @param radius The window radius, from 1 to DENOISE_MAX_RADIUS.
+ * @param epsilon The variance, in squared gray levels, below which a window is smoothed out.
+ * @param buffers Scratch memory for the planes.
+ */
+void guided_filter_into(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT],
+                        unsigned char output_image[BMP_WIDTH][BMP_HEIGHT], int radius, int epsilon,
+                        Denoise_buffers* buffers);
+
+#endif // CELL_DETECTION_DENOISE_H
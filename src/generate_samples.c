@@ -0,0 +1,341 @@
+// Synthesizes cell images of any size together with the true cell positions.
+// The images look like the bundled samples: bright, soft-edged cells on a dark noisy background.
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FILENAME_BUFFER_SIZE 256
+#define PLACEMENT_ATTEMPTS 200
+
+// Everything that shapes a generated image
+typedef struct {
+    int width;
+    int height;
+    int cells;
+    double radius_mean;
+    double radius_spread;
+    // Fraction of the cells placed touching an earlier cell instead of on their own
+    double cluster_fraction;
+    // Standard deviation of the gaussian noise, in gray levels
+    double noise;
+    int background;
+    int count;
+    unsigned long long seed;
+    const char* prefix;
+} Generator_options;
+
+typedef struct {
+    double x;
+    double y;
+    double radius;
+    int brightness;
+} Synthetic_cell;
+
+// xorshift64*, so the same seed gives the same images on every platform
+static uint64_t next_random(uint64_t* state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ULL;
+}
+
+static double random_uniform(uint64_t* state) {
+    return (next_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static double random_gaussian(uint64_t* state) {
+    // Box-Muller, with the first uniform kept away from zero
+    const double u = 1.0 - random_uniform(state);
+    const double v = random_uniform(state);
+    return sqrt(-2.0 * log(u)) * cos(2.0 * M_PI * v);
+}
+
+static void print_usage(const char* program) {
+    printf("Usage: %s [options] <output_prefix>\n", program);
+    printf("Writes <output_prefix>_N.bmp and the true cell centres in <output_prefix>_N_truth.csv\n");
+    printf("Options:\n");
+    printf("  --width <n>             Image width (950)\n");
+    printf("  --height <n>            Image height (950)\n");
+    printf("  --cells <n>             Cells per image (300)\n");
+    printf("  --radius <r>            Mean cell radius in pixels (7)\n");
+    printf("  --radius-spread <r>     Standard deviation of the cell radius (1.5)\n");
+    printf("  --cluster <fraction>    Fraction of cells touching another cell (0.1)\n");
+    printf("  --noise <sigma>         Gaussian noise in gray levels (8)\n");
+    printf("  --background <level>    Background gray level (40)\n");
+    printf("  --count <n>             Number of images (1)\n");
+    printf("  --seed <n>              Random seed (1)\n");
+}
+
+static bool parse_options(int argc, char** argv, Generator_options* options) {
+    options->width = 950;
+    options->height = 950;
+    options->cells = 300;
+    options->radius_mean = 7;
+    options->radius_spread = 1.5;
+    options->cluster_fraction = 0.1;
+    options->noise = 8;
+    options->background = 40;
+    options->count = 1;
+    options->seed = 1;
+    options->prefix = NULL;
+
+    int arg = 1;
+    for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++) {
+        const char* name = argv[arg] + 2;
+        if (arg + 1 >= argc) {
+            fprintf(stderr, "Missing value for %s\n", argv[arg]);
+            return false;
+        }
+        const char* value = argv[++arg];
+
+        if (strcmp(name, "width") == 0) {
+            options->width = atoi(value);
+        } else if (strcmp(name, "height") == 0) {
+            options->height = atoi(value);
+        } else if (strcmp(name, "cells") == 0) {
+            options->cells = atoi(value);
+        } else if (strcmp(name, "radius") == 0) {
+            options->radius_mean = atof(value);
+        } else if (strcmp(name, "radius-spread") == 0) {
+            options->radius_spread = atof(value);
+        } else if (strcmp(name, "cluster") == 0) {
+            options->cluster_fraction = atof(value);
+        } else if (strcmp(name, "noise") == 0) {
+            options->noise = atof(value);
+        } else if (strcmp(name, "background") == 0) {
+            options->background = atoi(value);
+        } else if (strcmp(name, "count") == 0) {
+            options->count = atoi(value);
+        } else if (strcmp(name, "seed") == 0) {
+            options->seed = strtoull(value, NULL, 10);
+        } else {
+            fprintf(stderr, "Unknown option %s\n", argv[arg - 1]);
+            return false;
+        }
+    }
+    if (argc - arg != 1) {
+        return false;
+    }
+    options->prefix = argv[arg];
+
+    if (options->width < 1 || options->height < 1 || options->cells < 0 || options->radius_mean < 1 ||
+        options->count < 1) {
+        fprintf(stderr, "Width, height and radius must be at least 1 and the cell count not negative\n");
+        return false;
+    }
+    return true;
+}
+
+static bool overlaps(const Synthetic_cell* cells, const int amount, const double x, const double y,
+                     const double radius) {
+    for (int i = 0; i < amount; i++) {
+        const double dx = cells[i].x - x;
+        const double dy = cells[i].y - y;
+        const double gap = cells[i].radius + radius + 2;
+        if (dx * dx + dy * dy < gap * gap) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Places the cells. Clustered cells touch a random earlier cell, the others keep a gap to all cells.
+ * Cells that do not fit after a few attempts are dropped, so dense settings may yield fewer cells.
+ * @return The number of cells placed.
+ */
+static int place_cells(const Generator_options* options, uint64_t* random, Synthetic_cell* cells) {
+    int amount = 0;
+    for (int i = 0; i < options->cells; i++) {
+        double radius = options->radius_mean + options->radius_spread * random_gaussian(random);
+        if (radius < 1) radius = 1;
+        const bool clustered = amount > 0 && random_uniform(random) < options->cluster_fraction;
+
+        for (int attempt = 0; attempt < PLACEMENT_ATTEMPTS; attempt++) {
+            double x;
+            double y;
+            if (clustered) {
+                const Synthetic_cell* neighbour = &cells[(int)(random_uniform(random) * amount)];
+                const double angle = 2.0 * M_PI * random_uniform(random);
+                // Slightly closer than the two radii, so the cells merge into one blob
+                const double distance = 0.85 * (neighbour->radius + radius);
+                x = neighbour->x + distance * cos(angle);
+                y = neighbour->y + distance * sin(angle);
+            } else {
+                x = radius + random_uniform(random) * (options->width - 2 * radius);
+                y = radius + random_uniform(random) * (options->height - 2 * radius);
+                if (overlaps(cells, amount, x, y, radius)) continue;
+            }
+            if (x < radius || y < radius || x >= options->width - radius || y >= options->height - radius) continue;
+
+            cells[amount].x = x;
+            cells[amount].y = y;
+            cells[amount].radius = radius;
+            cells[amount].brightness = 190 + (int)(random_uniform(random) * 65);
+            amount++;
+            break;
+        }
+    }
+    return amount;
+}
+
+/**
+ * @brief Draws a cell into a float image indexed [x * height + y]. Overlapping cells keep the brighter value.
+ * The intensity falls off towards the edge and fades into the background over a couple of pixels.
+ */
+static void draw_cell(float* image, const Generator_options* options, const Synthetic_cell* cell) {
+    const double fade = 2.0;
+    const int x0 = (int)floor(cell->x - cell->radius - fade);
+    const int x1 = (int)ceil(cell->x + cell->radius + fade);
+    const int y0 = (int)floor(cell->y - cell->radius - fade);
+    const int y1 = (int)ceil(cell->y + cell->radius + fade);
+
+    for (int x = x0 < 0 ? 0 : x0; x <= x1 && x < options->width; x++) {
+        for (int y = y0 < 0 ? 0 : y0; y <= y1 && y < options->height; y++) {
+            const double dx = x - cell->x;
+            const double dy = y - cell->y;
+            const double distance = sqrt(dx * dx + dy * dy);
+            double value;
+            if (distance <= cell->radius) {
+                const double t = distance / cell->radius;
+                value = cell->brightness - 0.3 * (cell->brightness - options->background) * t * t;
+            } else if (distance <= cell->radius + fade) {
+                const double edge = cell->brightness - 0.3 * (cell->brightness - options->background);
+                const double t = (distance - cell->radius) / fade;
+                value = edge + (options->background - edge) * t;
+            } else {
+                continue;
+            }
+            float* pixel = &image[(long)x * options->height + y];
+            if (value > *pixel) {
+                *pixel = (float)value;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Writes a float image as a 24-bit gray bitmap.
+ * Image rows are top-down like the detector's y coordinate, bitmap rows are bottom-up.
+ */
+static bool write_gray_bitmap(const float* image, const int width, const int height, const char* path) {
+    const int row_size = (width * 3 + 3) / 4 * 4;
+    const unsigned int pixel_bytes = (unsigned int)row_size * height;
+    unsigned char header[54] = {0};
+
+    header[0] = 'B';
+    header[1] = 'M';
+    const unsigned int file_size = sizeof(header) + pixel_bytes;
+    const unsigned int values[][2] = {
+        {2, file_size}, {10, sizeof(header)}, {14, 40}, {18, (unsigned int)width}, {22, (unsigned int)height},
+        {34, pixel_bytes}, {38, 2835}, {42, 2835}
+    };
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+        for (int byte = 0; byte < 4; byte++) {
+            header[values[i][0] + byte] = (unsigned char)(values[i][1] >> (8 * byte));
+        }
+    }
+    header[26] = 1;
+    header[28] = 24;
+
+    FILE* fp = fopen(path, "wb");
+    if (fp == NULL) {
+        perror("Error opening output file");
+        return false;
+    }
+    unsigned char* row = calloc(row_size, 1);
+    if (row == NULL) {
+        fprintf(stderr, "Failed to allocate bitmap row\n");
+        fclose(fp);
+        return false;
+    }
+
+    bool written = fwrite(header, sizeof(header), 1, fp) == 1;
+    for (int file_row = 0; file_row < height && written; file_row++) {
+        const int y = height - 1 - file_row;
+        for (int x = 0; x < width; x++) {
+            const float value = image[(long)x * height + y];
+            const unsigned char gray = value < 0 ? 0 : (value > 255 ? 255 : (unsigned char)lrintf(value));
+            row[3 * x] = gray;
+            row[3 * x + 1] = gray;
+            row[3 * x + 2] = gray;
+        }
+        written = fwrite(row, row_size, 1, fp) == 1;
+    }
+    free(row);
+    if (fclose(fp) != 0 || !written) {
+        fprintf(stderr, "Failed to write %s\n", path);
+        return false;
+    }
+    return true;
+}
+
+static bool write_truth(const Synthetic_cell* cells, const int amount, const char* path) {
+    FILE* fp = fopen(path, "w");
+    if (fp == NULL) {
+        perror("Error opening truth file");
+        return false;
+    }
+    fprintf(fp, "x,y,radius\n");
+    for (int i = 0; i < amount; i++) {
+        fprintf(fp, "%d,%d,%.2f\n", (int)lround(cells[i].x), (int)lround(cells[i].y), cells[i].radius);
+    }
+    return fclose(fp) == 0;
+}
+
+int main(int argc, char** argv) {
+    Generator_options options;
+    if (!parse_options(argc, argv, &options)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    float* image = malloc(sizeof(float) * options.width * options.height);
+    Synthetic_cell* cells = malloc(sizeof(Synthetic_cell) * (options.cells > 0 ? options.cells : 1));
+    if (image == NULL || cells == NULL) {
+        fprintf(stderr, "Failed to allocate a %dx%d image\n", options.width, options.height);
+        free(image);
+        free(cells);
+        return 1;
+    }
+
+    // A zero state would stay zero forever
+    uint64_t random = options.seed * 0x9E3779B97F4A7C15ULL + 1;
+    int result = 0;
+    for (int index = 0; index < options.count && result == 0; index++) {
+        const int amount = place_cells(&options, &random, cells);
+
+        for (long i = 0; i < (long)options.width * options.height; i++) {
+            image[i] = (float)options.background;
+        }
+        for (int i = 0; i < amount; i++) {
+            draw_cell(image, &options, &cells[i]);
+        }
+        if (options.noise > 0) {
+            for (long i = 0; i < (long)options.width * options.height; i++) {
+                image[i] += (float)(options.noise * random_gaussian(&random));
+            }
+        }
+
+        char path[FILENAME_BUFFER_SIZE];
+        snprintf(path, sizeof(path), "%s_%d.bmp", options.prefix, index);
+        if (!write_gray_bitmap(image, options.width, options.height, path)) {
+            result = 1;
+            break;
+        }
+        snprintf(path, sizeof(path), "%s_%d_truth.csv", options.prefix, index);
+        if (!write_truth(cells, amount, path)) {
+            result = 1;
+            break;
+        }
+        printf("%s_%d: %dx%d, %d cells\n", options.prefix, index, options.width, options.height, amount);
+    }
+
+    free(cells);
+    free(image);
+    return result;
+}
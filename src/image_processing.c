@@ -7,9 +7,8 @@
 #include <string.h>
 #include <math.h>
 
-#ifndef BORDER
-#define BORDER 1
-#endif
+// Half the length of the cross draw_points marks a cell with
+#define MARKER_RADIUS 10
 
 /**
  * @brief Checks if a given coordinate is within the image boundaries.
@@ -40,14 +39,35 @@ void convert_to_RGB(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT], unsigned c
     }
 }
 
-void apply_convolution(unsigned char image[BMP_WIDTH][BMP_HEIGHT],
-                       const int* kernel, const int kernel_size) {
-    // A convolution kernel must have an odd size
-    if (kernel_size % 2 == 0) {
-        printf("Error: Kernel size must be odd.\n");
-        return;
-    }
+static const int gaussian_3x3_kernel[] = {
+    1, 2, 1,
+    2, 4, 2,
+    1, 2, 1
+};
+
+static const int gaussian_5x5_kernel[] = {
+    1,  4,  7,  4, 1,
+    4, 16, 26, 16, 4,
+    7, 26, 41, 26, 7,
+    4, 16, 26, 16, 4,
+    1,  4,  7,  4, 1
+};
+
+static const int sharpen_kernel[] = {
+    0, -1,  0,
+   -1,  5, -1,
+    0, -1,  0
+};
 
+/**
+ * @brief Convolution body shared by the generic and the fixed-size variants.
+ * Only the pixels from x0 to x1 and y0 to y1, which the kernel must fully cover, are written to the output.
+ * When kernel_size is a compile-time constant the kernel loops are fully unrolled.
+ */
+static inline __attribute__((always_inline)) void convolve(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT],
+                                                           unsigned char output_image[BMP_WIDTH][BMP_HEIGHT],
+                                                           const int* kernel, const int kernel_size,
+                                                           const int x0, const int x1, const int y0, const int y1) {
     // Calculate the radius from the kernel size
     const int radius = kernel_size / 2;
 
@@ -61,11 +81,9 @@ void apply_convolution(unsigned char image[BMP_WIDTH][BMP_HEIGHT],
         divisor = 1;
     }
 
-    unsigned char output_image[BMP_WIDTH][BMP_HEIGHT];
-
-    // Main loops now use the radius for border handling
-    for (int x = radius; x < BMP_WIDTH - radius; x++) {
-        for (int y = radius; y < BMP_HEIGHT - radius; y++) {
+    // The callers keep the range at least the radius away from the edges
+    for (int x = x0; x < x1; x++) {
+        for (int y = y0; y < y1; y++) {
             int sum = 0;
 
             // Kernel loops also use the radius
@@ -76,12 +94,75 @@ void apply_convolution(unsigned char image[BMP_WIDTH][BMP_HEIGHT],
                     const int kernel_col = j + radius;
                     const int kernel_index = kernel_row * kernel_size + kernel_col;
 
-                    sum += image[x + i][y + j] * kernel[kernel_index];
+                    sum += input_image[x + i][y + j] * kernel[kernel_index];
                 }
             }
             output_image[x][y] = (unsigned char)(sum / divisor);
         }
     }
+}
+
+/**
+ * @brief Convolves the inner pixels of a region, the ones a kernel of the given radius fully covers.
+ */
+static inline __attribute__((always_inline)) void convolve_region(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT],
+                                                                  unsigned char output_image[BMP_WIDTH][BMP_HEIGHT],
+                                                                  const int* kernel, const int kernel_size,
+                                                                  const Image_region* region) {
+    const int radius = kernel_size / 2;
+    const int x0 = region->x0 > radius ? region->x0 : radius;
+    const int x1 = region->x1 < BMP_WIDTH - radius ? region->x1 : BMP_WIDTH - radius;
+    const int y0 = region->y0 > radius ? region->y0 : radius;
+    const int y1 = region->y1 < BMP_HEIGHT - radius ? region->y1 : BMP_HEIGHT - radius;
+    convolve(input_image, output_image, kernel, kernel_size, x0, x1, y0, y1);
+}
+
+/**
+ * @brief Copies the part of a region a convolution of the given radius does not reach from the input to the output.
+ */
+static void copy_convolution_region_border(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT],
+                                           unsigned char output_image[BMP_WIDTH][BMP_HEIGHT], const int radius,
+                                           const Image_region* region) {
+    for (int x = region->x0; x < region->x1; x++) {
+        if (x < radius || x >= BMP_WIDTH - radius) {
+            memcpy(&output_image[x][region->y0], &input_image[x][region->y0], region->y1 - region->y0);
+            continue;
+        }
+        for (int y = region->y0; y < region->y1 && y < radius; y++) {
+            output_image[x][y] = input_image[x][y];
+        }
+        for (int y = region->y1 - 1; y >= region->y0 && y >= BMP_HEIGHT - radius; y--) {
+            output_image[x][y] = input_image[x][y];
+        }
+    }
+}
+
+/**
+ * @brief Copies the border a convolution of the given radius does not reach from the input to the output.
+ */
+static void copy_convolution_border(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT],
+                                    unsigned char output_image[BMP_WIDTH][BMP_HEIGHT], const int radius) {
+    for (int x = 0; x < BMP_WIDTH; x++) {
+        if (x < radius || x >= BMP_WIDTH - radius) {
+            memcpy(output_image[x], input_image[x], BMP_HEIGHT);
+        } else {
+            memcpy(output_image[x], input_image[x], radius);
+            memcpy(&output_image[x][BMP_HEIGHT - radius], &input_image[x][BMP_HEIGHT - radius], radius);
+        }
+    }
+}
+
+void apply_convolution(unsigned char image[BMP_WIDTH][BMP_HEIGHT],
+                       const int* kernel, const int kernel_size) {
+    // A convolution kernel must have an odd size
+    if (kernel_size % 2 == 0) {
+        printf("Error: Kernel size must be odd.\n");
+        return;
+    }
+    const int radius = kernel_size / 2;
+
+    unsigned char output_image[BMP_WIDTH][BMP_HEIGHT];
+    convolve(image, output_image, kernel, kernel_size, radius, BMP_WIDTH - radius, radius, BMP_HEIGHT - radius);
 
     // Copy the processed inner pixels back to the original image
     for (int x = radius; x < BMP_WIDTH - radius; x++) {
@@ -91,33 +172,72 @@ void apply_convolution(unsigned char image[BMP_WIDTH][BMP_HEIGHT],
     }
 }
 
+// Convolutions specialized for a fixed kernel size, writing the full output image or one region of it
+#define DEFINE_FIXED_CONVOLUTION(SIZE) \
+    static void apply_convolution_##SIZE##x##SIZE(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT], \
+                                                  unsigned char output_image[BMP_WIDTH][BMP_HEIGHT], \
+                                                  const int kernel[SIZE * SIZE]) { \
+        convolve(input_image, output_image, kernel, SIZE, SIZE / 2, BMP_WIDTH - SIZE / 2, SIZE / 2, \
+                 BMP_HEIGHT - SIZE / 2); \
+        copy_convolution_border(input_image, output_image, SIZE / 2); \
+    } \
+    static void apply_convolution_region_##SIZE##x##SIZE(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT], \
+                                                         unsigned char output_image[BMP_WIDTH][BMP_HEIGHT], \
+                                                         const int kernel[SIZE * SIZE], \
+                                                         const Image_region* region) { \
+        convolve_region(input_image, output_image, kernel, SIZE, region); \
+        copy_convolution_region_border(input_image, output_image, SIZE / 2, region); \
+    }
+
+DEFINE_FIXED_CONVOLUTION(3)
+DEFINE_FIXED_CONVOLUTION(5)
+
+void gaussian_blur_3x3_into(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT],
+                            unsigned char output_image[BMP_WIDTH][BMP_HEIGHT]) {
+    apply_convolution_3x3(input_image, output_image, gaussian_3x3_kernel);
+}
+
+void gaussian_blur_5x5_into(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT],
+                            unsigned char output_image[BMP_WIDTH][BMP_HEIGHT]) {
+    apply_convolution_5x5(input_image, output_image, gaussian_5x5_kernel);
+}
+
+void sharpen_image_into(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT],
+                        unsigned char output_image[BMP_WIDTH][BMP_HEIGHT]) {
+    apply_convolution_3x3(input_image, output_image, sharpen_kernel);
+}
+
+void gaussian_blur_3x3_region_into(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT],
+                                   unsigned char output_image[BMP_WIDTH][BMP_HEIGHT], const Image_region* region) {
+    apply_convolution_region_3x3(input_image, output_image, gaussian_3x3_kernel, region);
+}
+
+void gaussian_blur_5x5_region_into(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT],
+                                   unsigned char output_image[BMP_WIDTH][BMP_HEIGHT], const Image_region* region) {
+    apply_convolution_region_5x5(input_image, output_image, gaussian_5x5_kernel, region);
+}
+
+void sharpen_image_region_into(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT],
+                               unsigned char output_image[BMP_WIDTH][BMP_HEIGHT], const Image_region* region) {
+    apply_convolution_region_3x3(input_image, output_image, sharpen_kernel, region);
+}
+
 void gaussian_blur_3x3(unsigned char image[BMP_WIDTH][BMP_HEIGHT]) {
-    const int kernel[] = {
-        1, 2, 1,
-        2, 4, 2,
-        1, 2, 1
-    };
-    apply_convolution(image, kernel, 3);
+    unsigned char output_image[BMP_WIDTH][BMP_HEIGHT];
+    gaussian_blur_3x3_into(image, output_image);
+    memcpy(image, output_image, BMP_WIDTH * BMP_HEIGHT);
 }
 
 void gaussian_blur_5x5(unsigned char image[BMP_WIDTH][BMP_HEIGHT]) {
-    const int kernel[] = {
-        1,  4,  7,  4, 1,
-        4, 16, 26, 16, 4,
-        7, 26, 41, 26, 7,
-        4, 16, 26, 16, 4,
-        1,  4,  7,  4, 1
-    };
-    apply_convolution(image, kernel, 5);
+    unsigned char output_image[BMP_WIDTH][BMP_HEIGHT];
+    gaussian_blur_5x5_into(image, output_image);
+    memcpy(image, output_image, BMP_WIDTH * BMP_HEIGHT);
 }
 
 void sharpen_image(unsigned char image[BMP_WIDTH][BMP_HEIGHT]) {
-    const int kernel[] = {
-        0, -1,  0,
-       -1,  5, -1,
-        0, -1,  0
-   };
-    apply_convolution(image, kernel, 3);
+    unsigned char output_image[BMP_WIDTH][BMP_HEIGHT];
+    sharpen_image_into(image, output_image);
+    memcpy(image, output_image, BMP_WIDTH * BMP_HEIGHT);
 }
 
 unsigned char otsu_threshold_value(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT]) {
@@ -126,39 +246,70 @@ unsigned char otsu_threshold_value(unsigned char input_image[BMP_WIDTH][BMP_HEIG
     for (int i = 0; i < 256; ++i) {
         histogram[i] = 0;
     }
-    for (int x = 0; x < BMP_WIDTH; ++x) {
-        for (int y = 0; y < BMP_HEIGHT; ++y) {
-            histogram[input_image[x][y]]++;
+    const Image_region image = {0, BMP_WIDTH, 0, BMP_HEIGHT};
+    add_to_histogram(input_image, &image, histogram);
+    return otsu_threshold_from_histogram(histogram);
+}
+
+void add_to_histogram(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT], const Image_region* region,
+                      int histogram[256]) {
+    // Neighbouring pixels mostly share a gray level, so counting them into the same bin makes every increment
+    // wait for the previous one. Four partial histograms keep four increments independent.
+    int partial[4][256];
+    memset(partial, 0, sizeof(partial));
+    for (int x = region->x0; x < region->x1; ++x) {
+        const unsigned char* column = input_image[x];
+        int y = region->y0;
+        for (; y + 4 <= region->y1; y += 4) {
+            partial[0][column[y]]++;
+            partial[1][column[y + 1]]++;
+            partial[2][column[y + 2]]++;
+            partial[3][column[y + 3]]++;
+        }
+        for (; y < region->y1; ++y) {
+            partial[0][column[y]]++;
         }
     }
+    for (int i = 0; i < 256; ++i) {
+        histogram[i] += partial[0][i] + partial[1][i] + partial[2][i] + partial[3][i];
+    }
+}
+
+unsigned char otsu_threshold_from_histogram(const int histogram[256]) {
+    return otsu_threshold_with_separation(histogram, NULL);
+}
+
+unsigned char otsu_threshold_with_separation(const int histogram[256], int* separation) {
+    long long total = 0;
+    long long total_sum = 0;
+    for (int i = 0; i < 256; ++i) {
+        total += histogram[i];
+        total_sum += (long long)histogram[i] * i;
+    }
 
-    // Iterate over histogram and add the pixel values
+    // The background is everything up to the split, so running sums give both classes of every split in O(1)
     double best_otsu = 0;
     int best_split = 0;
-    const double total_pixels = BMP_WIDTH * BMP_HEIGHT;
+    double best_separation = 0;
+    const double total_pixels = (double)total;
+    long long b_sum = 0;
+    long long mu_b_sum = 0;
     for (int split = 0; split < 256; ++split) {
-        int b_sum = 0;
-        int mu_b_sum = 0;
-        int f_sum = 0;
-        int mu_f_sum = 0;
-
-        for (int value = 0; value < 256; ++value) {
-            if (value <= split) {
-                b_sum += histogram[value];
-                mu_b_sum += histogram[value] * value;
-            } else {
-                f_sum += histogram[value];
-                mu_f_sum += histogram[value] * value;
-            }
+        // An empty level leaves both classes, and so the variance, as they were at the split before
+        if (histogram[split] == 0) {
+            continue;
         }
-
-        const double W_b = (double)b_sum / total_pixels;
-        const double W_f = (double)f_sum / total_pixels;
+        b_sum += histogram[split];
+        mu_b_sum += (long long)histogram[split] * split;
+        const long long f_sum = total - b_sum;
+        const long long mu_f_sum = total_sum - mu_b_sum;
 
         if (b_sum == 0 || f_sum == 0) {
             continue;
         }
-        const double mu_b = (double)mu_b_sum / b_sum;;
+        const double W_b = (double)b_sum / total_pixels;
+        const double W_f = (double)f_sum / total_pixels;
+        const double mu_b = (double)mu_b_sum / b_sum;
         const double mu_f = (double)mu_f_sum / f_sum;
 
         const double otsu = W_b * W_f * (double)((mu_b - mu_f) * (mu_b - mu_f));
@@ -166,41 +317,70 @@ unsigned char otsu_threshold_value(unsigned char input_image[BMP_WIDTH][BMP_HEIG
         if (best_otsu < otsu) {
             best_otsu = otsu;
             best_split = split;
+            best_separation = mu_f - mu_b;
         }
     }
 
+    if (separation != NULL) {
+        *separation = (int)best_separation;
+    }
     return best_split;
 }
 
-void binary_threshold(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT], const int threshold) {
-    for (int x = 0; x < BMP_WIDTH; ++x) {
-        for (int y = 0; y < BMP_HEIGHT; ++y) {
-            input_image[x][y] = (input_image[x][y] > threshold) ? 255 : 0;
+void binary_threshold_region_into(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT],
+                                  unsigned char output_image[BMP_WIDTH][BMP_HEIGHT], const Image_region* region,
+                                  const int threshold) {
+    // The region is clipped to the inside of the black border, which is cleared separately
+    const int x0 = region->x0 > BORDER ? region->x0 : BORDER;
+    const int x1 = region->x1 < BMP_WIDTH - BORDER ? region->x1 : BMP_WIDTH - BORDER;
+    const int y0 = region->y0 > BORDER ? region->y0 : BORDER;
+    const int y1 = region->y1 < BMP_HEIGHT - BORDER ? region->y1 : BMP_HEIGHT - BORDER;
+    for (int x = region->x0; x < region->x1; ++x) {
+        if (x < x0 || x >= x1 || y0 >= y1) {
+            memset(&output_image[x][region->y0], 0, region->y1 - region->y0);
+            continue;
         }
+        memset(&output_image[x][region->y0], 0, y0 - region->y0);
+        for (int y = y0; y < y1; ++y) {
+            output_image[x][y] = (input_image[x][y] > threshold) ? 255 : 0;
+        }
+        memset(&output_image[x][y1], 0, region->y1 - y1);
     }
+}
 
-    if (BORDER > 0) {
-        const int bw = (BORDER < BMP_WIDTH)  ? BORDER : BMP_WIDTH;
-        const int bh = (BORDER < BMP_HEIGHT) ? BORDER : BMP_HEIGHT;
-
-        // top & bottom rows
-        for (int x = 0; x < BMP_WIDTH; ++x) {
-            for (int y = 0; y < bh; ++y) {
-                input_image[x][y] = 0;
-                input_image[x][BMP_HEIGHT - 1 - y] = 0;
-            }
+void binary_threshold(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT], const int threshold) {
+    const int bw = (BORDER < BMP_WIDTH)  ? BORDER : BMP_WIDTH;
+    const int bh = (BORDER < BMP_HEIGHT) ? BORDER : BMP_HEIGHT;
+    // Comparing bytes with a byte keeps sixteen pixels per vector, an int threshold widens them to four
+    const unsigned char level = threshold < 0 ? 0 : (threshold > 255 ? 255 : threshold);
+    const unsigned char at_level = threshold < 0 ? 255 : 0;
+    for (int x = 0; x < BMP_WIDTH; ++x) {
+        unsigned char* column = input_image[x];
+        if (x < bw || x >= BMP_WIDTH - bw) {
+            // left & right columns
+            memset(column, 0, BMP_HEIGHT);
+            continue;
         }
-        // left & right columns
         for (int y = 0; y < BMP_HEIGHT; ++y) {
-            for (int x = 0; x < bw; ++x) {
-                input_image[x][y] = 0;
-                input_image[BMP_WIDTH - 1 - x][y] = 0;
-            }
+            column[y] = (column[y] > level) ? 255 : at_level;
         }
+        // top & bottom rows, cleared while the column is still in cache
+        memset(column, 0, bh);
+        memset(&column[BMP_HEIGHT - bh], 0, bh);
     }
 }
 
-static bool should_pixel_erode(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT], const int x, const int y) {
+/**
+ * @brief Checks whether a white pixel has a black neighbour.
+ * binary_threshold leaves a black frame of BORDER pixels, so a white pixel is never on the edge and the frame
+ * acts as a guard band: all four neighbours can be read unchecked, and since the image only holds 0 and 255,
+ * their AND is zero exactly when one of them is black.
+ */
+static inline __attribute__((always_inline)) bool should_pixel_erode(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT],
+    const int x, const int y) {
+#if BORDER > 0
+    return (input_image[x-1][y] & input_image[x+1][y] & input_image[x][y-1] & input_image[x][y+1]) == 0;
+#else
     if (is_valid_coordinate(x-1, y) && input_image[x-1][y] == 0) {
         return true;
     }
@@ -214,6 +394,7 @@ static bool should_pixel_erode(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT],
         return true;
     }
     return false;
+#endif
 }
 
 bool erode_image(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT]) {
@@ -290,8 +471,9 @@ void destroy_cell_list(Cell_list* cell_list) {
     free(cell_list);
 }
 
-bool is_exclusion_frame_clear(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT], const int detection_area_size,
-    const int exclusion_frame_thickness, const int center_x, const int center_y) {
+static inline __attribute__((always_inline)) bool is_exclusion_frame_clear(
+    unsigned char input_image[BMP_WIDTH][BMP_HEIGHT], const int detection_area_size,
+    const int exclusion_frame_thickness, const int center_x, const int center_y, const bool checked) {
 
     for (int thickness = 0; thickness <= exclusion_frame_thickness; thickness++) {
         const int half_size = (detection_area_size / 2) + thickness;
@@ -304,7 +486,7 @@ bool is_exclusion_frame_clear(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT],
                     const int y = center_y + j;
 
                     // If the coordinate is valid AND the pixel is white, the frame is not clear.
-                    if (is_valid_coordinate(x, y) && input_image[x][y] == 255) {
+                    if ((!checked || is_valid_coordinate(x, y)) && input_image[x][y] == 255) {
                         return false;
                     }
                 }
@@ -315,15 +497,15 @@ bool is_exclusion_frame_clear(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT],
     return true;
 }
 
-static bool is_detection_area_active(unsigned char image[BMP_WIDTH][BMP_HEIGHT], const int detection_area_size,
-    const int center_x, const int center_y) {
+static inline __attribute__((always_inline)) bool is_detection_area_active(unsigned char image[BMP_WIDTH][BMP_HEIGHT],
+    const int detection_area_size, const int center_x, const int center_y, const bool checked) {
     const int half_size = detection_area_size / 2;
 
     for (int i = -half_size; i < half_size; i++) {
         for (int j = -half_size; j < half_size; j++) {
             const int x = center_x + i;
             const int y = center_y + j;
-            if (is_valid_coordinate(x, y) && image[x][y] == 255) {
+            if ((!checked || is_valid_coordinate(x, y)) && image[x][y] == 255) {
                 return true; // Found a white pixel!
             }
         }
@@ -331,78 +513,124 @@ static bool is_detection_area_active(unsigned char image[BMP_WIDTH][BMP_HEIGHT],
     return false; // No white pixels found.
 }
 
+/**
+ * @brief Clears the box [x0, x1) x [y0, y1), clipped to the image.
+ */
+static void clear_box(unsigned char image[BMP_WIDTH][BMP_HEIGHT], int x0, int x1, int y0, int y1) {
+    x0 = x0 > 0 ? x0 : 0;
+    y0 = y0 > 0 ? y0 : 0;
+    x1 = x1 < BMP_WIDTH ? x1 : BMP_WIDTH;
+    y1 = y1 < BMP_HEIGHT ? y1 : BMP_HEIGHT;
+    for (int x = x0; x < x1; x++) {
+        if (y1 > y0) memset(&image[x][y0], 0, y1 - y0);
+    }
+}
+
 static void clear_detection_area(unsigned char image[BMP_WIDTH][BMP_HEIGHT], const int detection_area_size,
     const int center_x, const int center_y) {
     const int half_size = detection_area_size / 2;
-    for (int i = -half_size; i < half_size; i++) {
-        for (int j = -half_size; j < half_size; j++) {
-            const int x = center_x + i;
-            const int y = center_y + j;
-            if (is_valid_coordinate(x, y)) {
-                image[x][y] = 0;
+    clear_box(image, center_x - half_size, center_x + half_size, center_y - half_size, center_y + half_size);
+}
+
+/**
+ * @brief The window test for one centre: a clear exclusion frame around an active detection area.
+ */
+static inline __attribute__((always_inline)) bool is_window_cell(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT],
+    const int detection_area_size, const int exclusion_frame_thickness, const int x, const int y, const bool checked) {
+    // The exclusion frame must be all black.
+    if (!is_exclusion_frame_clear(input_image, detection_area_size, exclusion_frame_thickness, x, y, checked)) {
+        return false;
+    }
+    // The inner detection area must contain at least one white pixel.
+    return input_image[x][y] || is_detection_area_active(input_image, detection_area_size, x, y, checked);
+}
+
+/**
+ * @brief Window detector body shared by the generic and the fixed-size variants.
+ * Centres whose outermost frame lies in the image are tested without bounds checks.
+ */
+static inline __attribute__((always_inline)) int detect_cells_window(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT],
+    const int detection_area_size, const int exclusion_frame_thickness, Cell_list *cell_list) {
+    const int margin = detection_area_size / 2 + exclusion_frame_thickness;
+    int cellsDetected = 0;
+    for (int x = 0; x < BMP_WIDTH; x++) {
+        const bool line_inside = x >= margin && x + margin <= BMP_WIDTH;
+        for (int y = 0; y < BMP_HEIGHT; y++) {
+            const bool inside = line_inside && y >= margin && y + margin <= BMP_HEIGHT;
+            if (inside ? is_window_cell(input_image, detection_area_size, exclusion_frame_thickness, x, y, false)
+                       : is_window_cell(input_image, detection_area_size, exclusion_frame_thickness, x, y, true)) {
+                // Store its coordinates
+                add_to_cell_list(cell_list, x, y);
+                cellsDetected++;
+
+                // Clear the area to prevent detecting the same cell again
+                clear_detection_area(input_image, detection_area_size, x, y);
             }
         }
     }
+    return cellsDetected;
 }
 
 void detect_cells(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT], const int detection_area_size,
     const int exclusion_frame_thickness, Cell_list *cell_list) {
-    for (int x = 0; x < BMP_WIDTH; x++) {
-        for (int y = 0; y < BMP_HEIGHT; y++) {
-            // The exclusion frame must be all black.
-            if (is_exclusion_frame_clear(input_image, detection_area_size, exclusion_frame_thickness, x, y)) {
-
-                // The inner detection area must contain at least one white pixel.
-                if (input_image[x][y] || is_detection_area_active(input_image, detection_area_size, x, y)) {
-                    // Store its coordinates
-                    add_to_cell_list(cell_list, x, y);
+    detect_cells_window(input_image, detection_area_size, exclusion_frame_thickness, cell_list);
+}
 
-                    // Clear the area to prevent detecting the same cell again
-                    clear_detection_area(input_image, detection_area_size, x, y);
-                }
+/**
+ * @brief Isolation test body shared by check_for_cell and the fixed-radius variants.
+ * The pixel is isolated if the square frames at frame_radius and frame_radius + 1 are black.
+ */
+static inline __attribute__((always_inline)) bool is_isolated(unsigned char inputImage[BMP_WIDTH][BMP_HEIGHT],
+    const int x, const int y, const int frame_radius, const bool checked) {
+    for (int r = frame_radius; r <= frame_radius + 1; ++r) {
+        for (int i = -r; i < r; ++i) {
+            if (((!checked || is_valid_coordinate(x + i,y - r)) && inputImage[x + i][y - r]) ||
+                ((!checked || is_valid_coordinate(x + i,y + r)) && inputImage[x + i][y + r])) {
+                return false;
+            }
+            if (((!checked || is_valid_coordinate(x - r,y + i)) && inputImage[x - r][y + i]) ||
+                ((!checked || is_valid_coordinate(x + r,y + i)) && inputImage[x + r][y + i])) {
+                return false;
             }
         }
     }
+    return true;
 }
 
 char check_for_cell(unsigned char inputImage[BMP_WIDTH][BMP_HEIGHT], const int x, const int y) {
-    for (int i = -6; i < 6; ++i) {
-        if ((is_valid_coordinate(x + i,y - 6) && inputImage[x + i][y - 6]) ||
-            (is_valid_coordinate(x + i,y + 6) && inputImage[x + i][y + 6])) {
-            return false;
-        }
-        if ((is_valid_coordinate(x - 6,y + i) && inputImage[x - 6][y + i]) ||
-            (is_valid_coordinate(x + 6,y + i) && inputImage[x + 6][y + i])) {
-            return false;
-        }
-    }
-    for (int i = -7; i < 7; ++i) {
-        if ((is_valid_coordinate(x + i,y - 7) && inputImage[x + i][y - 7]) ||
-            (is_valid_coordinate(x + i,y + 7) && inputImage[x + i][y + 7])) {
-            return false;
-        }
-        if ((is_valid_coordinate(x - 7,y + i) && inputImage[x - 7][y + i]) ||
-            (is_valid_coordinate(x + 7,y + i) && inputImage[x + 7][y + i])) {
-            return false;
-        }
-    }
-    return true;
+    return is_isolated(inputImage, x, y, 6, true);
 }
 
-int detect_cells_quick(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT], Cell_list *cell_list) {
+void get_tile_bounds(const int tile_x, const int tile_y, int* x0, int* x1, int* y0, int* y1) {
+    *x0 = tile_x * TILE_SIZE;
+    *y0 = tile_y * TILE_SIZE;
+    *x1 = (*x0 + TILE_SIZE < BMP_WIDTH) ? *x0 + TILE_SIZE : BMP_WIDTH;
+    *y1 = (*y0 + TILE_SIZE < BMP_HEIGHT) ? *y0 + TILE_SIZE : BMP_HEIGHT;
+}
+
+/**
+ * @brief Quick detector body for a single line of constant x, shared by the full and the fused sweeps.
+ * A detected cell clears the box reaching one pixel past its outer frame. Pixels whose box lies in the
+ * image, which is all but a band of frame_radius + 2 along the edges, are tested without bounds checks.
+ */
+static inline __attribute__((always_inline)) int detect_cells_in_line(
+    unsigned char input_image[BMP_WIDTH][BMP_HEIGHT], bool tile_mask[TILES_X][TILES_Y], const int x,
+    const int frame_radius, Cell_list *cell_list) {
+    const int clear_radius = frame_radius + 2;
+    const bool line_inside = x >= clear_radius && x + clear_radius <= BMP_WIDTH;
     int cellsDetected = 0;
-    for (int x = 0; x < BMP_WIDTH; x++) {
-        for (int y = 0; y < BMP_HEIGHT; y++) {
+    for (int tile_y = 0; tile_y < TILES_Y; tile_y++) {
+        if (tile_mask != NULL && !tile_mask[x / TILE_SIZE][tile_y]) continue;
+        const int y_end = (tile_y + 1) * TILE_SIZE < BMP_HEIGHT ? (tile_y + 1) * TILE_SIZE : BMP_HEIGHT;
+
+        for (int y = tile_y * TILE_SIZE; y < y_end; y++) {
             if (input_image[x][y]) {
-                if (check_for_cell(input_image, x ,y) == true) {
+                const bool inside = line_inside && y >= clear_radius && y + clear_radius <= BMP_HEIGHT;
+                if (inside ? is_isolated(input_image, x, y, frame_radius, false)
+                           : is_isolated(input_image, x, y, frame_radius, true)) {
                     cellsDetected++;
                     add_to_cell_list(cell_list, x, y);
-                    for (int i = -8; i < 8; i++) {
-                        for (int j = -8; j < 8; j++) {
-                            if (!is_valid_coordinate(x+i, y +j)) continue;
-                            input_image[x + i][y + j] = 0;
-                        }
-                    }
+                    clear_box(input_image, x - clear_radius, x + clear_radius, y - clear_radius, y + clear_radius);
                 }
             }
         }
@@ -410,41 +638,272 @@ int detect_cells_quick(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT], Cell_li
     return cellsDetected;
 }
 
+/**
+ * @brief Quick detector body shared by the generic and the fixed-radius variants.
+ *
+ * Without a tile mask the whole image is scanned. With one, only the masked tiles are, but still
+ * in column order, so the result matches the full scan as long as every white pixel is in a masked tile.
+ */
+static inline __attribute__((always_inline)) int detect_cells_isolated(
+    unsigned char input_image[BMP_WIDTH][BMP_HEIGHT], bool tile_mask[TILES_X][TILES_Y], const int frame_radius,
+    Cell_list *cell_list) {
+    int cellsDetected = 0;
+    for (int x = 0; x < BMP_WIDTH; x++) {
+        cellsDetected += detect_cells_in_line(input_image, tile_mask, x, frame_radius, cell_list);
+    }
+    return cellsDetected;
+}
+
+int detect_cells_quick(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT], Cell_list *cell_list) {
+    return detect_cells_isolated(input_image, NULL, 6, cell_list);
+}
+
+int detect_cells_quick_with_radius(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT], bool tile_mask[TILES_X][TILES_Y],
+    const int frame_radius, Cell_list *cell_list) {
+    return detect_cells_isolated(input_image, tile_mask, frame_radius, cell_list);
+}
+
+int detect_cells_quick_tiles(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT], bool tile_mask[TILES_X][TILES_Y],
+    Cell_list *cell_list) {
+    return detect_cells_isolated(input_image, tile_mask, 6, cell_list);
+}
+
+// Detectors specialized for fixed window sizes
+#define DEFINE_QUICK_DETECTOR(RADIUS) \
+    static int detect_cells_quick_##RADIUS(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT], \
+                                           bool tile_mask[TILES_X][TILES_Y], Cell_list *cell_list) { \
+        if (tile_mask == NULL) { \
+            return detect_cells_isolated(input_image, NULL, RADIUS, cell_list); \
+        } \
+        return detect_cells_isolated(input_image, tile_mask, RADIUS, cell_list); \
+    }
+
+// The window detector also fires on black centres next to white pixels, so it always scans everything
+#define DEFINE_WINDOW_DETECTOR(AREA, FRAME) \
+    static int detect_cells_##AREA##_##FRAME(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT], \
+                                             bool tile_mask[TILES_X][TILES_Y], Cell_list *cell_list) { \
+        (void)tile_mask; \
+        return detect_cells_window(input_image, AREA, FRAME, cell_list); \
+    }
+
+DEFINE_QUICK_DETECTOR(5)
+DEFINE_QUICK_DETECTOR(6)
+DEFINE_QUICK_DETECTOR(7)
+DEFINE_QUICK_DETECTOR(8)
+
+DEFINE_WINDOW_DETECTOR(10, 1)
+DEFINE_WINDOW_DETECTOR(12, 1)
+DEFINE_WINDOW_DETECTOR(12, 2)
+DEFINE_WINDOW_DETECTOR(14, 1)
+DEFINE_WINDOW_DETECTOR(16, 1)
+
+Cell_detector get_quick_detector(const int frame_radius) {
+    switch (frame_radius) {
+        case 5: return detect_cells_quick_5;
+        case 6: return detect_cells_quick_6;
+        case 7: return detect_cells_quick_7;
+        case 8: return detect_cells_quick_8;
+        default: return NULL;
+    }
+}
+
+Cell_detector get_window_detector(const int detection_area_size, const int exclusion_frame_thickness) {
+    if (exclusion_frame_thickness == 1) {
+        switch (detection_area_size) {
+            case 10: return detect_cells_10_1;
+            case 12: return detect_cells_12_1;
+            case 14: return detect_cells_14_1;
+            case 16: return detect_cells_16_1;
+            default: return NULL;
+        }
+    }
+    if (exclusion_frame_thickness == 2 && detection_area_size == 12) {
+        return detect_cells_12_2;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Erodes the masked tiles of a single line of constant x into the output.
+ * Marks the tiles of the line that still hold white pixels, without clearing the others.
+ */
+static inline __attribute__((always_inline)) bool erode_line(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT],
+    unsigned char output_image[BMP_WIDTH][BMP_HEIGHT], bool tile_mask[TILES_X][TILES_Y],
+    bool has_white[TILES_X][TILES_Y], const int x) {
+    const int tile_x = x / TILE_SIZE;
+    bool has_eroded = false;
+    for (int tile_y = 0; tile_y < TILES_Y; tile_y++) {
+        if (!tile_mask[tile_x][tile_y]) continue;
+        const int y_end = (tile_y + 1) * TILE_SIZE < BMP_HEIGHT ? (tile_y + 1) * TILE_SIZE : BMP_HEIGHT;
+
+        bool tile_has_white = false;
+        for (int y = tile_y * TILE_SIZE; y < y_end; y++) {
+            unsigned char value = input_image[x][y];
+            if (value == 255) {
+                if (should_pixel_erode(input_image, x, y)) {
+                    value = 0;
+                    has_eroded = true;
+                } else {
+                    tile_has_white = true;
+                }
+            }
+            output_image[x][y] = value;
+        }
+        has_white[tile_x][tile_y] |= tile_has_white;
+    }
+    return has_eroded;
+}
+
+/**
+ * @brief Erosion body shared by the in-place and the ping-pong variants.
+ * Writes the masked tiles of the output and reports which of them still hold white pixels.
+ */
+static bool erode_tiles(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT],
+                        unsigned char output_image[BMP_WIDTH][BMP_HEIGHT], bool tile_mask[TILES_X][TILES_Y],
+                        bool has_white[TILES_X][TILES_Y]) {
+    memset(has_white, false, sizeof(bool) * TILES_X * TILES_Y);
+
+    bool has_eroded = false;
+    for (int x = 0; x < BMP_WIDTH; x++) {
+        has_eroded |= erode_line(input_image, output_image, tile_mask, has_white, x);
+    }
+    return has_eroded;
+}
+
+/**
+ * @brief Clears the masked tiles that went black in the input, see erode_image_tiles_into.
+ */
+static void clear_black_tiles(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT], bool tile_mask[TILES_X][TILES_Y],
+                              bool has_white[TILES_X][TILES_Y]) {
+    int x0, x1, y0, y1;
+    for (int tile_x = 0; tile_x < TILES_X; tile_x++) {
+        for (int tile_y = 0; tile_y < TILES_Y; tile_y++) {
+            if (!tile_mask[tile_x][tile_y] || has_white[tile_x][tile_y]) continue;
+            get_tile_bounds(tile_x, tile_y, &x0, &x1, &y0, &y1);
+            for (int x = x0; x < x1; x++) {
+                memset(&input_image[x][y0], 0, y1 - y0);
+            }
+        }
+    }
+}
+
+bool erode_image_tiles_into(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT],
+    unsigned char output_image[BMP_WIDTH][BMP_HEIGHT], bool tile_mask[TILES_X][TILES_Y],
+    bool white_tiles[TILES_X][TILES_Y]) {
+    bool has_white[TILES_X][TILES_Y];
+
+    const bool has_eroded = erode_tiles(input_image, output_image, tile_mask, has_white);
+
+    // Tiles that went black drop out of the mask and are never written again,
+    // so they are cleared in the input too before it becomes the next output
+    clear_black_tiles(input_image, tile_mask, has_white);
+
+    if (white_tiles != NULL) {
+        memcpy(white_tiles, has_white, sizeof(has_white));
+    }
+    return has_eroded;
+}
+
+/**
+ * @brief Fused sweep body shared by the generic and the fixed-radius variants.
+ *
+ * Detection on line x reads and clears lines up to x + frame_radius + 1, so it trails the erosion by
+ * that many lines. The window of lines both touch is about 2 * frame_radius + 4 lines, which stays in cache.
+ * Detection scans the tiles erosion has found white so far. Every line up to the one being scanned
+ * is eroded already, so a tile not marked yet has no white pixels on it.
+ */
+static inline __attribute__((always_inline)) bool erode_and_detect(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT],
+    unsigned char output_image[BMP_WIDTH][BMP_HEIGHT], bool tile_mask[TILES_X][TILES_Y],
+    bool white_tiles[TILES_X][TILES_Y], const int frame_radius, Cell_list *cell_list) {
+    const int lag = frame_radius + 1;
+    bool has_white[TILES_X][TILES_Y];
+    memset(has_white, false, sizeof(has_white));
+
+    bool has_eroded = false;
+    for (int x = 0; x < lag; x++) {
+        has_eroded |= erode_line(input_image, output_image, tile_mask, has_white, x);
+    }
+    for (int x = lag; x < BMP_WIDTH; x++) {
+        has_eroded |= erode_line(input_image, output_image, tile_mask, has_white, x);
+        detect_cells_in_line(output_image, has_white, x - lag, frame_radius, cell_list);
+    }
+    for (int x = BMP_WIDTH - lag; x < BMP_WIDTH; x++) {
+        detect_cells_in_line(output_image, has_white, x, frame_radius, cell_list);
+    }
+
+    clear_black_tiles(input_image, tile_mask, has_white);
+    if (white_tiles != NULL) {
+        memcpy(white_tiles, has_white, sizeof(has_white));
+    }
+    return has_eroded;
+}
+
+bool erode_and_detect_tiles_into(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT],
+    unsigned char output_image[BMP_WIDTH][BMP_HEIGHT], bool tile_mask[TILES_X][TILES_Y],
+    bool white_tiles[TILES_X][TILES_Y], const int frame_radius, Cell_list *cell_list) {
+    return erode_and_detect(input_image, output_image, tile_mask, white_tiles, frame_radius, cell_list);
+}
+
+// Fused sweeps specialized for fixed frame radii, one function each so every body is optimized on its own
+#define DEFINE_FUSED_SWEEP(RADIUS) \
+    static bool erode_and_detect_##RADIUS(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT], \
+                                          unsigned char output_image[BMP_WIDTH][BMP_HEIGHT], \
+                                          bool tile_mask[TILES_X][TILES_Y], bool white_tiles[TILES_X][TILES_Y], \
+                                          Cell_list *cell_list) { \
+        return erode_and_detect(input_image, output_image, tile_mask, white_tiles, RADIUS, cell_list); \
+    }
+
+DEFINE_FUSED_SWEEP(5)
+DEFINE_FUSED_SWEEP(6)
+DEFINE_FUSED_SWEEP(7)
+DEFINE_FUSED_SWEEP(8)
+
+Fused_sweep get_fused_sweep(const int frame_radius) {
+    switch (frame_radius) {
+        case 5: return erode_and_detect_5;
+        case 6: return erode_and_detect_6;
+        case 7: return erode_and_detect_7;
+        case 8: return erode_and_detect_8;
+        default: return NULL;
+    }
+}
+
+/**
+ * @brief Paints one marker pixel red.
+ */
+static inline __attribute__((always_inline)) void mark_pixel(
+    unsigned char image[BMP_WIDTH][BMP_HEIGHT][BMP_CHANNELS], const int x, const int y, const bool checked) {
+    if (checked && !is_valid_coordinate(x, y)) return;
+    image[x][y][0] = 255;
+    image[x][y][1] = 0;
+    image[x][y][2] = 0;
+}
+
+/**
+ * @brief Draws a cross three pixels wide, reaching MARKER_RADIUS pixels left and up and one less right and down.
+ */
+static inline __attribute__((always_inline)) void draw_marker(
+    unsigned char image[BMP_WIDTH][BMP_HEIGHT][BMP_CHANNELS], const int x, const int y, const bool checked) {
+    for (int i = -MARKER_RADIUS; i < MARKER_RADIUS; ++i) {
+        for (int j = -1; j <= 1; ++j) {
+            // Draw on x-axis
+            mark_pixel(image, x + i, y + j, checked);
+            // Draw on y-axis
+            mark_pixel(image, x + j, y + i, checked);
+        }
+    }
+}
+
 void draw_points(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT][BMP_CHANNELS], Cell_list *cell_list) {
     Cell *current = cell_list->head;
     while (current) {
         const int x = current->x;
         const int y = current->y;
-        for (int i = -10; i < 10; ++i) {
-            // Draw on x-axis
-            if (!is_valid_coordinate(x + i, y) && !is_valid_coordinate(x+i, y + 1)
-                && !is_valid_coordinate(x + i, y - 1)) {
-                continue;
-            }
-            input_image[x + i][y][0] = 255;
-            input_image[x + i][y + 1][0] = 255;
-            input_image[x + i][y - 1][0] = 255;
-            input_image[x + i][y][1] = 0;
-            input_image[x + i][y + 1][1] = 0;
-            input_image[x + i][y - 1][1] = 0;
-            input_image[x + i][y][2] = 0;
-            input_image[x + i][y + 1][2] = 0;
-            input_image[x + i][y - 1][2] = 0;
-
-            // Draw on y-axis
-            if (!is_valid_coordinate(x, y + i) && !is_valid_coordinate(x + 1, y + i)
-                && !is_valid_coordinate(x - 1, y + i)) {
-                continue;
-            }
-            input_image[x][y + i][0] = 255;
-            input_image[x + 1][y + i][0] = 255;
-            input_image[x - 1][y + i][0] = 255;
-            input_image[x][y + i][1] = 0;
-            input_image[x + 1][y + i][1] = 0;
-            input_image[x - 1][y + i][1] = 0;
-            input_image[x][y + i][2] = 0;
-            input_image[x + 1][y + i][2] = 0;
-            input_image[x - 1][y + i][2] = 0;
+        // Only markers near the edge need their pixels clipped
+        if (x >= MARKER_RADIUS && x + MARKER_RADIUS <= BMP_WIDTH && y >= MARKER_RADIUS && y + MARKER_RADIUS <= BMP_HEIGHT) {
+            draw_marker(input_image, x, y, false);
+        } else {
+            draw_marker(input_image, x, y, true);
         }
         current = current->next;
     }
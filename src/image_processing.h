@@ -5,6 +5,24 @@
 
 #include "cbmp.h"
 
+// Width of the black border binary_threshold leaves around the image
+#ifndef BORDER
+#define BORDER 1
+#endif
+
+// Tiles used to restrict erosion and detection to the parts of an image that need it
+#define TILE_SIZE 32
+#define TILES_X ((BMP_WIDTH + TILE_SIZE - 1) / TILE_SIZE)
+#define TILES_Y ((BMP_HEIGHT + TILE_SIZE - 1) / TILE_SIZE)
+
+// A rectangle of pixels. The upper bounds are exclusive.
+typedef struct {
+    int x0;
+    int x1;
+    int y0;
+    int y1;
+} Image_region;
+
 /**
  * @brief Converts an RGB image to a grayscale image.
  *
@@ -53,6 +71,63 @@ void gaussian_blur_5x5(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT]);
  */
 void sharpen_image(unsigned char image[BMP_WIDTH][BMP_HEIGHT]);
 
+/**
+ * @brief Same as gaussian_blur_3x3, writing the result to a separate image instead of in place.
+ *
+ * @param input_image The image to be blurred.
+ * @param output_image The blurred image. The border the kernel does not reach is copied from the input.
+ */
+void gaussian_blur_3x3_into(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT],
+                            unsigned char output_image[BMP_WIDTH][BMP_HEIGHT]);
+
+/**
+ * @brief Same as gaussian_blur_5x5, writing the result to a separate image instead of in place.
+ *
+ * @param input_image The image to be blurred.
+ * @param output_image The blurred image. The border the kernel does not reach is copied from the input.
+ */
+void gaussian_blur_5x5_into(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT],
+                            unsigned char output_image[BMP_WIDTH][BMP_HEIGHT]);
+
+/**
+ * @brief Same as sharpen_image, writing the result to a separate image instead of in place.
+ *
+ * @param input_image The image to be sharpened.
+ * @param output_image The sharpened image. The border the kernel does not reach is copied from the input.
+ */
+void sharpen_image_into(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT],
+                        unsigned char output_image[BMP_WIDTH][BMP_HEIGHT]);
+
+/**
+ * @brief Same as gaussian_blur_3x3_into, only writing the pixels inside a region.
+ *
+ * @param input_image The image to be blurred. The pixels the kernel reaches from the region must be valid.
+ * @param output_image The image the blurred region is written to.
+ * @param region The pixels to write.
+ */
+void gaussian_blur_3x3_region_into(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT],
+                                   unsigned char output_image[BMP_WIDTH][BMP_HEIGHT], const Image_region* region);
+
+/**
+ * @brief Same as gaussian_blur_5x5_into, only writing the pixels inside a region.
+ *
+ * @param input_image The image to be blurred. The pixels the kernel reaches from the region must be valid.
+ * @param output_image The image the blurred region is written to.
+ * @param region The pixels to write.
+ */
+void gaussian_blur_5x5_region_into(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT],
+                                   unsigned char output_image[BMP_WIDTH][BMP_HEIGHT], const Image_region* region);
+
+/**
+ * @brief Same as sharpen_image_into, only writing the pixels inside a region.
+ *
+ * @param input_image The image to be sharpened. The pixels the kernel reaches from the region must be valid.
+ * @param output_image The image the sharpened region is written to.
+ * @param region The pixels to write.
+ */
+void sharpen_image_region_into(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT],
+                               unsigned char output_image[BMP_WIDTH][BMP_HEIGHT], const Image_region* region);
+
 /**
  * @brief Calculates an optimal threshold value for a binary image using Otsu's method.
  *
@@ -61,6 +136,34 @@ void sharpen_image(unsigned char image[BMP_WIDTH][BMP_HEIGHT]);
  */
 unsigned char otsu_threshold_value(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT]);
 
+/**
+ * @brief Counts the gray levels of the pixels inside a region.
+ *
+ * @param input_image The grayscale image.
+ * @param region The pixels to count.
+ * @param histogram The counts to add to.
+ */
+void add_to_histogram(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT], const Image_region* region,
+                      int histogram[256]);
+
+/**
+ * @brief Same as otsu_threshold_value, for the pixels counted in a histogram.
+ *
+ * @param histogram The number of pixels per gray level.
+ * @return The calculated optimal threshold value.
+ */
+unsigned char otsu_threshold_from_histogram(const int histogram[256]);
+
+/**
+ * @brief Same as otsu_threshold_from_histogram, also telling how well the threshold splits the pixels.
+ *
+ * @param histogram The number of pixels per gray level.
+ * @param separation Set to the mean gray level above the threshold minus the one at or below it,
+ * 0 if the histogram has a single level. May be NULL.
+ * @return The calculated optimal threshold value.
+ */
+unsigned char otsu_threshold_with_separation(const int histogram[256], int* separation);
+
 /**
  * @brief Converts a grayscale image to a binary image based on a threshold.
  *
@@ -69,11 +172,25 @@ unsigned char otsu_threshold_value(unsigned char input_image[BMP_WIDTH][BMP_HEIG
  */
 void binary_threshold(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT], int threshold);
 
+/**
+ * @brief Same as binary_threshold, only for the pixels inside a region and writing them to a separate image.
+ * The part of the region in the black border is written black.
+ *
+ * @param input_image The grayscale image.
+ * @param output_image The image the binary region is written to.
+ * @param region The pixels to binarize.
+ * @param threshold The threshold value.
+ */
+void binary_threshold_region_into(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT],
+                                  unsigned char output_image[BMP_WIDTH][BMP_HEIGHT], const Image_region* region,
+                                  int threshold);
+
 /**
  * @brief Determines if a single white pixel should be eroded.
  *
  * According to the rules, a white pixel is eroded (turns black) if any of its
- * direct neighbors are black.
+ * direct neighbors are black. The neighbours are read without bounds checks when BORDER is
+ * at least 1, so the image must keep the black border binary_threshold leaves.
  *
  * @param input_image The binary image buffer.
  * @param x The x-coordinate of the pixel to check.
@@ -131,11 +248,12 @@ void destroy_cell_list(Cell_list* cell_list);
  * @param exclusion_frame_thickness The thickness of the exclusion frame.
  * @param center_x The center x-coordinate of the detection window.
  * @param center_y The center y-coordinate of the detection window.
+ * @param checked False if the whole frame lies in the image, which skips the bounds checks.
  *
  * @return True if the frame is all black, false otherwise.
  */
 static bool is_exclusion_frame_clear(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT], int detection_area_size,
-                                     int exclusion_frame_thickness, int center_x, int center_y);
+                                     int exclusion_frame_thickness, int center_x, int center_y, bool checked);
 
 /**
  * @brief Checks if the inner detection area contains at least one white pixel.
@@ -144,13 +262,14 @@ static bool is_exclusion_frame_clear(unsigned char input_image[BMP_WIDTH][BMP_HE
  * @param detection_area_size The size of the detection area.
  * @param center_x The center x-coordinate of the detection window.
  * @param center_y The center y-coordinate of the detection window.
+ * @param checked False if the whole area lies in the image, which skips the bounds checks.
  * @return True if at least one white pixel is found, false otherwise.
  */
 static bool is_detection_area_active(unsigned char image[BMP_WIDTH][BMP_HEIGHT], int detection_area_size,
-                                     int center_x, int center_y);
+                                     int center_x, int center_y, bool checked);
 
 /**
- * @brief Sets all pixels in a specified detection area to black (0).
+ * @brief Sets all pixels in a specified detection area to black (0), clipped to the image.
  *
  * @param image The binary image to modify.
  * @param detection_area_size The size of the area to clear.
@@ -193,6 +312,112 @@ char check_for_cell(unsigned char inputImage[BMP_WIDTH][BMP_HEIGHT], int x, int
  */
 int detect_cells_quick(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT], Cell_list *cell_list);
 
+/**
+ * @brief Gets the pixel range covered by a tile. The upper bounds are exclusive.
+ *
+ * @param tile_x The x index of the tile.
+ * @param tile_y The y index of the tile.
+ */
+void get_tile_bounds(int tile_x, int tile_y, int* x0, int* x1, int* y0, int* y1);
+
+/**
+ * @brief Applies one erosion pass, restricted to the tiles set in the mask, writing the eroded tiles to a
+ * separate image. Pixels outside the masked tiles are read as neighbours but never modified.
+ *
+ * Black pixels never turn white, so the tiles left with white pixels are the only ones the
+ * next pass and the detector have to visit. They are written to white_tiles, which may be the
+ * same array as tile_mask.
+ *
+ * Meant for ping-pong buffers: as long as both images are black outside tile_mask and the
+ * result is fed back through white_tiles, they stay identical outside the mask. To keep it that
+ * way, masked tiles that went black are also cleared in the input.
+ *
+ * @param input_image The binary image to be eroded. Masked tiles that went black are cleared.
+ * @param output_image Receives the eroded masked tiles.
+ * @param tile_mask The tiles to erode.
+ * @param white_tiles Set to the tiles that still hold white pixels, or NULL.
+ * @return True if any pixel was changed during erosion, false otherwise.
+ */
+bool erode_image_tiles_into(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT],
+                            unsigned char output_image[BMP_WIDTH][BMP_HEIGHT], bool tile_mask[TILES_X][TILES_Y],
+                            bool white_tiles[TILES_X][TILES_Y]);
+
+/**
+ * @brief Same as detect_cells_quick, but only white pixels inside the masked tiles are tested.
+ * The isolation frames may reach into neighbouring tiles, which are read but not scanned.
+ *
+ * @param input_image The binary image to process.
+ * @param tile_mask The tiles to scan.
+ * @param cell_list The list to store coordinates of detected cells.
+ * @return The total number of cells detected.
+ */
+int detect_cells_quick_tiles(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT], bool tile_mask[TILES_X][TILES_Y],
+                             Cell_list *cell_list);
+
+/**
+ * @brief Same as detect_cells_quick_tiles, with the isolation frames at a runtime radius.
+ * The frames sit at frame_radius and frame_radius + 1, detect_cells_quick uses 6.
+ *
+ * @param input_image The binary image to process.
+ * @param tile_mask The tiles to scan, or NULL for the whole image.
+ * @param frame_radius The radius of the inner isolation frame.
+ * @param cell_list The list to store coordinates of detected cells.
+ * @return The total number of cells detected.
+ */
+int detect_cells_quick_with_radius(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT], bool tile_mask[TILES_X][TILES_Y],
+                                   int frame_radius, Cell_list *cell_list);
+
+// A detector with its window sizes fixed at compile time. Quick detectors only scan the
+// tiles in the mask (NULL for the whole image), window detectors always scan everything.
+typedef int (*Cell_detector)(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT], bool tile_mask[TILES_X][TILES_Y],
+                             Cell_list *cell_list);
+
+/**
+ * @brief Looks up the quick detector specialized for a frame radius.
+ *
+ * @param frame_radius The radius of the inner isolation frame.
+ * @return The specialized detector, or NULL if there is none for this radius.
+ */
+Cell_detector get_quick_detector(int frame_radius);
+
+/**
+ * @brief Looks up the window detector specialized for a detection area and frame thickness.
+ *
+ * @param detection_area_size The size of the inner detection window.
+ * @param exclusion_frame_thickness The thickness of the surrounding exclusion frame.
+ * @return The specialized detector, or NULL if there is none for these sizes.
+ */
+Cell_detector get_window_detector(int detection_area_size, int exclusion_frame_thickness);
+
+/**
+ * @brief One erosion pass and one quick detection pass in a single sweep over the image.
+ * Gives the same image, cells and tiles as erode_image_tiles_into followed by detect_cells_quick_with_radius.
+ *
+ * An image that erodes no further is all black, so detecting on it too, unlike the separate passes, finds nothing.
+ *
+ * @param input_image The binary image to be eroded. Masked tiles that went black are cleared.
+ * @param output_image Receives the eroded masked tiles, with the detected cells cleared.
+ * @param tile_mask The tiles to erode and scan.
+ * @param white_tiles Set to the tiles that still hold white pixels after erosion, or NULL.
+ * @param frame_radius The radius of the inner isolation frame, see detect_cells_quick_with_radius.
+ * @param cell_list The list to store coordinates of detected cells.
+ * @return True if any pixel was changed during erosion, false otherwise.
+ */
+bool erode_and_detect_tiles_into(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT],
+                                 unsigned char output_image[BMP_WIDTH][BMP_HEIGHT], bool tile_mask[TILES_X][TILES_Y],
+                                 bool white_tiles[TILES_X][TILES_Y], int frame_radius, Cell_list *cell_list);
+
+// A fused sweep with its frame radius fixed at compile time
+typedef bool (*Fused_sweep)(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT],
+                            unsigned char output_image[BMP_WIDTH][BMP_HEIGHT], bool tile_mask[TILES_X][TILES_Y],
+                            bool white_tiles[TILES_X][TILES_Y], Cell_list *cell_list);
+
+/**
+ * @brief Returns the fused sweep specialized for a frame radius.
+ * @return The sweep, or NULL if there is no variant for this radius.
+ */
+Fused_sweep get_fused_sweep(int frame_radius);
+
 /**
  * @brief Draws a red cross marker on the RGB image for each cell in the list.
  *
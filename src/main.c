@@ -1,87 +1,544 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
+#include "batch.h"
 #include "cbmp.h"
 #include "image_processing.h"
+#include "pipeline.h"
+#include "result_cache.h"
+#include "sequence.h"
+#include "shard.h"
+#include "stream.h"
+#include "sweep.h"
 
 #define MAX_CELLS 4000
 #define FILENAME_BUFFER_SIZE 256
 
-static void construct_output_path(char* output_buffer, size_t buffer_size,
-                                  const char* base_path, const char* suffix) {
-    const char* extension = strrchr(base_path, '.');
-    if (extension != NULL) {
-        const int basename_len = extension - base_path;
-        snprintf(output_buffer, buffer_size, "%.*s%s%s", basename_len, base_path, suffix, extension);
-    } else {
-        snprintf(output_buffer, buffer_size, "%s%s", base_path, suffix);
-    }
-}
-
 unsigned char original_image[BMP_WIDTH][BMP_HEIGHT][BMP_CHANNELS];
-unsigned char rgb_image[BMP_WIDTH][BMP_HEIGHT][BMP_CHANNELS];
-unsigned char grayscale_image[BMP_WIDTH][BMP_HEIGHT];
 clock_t start, end;
 double cpu_time_used;
 
+// Options shared by all modes
+typedef struct {
+    Pipeline_config pipeline;
+    bool sequence;
+    bool batch;
+    Batch_options batch_options;
+    // Fork worker processes and merge their results into one file
+    bool shard;
+    Shard_options shard_options;
+    // Read bitmaps from stdin and write results to stdout
+    bool stream;
+    Stream_output stream_output;
+    // Grid file of the sweep mode, or NULL
+    const char* sweep_grid;
+    // Directory of the result cache, or NULL for no cache
+    const char* cache_directory;
+    long cache_megabytes;
+    // Write the input with the detected cells marked
+    bool annotate;
+    // Measure every stage with the hardware performance counters
+    bool perf_counters;
+    int tile_tolerance;
+    int link_distance;
+    // Positional arguments
+    char** paths;
+    int path_amount;
+} Options;
+
+static void print_usage(const char* program) {
+    printf("Usage: %s [options] <input_image.bmp> <output_image.bmp>\n", program);
+    printf("       %s --sequence [options] <output_image.bmp> <frame.bmp>...\n", program);
+    printf("       %s --batch [options] <output_directory> <input_image.bmp>...\n", program);
+    printf("       %s --shards <n> [options] <results.txt> <input_image.bmp>...\n", program);
+    printf("       %s --sweep <grid_file> [options] <report.csv> <input_image.bmp>...\n", program);
+    printf("       %s --stream <cells|bitmaps> [options] < images.bmp > results\n", program);
+    printf("Options:\n");
+    printf("  --config <file>         Read pipeline options from a file with key = value lines\n");
+    printf("  --blur <type>           none, gaussian3x3, gaussian5x5, sharpen, median or guided\n");
+    printf("  --blur-passes <n>       Number of blur passes\n");
+    printf("  --filter-radius <n>     Window radius of the median and guided filters\n");
+    printf("  --guided-epsilon <n>    Variance the guided filter smooths out, in squared gray levels\n");
+    printf("  --threshold <method>    otsu, fixed or tiled (one Otsu threshold per tile, interpolated)\n");
+    printf("  --threshold-value <n>   Threshold for the fixed method\n");
+    printf("  --threshold-offset <n>  Added to the computed threshold\n");
+    printf("  --threshold-tile <n>    Tiled method: approximate tile size (128)\n");
+    printf("  --threshold-separation <n> Tiled method: gray levels between a tile's classes for its own threshold (32)\n");
+    printf("  --detector <type>       quick or window\n");
+    printf("  --frame-radius <n>      Isolation frame radius of the quick detector\n");
+    printf("  --detection-area <n>    Window size of the window detector\n");
+    printf("  --exclusion-frame <n>   Exclusion frame thickness of the window detector\n");
+    printf("  --engine <dense|rle>    Store the binary image as bytes or as white runs during erosion\n");
+    printf("  --fused <0|1>           Erode and detect in one sweep per pass (1)\n");
+    printf("  --pyramid <0|2|4>       Find cells on a downsampled image and refine them at full resolution\n");
+    printf("  --pyramid-compare <0|1> Also run the full-resolution loop and report the pyramid's accuracy\n");
+    printf("  --debug-images <0|1>    Write the intermediate images\n");
+    printf("  --roi <x,y,w,h>         Only process this region and report the cells in it, may be repeated\n");
+    printf("  --roi-threshold <mode>  global: one Otsu threshold over all regions, local: one per region\n");
+    printf("  --roi-margin <n>        Pixels around each region that are processed too (32)\n");
+    printf("  --deadline <ms>         Stop eroding when the next pass would end past this budget, keep the cells so far\n");
+    printf("  --no-annotate           Skip the annotated output image and the RGB copy it needs\n");
+    printf("  --perf-counters         Count cycles, instructions, cache and branch misses per stage (single image only)\n");
+    printf("  --tile-tolerance <n>    Sequence mode: changed pixels before a tile is detected on again\n");
+    printf("  --link-distance <n>     Sequence mode: how far a cell may move and keep its track\n");
+    printf("  --queue-depth <n>       Batch mode: images waiting between two stages\n");
+    printf("  --buffers <n>           Batch mode: images in flight at once, which bounds memory\n");
+    printf("  --io <uring|blocking>   Batch mode: read and write files through io_uring (uring) or one at a time\n");
+    printf("  --io-depth <n>          Batch mode: io_uring reads ahead and writes behind in flight (4)\n");
+    printf("  --cold-cache            Batch mode: drop the inputs from the page cache first\n");
+    printf("  --shards <n>            Process the images in n worker processes that claim them one by one\n");
+    printf("  --shard-scaling         Shard mode: first run with 1, 2, 4, ... workers and report the speedup\n");
+    printf("  --sweep <grid_file>     Evaluate every combination of the key = value, value, ... lines in the file\n");
+    printf("  --stream <format>       Read concatenated bitmaps from stdin and write cells or bitmaps to stdout\n");
+    printf("  --cache-dir <dir>       Reuse the cells of images already processed with the same configuration (not in sequence and sweep mode)\n");
+    printf("  --cache-size <MB>       Size the result cache is trimmed to by evicting the least recently used (64)\n");
+}
+
+static bool parse_options(int argc, char** argv, Options* options) {
+    default_pipeline_config(&options->pipeline);
+    options->sequence = false;
+    options->batch = false;
+    options->batch_options.queue_depth = 2;
+    options->batch_options.buffer_count = 4;
+    options->batch_options.cache = NULL;
+    options->batch_options.io_backend = IO_BACKEND_URING;
+    options->batch_options.io_depth = 4;
+    options->batch_options.cold_cache = false;
+    options->shard = false;
+    options->shard_options.workers = 1;
+    options->shard_options.scaling = false;
+    options->shard_options.cache = NULL;
+    options->stream = false;
+    options->stream_output = STREAM_CELLS;
+    options->sweep_grid = NULL;
+    options->cache_directory = NULL;
+    options->cache_megabytes = 64;
+    options->annotate = true;
+    options->perf_counters = false;
+    options->tile_tolerance = 8;
+    options->link_distance = 10;
+    options->paths = argv + argc;
+    options->path_amount = 0;
+
+    int arg = 1;
+    for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++) {
+        const char* name = argv[arg] + 2;
+        if (strcmp(name, "sequence") == 0) {
+            options->sequence = true;
+            continue;
+        }
+        if (strcmp(name, "batch") == 0) {
+            options->batch = true;
+            continue;
+        }
+        if (strcmp(name, "shard-scaling") == 0) {
+            options->shard_options.scaling = true;
+            continue;
+        }
+        if (strcmp(name, "no-annotate") == 0) {
+            options->annotate = false;
+            continue;
+        }
+        if (strcmp(name, "perf-counters") == 0) {
+            options->perf_counters = true;
+            continue;
+        }
+        if (strcmp(name, "cold-cache") == 0) {
+            options->batch_options.cold_cache = true;
+            continue;
+        }
+        if (arg + 1 >= argc) {
+            fprintf(stderr, "Missing value for %s\n", argv[arg]);
+            return false;
+        }
+        const char* value = argv[++arg];
+
+        if (strcmp(name, "config") == 0) {
+            if (!load_pipeline_config(&options->pipeline, value)) return false;
+        } else if (strcmp(name, "shards") == 0) {
+            options->shard = true;
+            options->shard_options.workers = atoi(value);
+        } else if (strcmp(name, "sweep") == 0) {
+            options->sweep_grid = value;
+        } else if (strcmp(name, "stream") == 0) {
+            options->stream = true;
+            if (strcmp(value, "cells") == 0) {
+                options->stream_output = STREAM_CELLS;
+            } else if (strcmp(value, "bitmaps") == 0) {
+                options->stream_output = STREAM_BITMAPS;
+            } else {
+                fprintf(stderr, "Invalid option --stream %s\n", value);
+                return false;
+            }
+        } else if (strcmp(name, "cache-dir") == 0) {
+            options->cache_directory = value;
+        } else if (strcmp(name, "cache-size") == 0) {
+            options->cache_megabytes = atol(value);
+        } else if (strcmp(name, "queue-depth") == 0) {
+            options->batch_options.queue_depth = atoi(value);
+        } else if (strcmp(name, "buffers") == 0) {
+            options->batch_options.buffer_count = atoi(value);
+        } else if (strcmp(name, "io") == 0) {
+            if (strcmp(value, "uring") == 0) {
+                options->batch_options.io_backend = IO_BACKEND_URING;
+            } else if (strcmp(value, "blocking") == 0) {
+                options->batch_options.io_backend = IO_BACKEND_BLOCKING;
+            } else {
+                fprintf(stderr, "Invalid option --io %s\n", value);
+                return false;
+            }
+        } else if (strcmp(name, "io-depth") == 0) {
+            options->batch_options.io_depth = atoi(value);
+        } else if (strcmp(name, "tile-tolerance") == 0) {
+            options->tile_tolerance = atoi(value);
+        } else if (strcmp(name, "link-distance") == 0) {
+            options->link_distance = atoi(value);
+        } else {
+            // Everything else is a pipeline option, written with dashes on the command line
+            char key[64];
+            snprintf(key, sizeof(key), "%s", name);
+            for (char* c = key; *c; c++) {
+                if (*c == '-') *c = '_';
+            }
+            if (!set_pipeline_option(&options->pipeline, key, value)) {
+                fprintf(stderr, "Invalid option %s %s\n", argv[arg - 1], value);
+                return false;
+            }
+        }
+    }
+    options->paths = argv + arg;
+    options->path_amount = argc - arg;
+    return true;
+}
+
+// Prints the per-stage counts and writes them to <output>_perf.csv
+static void report_perf_counters(const Pipeline_stats* stats, const char* output_path) {
+    char report_filename[FILENAME_BUFFER_SIZE];
+    construct_report_path(report_filename, FILENAME_BUFFER_SIZE, output_path, "_perf.csv");
+    FILE* report_file = fopen(report_filename, "w");
+    if (report_file == NULL) {
+        perror("Error opening performance counter report");
+    }
+    bool any_scaled = false;
+
+    printf("%-10s", "stage");
+    if (report_file) fprintf(report_file, "stage");
+    for (int counter = 0; counter < PERF_COUNTER_AMOUNT; counter++) {
+        printf(" %14s", perf_counter_name((Perf_counter)counter));
+        if (report_file) fprintf(report_file, ",%s", perf_counter_name((Perf_counter)counter));
+    }
+    printf("\n");
+    if (report_file) fprintf(report_file, "\n");
+
+    for (int stage = 0; stage < PIPELINE_STAGE_AMOUNT; stage++) {
+        const Perf_sample* sample = &stats->stage_counters[stage];
+        printf("%-10s", pipeline_stage_name((Pipeline_stage)stage));
+        if (report_file) fprintf(report_file, "%s", pipeline_stage_name((Pipeline_stage)stage));
+        for (int counter = 0; counter < PERF_COUNTER_AMOUNT; counter++) {
+            // Counters that could not be opened are reported as n/a, and left empty in the file
+            if (sample->values[counter] < 0) {
+                printf(" %14s", "n/a");
+                if (report_file) fprintf(report_file, ",");
+            } else {
+                // Counts the kernel had to multiplex are estimates, marked with a * on screen
+                printf(" %13lld%c", sample->values[counter], sample->scaled[counter] ? '*' : ' ');
+                if (report_file) fprintf(report_file, ",%lld", sample->values[counter]);
+                any_scaled |= sample->scaled[counter];
+            }
+        }
+        printf("\n");
+        if (report_file) fprintf(report_file, "\n");
+    }
+    if (any_scaled) {
+        printf("* scaled up from the part of the stage the counter was running, multiplexed with the others\n");
+    }
+    if (report_file) fclose(report_file);
+}
+
+// Prints what every region of interest cost
+static void report_rois(const Pipeline_config* config, const Pipeline_stats* stats) {
+    for (int i = 0; i < stats->roi_amount; i++) {
+        const Image_region* roi = &config->rois[i];
+        const Roi_stats* roi_stats = &stats->rois[i];
+        printf("ROI %d (%d,%d %dx%d): threshold %d, %d cells, %ld pixels blurred, %ld processed, %.3f ms\n", i,
+               roi->x0, roi->y0, roi->x1 - roi->x0, roi->y1 - roi->y0, roi_stats->threshold, roi_stats->cells,
+               roi_stats->blurred_pixels, roi_stats->processed_pixels, 1000 * roi_stats->seconds);
+    }
+}
+
+static void report_result_cache(const Result_cache* cache) {
+    printf("Result cache: %d hits, %d misses, %d evicted\n", cache->hits, cache->misses, cache->evictions);
+}
+
+// Writes one line per track to <output>_tracks_summary.csv: when it was seen and where it was last
+static bool write_track_summary(const Sequence_state* state, const char* output_path) {
+    char summary_filename[FILENAME_BUFFER_SIZE];
+    construct_report_path(summary_filename, FILENAME_BUFFER_SIZE, output_path, "_tracks_summary.csv");
+    FILE* summary_file = fopen(summary_filename, "w");
+    if (summary_file == NULL) {
+        perror("Error opening track summary");
+        return false;
+    }
+    fprintf(summary_file, "track_id,first_frame,last_frame,frames_seen,last_x,last_y\n");
+    for (int i = 0; i < state->track_amount; i++) {
+        const Track* track = &state->tracks[i];
+        fprintf(summary_file, "%d,%d,%d,%d,%d,%d\n", track->id, track->first_frame, track->last_frame,
+                track->frames_seen, track->x, track->y);
+    }
+    return fclose(summary_file) == 0;
+}
+
+// Processes an ordered list of frames of the same field, reusing work between frames
+static int run_sequence(const Options* options, const Pipeline* pipeline, Scratch_arena* arena) {
+    if (options->path_amount < 2) {
+        fprintf(stderr, "Sequence mode needs an output path and at least one frame\n");
+        return 1;
+    }
+    const char* output_path = options->paths[0];
+
+    char output_filename[FILENAME_BUFFER_SIZE];
+    construct_report_path(output_filename, FILENAME_BUFFER_SIZE, output_path, "_tracks.csv");
+    FILE* tracks_file = fopen(output_filename, "w");
+    if (tracks_file == NULL) {
+        perror("Error opening track file");
+        return 1;
+    }
+    fprintf(tracks_file, "frame,track_id,x,y\n");
+
+    Sequence_state* state = create_sequence_state(options->tile_tolerance, options->link_distance);
+    if (state == NULL) {
+        fclose(tracks_file);
+        return 1;
+    }
+
+    int untracked_cells = 0;
+    for (int frame = 0; frame + 1 < options->path_amount; frame++) {
+        start = clock();
+        read_bitmap_grayscale(options->paths[frame + 1], arena->front, options->annotate ? original_image : NULL);
+        run_blur_stages(pipeline, arena);
+
+        Frame_report report;
+        process_sequence_frame(state, pipeline, arena->front, &report);
+        end = clock();
+        cpu_time_used = end - start;
+
+        printf("Frame %d: threshold %d, %d changed tiles, %d dirty tiles, %d cells (%d new tracks, %d lost), "
+               "time used: %f\n", frame, report.threshold, report.changed_tiles, report.dirty_tiles,
+               report.cells, report.new_tracks, report.lost_cells, cpu_time_used);
+        if (report.untracked_cells > 0) {
+            fprintf(stderr, "Frame %d: dropped %d cells, out of memory for their tracks\n", frame,
+                    report.untracked_cells);
+            untracked_cells += report.untracked_cells;
+        }
+
+        for (int i = 0; i < state->cell_amount; i++) {
+            fprintf(tracks_file, "%d,%d,%d,%d\n", frame, state->cells[i].track_id,
+                    state->cells[i].x, state->cells[i].y);
+        }
+
+        if (options->annotate) {
+            Cell_list* cell_list = create_cell_list();
+            sequence_cells_to_list(state, cell_list);
+            draw_points(original_image, cell_list);
+            destroy_cell_list(cell_list);
+
+            char suffix[32];
+            snprintf(suffix, sizeof(suffix), "_frame%d", frame);
+            construct_output_path(output_filename, FILENAME_BUFFER_SIZE, output_path, suffix);
+            write_bitmap(original_image, output_filename);
+        }
+    }
+
+    printf("Tracked %d cells over %d frames\n", state->track_amount, state->frame_index);
+    const bool summary_written = write_track_summary(state, output_path);
+    destroy_sequence_state(state);
+    fclose(tracks_file);
+    return summary_written && untracked_cells == 0 ? 0 : 1;
+}
+
 int main(int argc, char** argv) {
-    // argc counts how may arguments are passed
-    // argv[0] is a string with the name of the program
-    // argv[1] is the first command line argument (input image)
-    // argv[2] is the second command line argument (output image)
+    // Options come first, then the input and output image paths
+    Options options;
+    if (!parse_options(argc, argv, &options)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    Pipeline pipeline;
+    build_pipeline(&options.pipeline, &pipeline);
 
     // Check for correct number of arguments
-    if (argc != 3) {
-        printf("Usage: %s <input_image.bmp> <output_image.bmp>\n", argv[0]);
+    if (!options.sequence && !options.batch && !options.shard && options.sweep_grid == NULL &&
+        !options.stream && options.path_amount != 2) {
+        print_usage(argv[0]);
         return 1;
     }
 
-    // Read the input image from file
-    read_bitmap(argv[1], original_image);
-    memcpy(rgb_image, original_image, BMP_WIDTH * BMP_HEIGHT * BMP_CHANNELS);
+    // The counters only follow the thread that opened them, and are reported per stage of one image
+    if (options.perf_counters && (options.sequence || options.batch || options.shard || options.sweep_grid != NULL ||
+                                  options.stream)) {
+        fprintf(stderr, "Performance counters are only supported for a single image\n");
+        return 1;
+    }
 
-    start = clock();
-    convert_to_grayscale(rgb_image, grayscale_image);
+    // Sequence frames build on each other and a sweep runs each configuration once, so neither uses the cache
+    if (options.cache_directory != NULL && (options.sequence || options.sweep_grid != NULL)) {
+        fprintf(stderr, "The result cache is not supported in sequence and sweep mode\n");
+        return 1;
+    }
+    Result_cache cache;
+    Result_cache* result_cache = NULL;
+    if (options.cache_directory != NULL) {
+        if (!open_result_cache(&cache, options.cache_directory, options.cache_megabytes * 1024 * 1024)) {
+            return 1;
+        }
+        result_cache = &cache;
+    }
 
-    char output_filename[FILENAME_BUFFER_SIZE];
+    if (options.batch) {
+        if (options.path_amount < 2) {
+            print_usage(argv[0]);
+            return 1;
+        }
+        options.batch_options.annotate = options.annotate;
+        options.batch_options.cache = result_cache;
+        const int result = run_batch(&pipeline, &options.batch_options, options.paths[0], options.paths + 1,
+                                     options.path_amount - 1);
+        if (result_cache != NULL) {
+            report_result_cache(result_cache);
+        }
+        return result;
+    }
 
-    //gaussian_blur_5x5(grayscale_image);
-    //gaussian_blur_5x5(grayscale_image);
-    //gaussian_blur_5x5(grayscale_image);
-    gaussian_blur_3x3(grayscale_image);
-    gaussian_blur_3x3(grayscale_image);
+    if (options.shard) {
+        if (options.path_amount < 2) {
+            print_usage(argv[0]);
+            return 1;
+        }
+        options.shard_options.cache = result_cache;
+        const int result = run_sharded(&pipeline, &options.shard_options, options.paths[0], options.paths + 1,
+                                       options.path_amount - 1);
+        if (result_cache != NULL) {
+            report_result_cache(result_cache);
+        }
+        return result;
+    }
 
-    construct_output_path(output_filename, FILENAME_BUFFER_SIZE, argv[2], "_gaussian");
-    convert_to_RGB(grayscale_image, rgb_image);
-    write_bitmap(rgb_image, output_filename);
+    if (options.stream) {
+        if (options.path_amount != 0) {
+            print_usage(argv[0]);
+            return 1;
+        }
+        return run_stream(&pipeline, options.stream_output, result_cache, stdin, stdout);
+    }
 
-    const int threshold = otsu_threshold_value(grayscale_image);
-    printf("The threshold is %i\n", threshold);
-    binary_threshold(grayscale_image, threshold);
+    // Both run the stages themselves on whole frames
+    if ((options.sequence || options.sweep_grid != NULL) && options.pipeline.roi_amount > 0) {
+        fprintf(stderr, "Regions of interest are not supported in sequence and sweep mode\n");
+        return 1;
+    }
+    // Sequence mode keeps one global histogram up to date from frame to frame
+    if (options.sequence && options.pipeline.threshold_method == THRESHOLD_TILED) {
+        fprintf(stderr, "The tiled threshold is not supported in sequence mode\n");
+        return 1;
+    }
+    // and runs its own erosion loop on the dirty tiles
+    if (options.sequence && options.pipeline.deadline_ms > 0) {
+        fprintf(stderr, "The deadline is not supported in sequence mode\n");
+        return 1;
+    }
+    if (options.sequence && (options.pipeline.engine == ENGINE_RLE || options.pipeline.pyramid_factor > 1)) {
+        fprintf(stderr, "The run-length engine and the pyramid are not supported in sequence mode\n");
+        return 1;
+    }
 
-    construct_output_path(output_filename, FILENAME_BUFFER_SIZE, argv[2], "_binary");
-    convert_to_RGB(grayscale_image, rgb_image);
-    write_bitmap(rgb_image, output_filename);
+    if (options.sweep_grid != NULL) {
+        Sweep_grid grid;
+        if (options.path_amount < 2 || !load_sweep_grid(&grid, options.sweep_grid)) {
+            print_usage(argv[0]);
+            return 1;
+        }
+        return run_sweep(&options.pipeline, &grid, options.paths[0], options.paths + 1, options.path_amount - 1);
+    }
+
+    Scratch_arena* arena = create_scratch_arena();
+    if (arena == NULL) {
+        return 1;
+    }
+    if (options.sequence) {
+        const int result = run_sequence(&options, &pipeline, arena);
+        destroy_scratch_arena(arena);
+        return result;
+    }
+    char* input_path = options.paths[0];
+    char* output_path = options.paths[1];
+
+    // Without counters the run goes on unmeasured, and the report says so
+    Perf_counters counters;
+    if (options.perf_counters && open_perf_counters(&counters)) {
+        pipeline.counters = &counters;
+    }
+
+    char description[128];
+    describe_pipeline(&pipeline, description, sizeof(description));
+    printf("Pipeline: %s\n", description);
+
+    // Read the input image from file, decoding straight to grayscale
+    start = clock();
+    read_bitmap_grayscale(input_path, arena->front, options.annotate ? original_image : NULL);
 
     Cell_list* cell_list = create_cell_list();
-    int i = 0;
-    while (erode_image(grayscale_image)) {
-        //detect_cells(grayscale_image, 12, 1, cell_list);
-        detect_cells_quick(grayscale_image, cell_list);
-        convert_to_RGB(grayscale_image, rgb_image);
-
-        char suffix[32];
-        snprintf(suffix, sizeof(suffix), "_erode%d", i);
-        construct_output_path(output_filename, FILENAME_BUFFER_SIZE, argv[2], suffix);
-        write_bitmap(rgb_image, output_filename);
-        i++;
-    }
-    draw_points(original_image, cell_list);
+    Pipeline_stats stats;
+    int threshold;
+    // The key is taken before the pipeline overwrites the decoded image
+    const unsigned long long cache_key = result_cache != NULL ? result_cache_key(arena->front, &options.pipeline) : 0;
+    const bool cached = result_cache != NULL && lookup_result_cache(result_cache, cache_key, cell_list, &threshold);
+    if (!cached) {
+        threshold = run_pipeline(&pipeline, arena, cell_list, output_path, &stats);
+        // A run the deadline cut short is not the image's result, so it is not cached
+        if (result_cache != NULL && !stats.deadline_expired) {
+            store_result_cache(result_cache, cache_key, cell_list, threshold);
+        }
+    }
+    printf("The threshold is %i\n", threshold);
+    if (!cached && options.pipeline.deadline_ms > 0) {
+        printf("Deadline of %d ms %s after %d erosion passes\n", options.pipeline.deadline_ms,
+               stats.deadline_expired ? "expired" : "met", stats.erosion_passes);
+    }
+    if (!cached && stats.threshold_tiles > 0) {
+        printf("Tiled threshold: %d tiles from %d to %d, %d on the global threshold\n", stats.threshold_tiles,
+               stats.tile_threshold_min, stats.tile_threshold_max, stats.fallback_tiles);
+    }
+    if (!cached) {
+        report_rois(&options.pipeline, &stats);
+    }
+    if (!cached && options.pipeline.pyramid_factor > 1 && options.pipeline.pyramid_compare) {
+        printf("Pyramid: %d cells, full resolution: %d cells, %d matched (mean offset %.2f px), "
+               "pixel visits %ld vs %ld\n", cell_list->cell_amount, stats.reference_cells, stats.matched_cells,
+               stats.mean_offset, stats.pixel_visits, stats.reference_pixel_visits);
+    }
+
+    if (options.annotate) {
+        draw_points(original_image, cell_list);
+    }
     printf("Drew %d points \n", cell_list->cell_amount);
     destroy_cell_list(cell_list);
     end = clock();
     cpu_time_used = end - start;
     printf("Time used: %f \n", cpu_time_used);
-    write_bitmap(original_image, argv[2]);
-}
\ No newline at end of file
+    if (options.perf_counters && !cached) {
+        report_perf_counters(&stats, output_path);
+    }
+    if (result_cache != NULL) {
+        report_result_cache(result_cache);
+    }
+    if (options.annotate) {
+        write_bitmap(original_image, output_path);
+    }
+    if (pipeline.counters != NULL) {
+        close_perf_counters(&counters);
+    }
+    destroy_scratch_arena(arena);
+}
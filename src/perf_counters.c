@@ -0,0 +1,163 @@
+#include "perf_counters.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+static const char* counter_names[] = {"cycles", "instructions", "l1d_misses", "llc_misses", "branch_misses"};
+
+const char* perf_counter_name(const Perf_counter counter) {
+    return counter_names[counter];
+}
+
+void clear_perf_sample(Perf_sample* sample) {
+    for (int i = 0; i < PERF_COUNTER_AMOUNT; i++) {
+        sample->values[i] = -1;
+        sample->scaled[i] = false;
+    }
+}
+
+#ifdef __linux__
+
+// What read returns with PERF_FORMAT_TOTAL_TIME_ENABLED and PERF_FORMAT_TOTAL_TIME_RUNNING
+typedef struct {
+    unsigned long long value;
+    unsigned long long time_enabled;
+    unsigned long long time_running;
+} Counter_reading;
+
+static void describe_counter(const Perf_counter counter, struct perf_event_attr* attr) {
+    memset(attr, 0, sizeof(*attr));
+    attr->size = sizeof(*attr);
+    switch (counter) {
+        case PERF_CYCLES:
+            attr->type = PERF_TYPE_HARDWARE;
+            attr->config = PERF_COUNT_HW_CPU_CYCLES;
+            break;
+        case PERF_INSTRUCTIONS:
+            attr->type = PERF_TYPE_HARDWARE;
+            attr->config = PERF_COUNT_HW_INSTRUCTIONS;
+            break;
+        case PERF_L1D_MISSES:
+            attr->type = PERF_TYPE_HW_CACHE;
+            attr->config = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                           (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+            break;
+        case PERF_LLC_MISSES:
+            attr->type = PERF_TYPE_HARDWARE;
+            attr->config = PERF_COUNT_HW_CACHE_MISSES;
+            break;
+        default:
+            attr->type = PERF_TYPE_HARDWARE;
+            attr->config = PERF_COUNT_HW_BRANCH_MISSES;
+            break;
+    }
+    attr->disabled = 1;
+    // With more counters than the PMU has slots the kernel time-shares them, which these times reveal
+    attr->read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    // User space only, which is also what an unprivileged process is allowed to count
+    attr->exclude_kernel = 1;
+    attr->exclude_hv = 1;
+}
+
+bool open_perf_counters(Perf_counters* counters) {
+    int last_error = 0;
+    counters->any_available = false;
+    for (int i = 0; i < PERF_COUNTER_AMOUNT; i++) {
+        struct perf_event_attr attr;
+        describe_counter((Perf_counter)i, &attr);
+        counters->time_enabled[i] = 0;
+        counters->time_running[i] = 0;
+        counters->fds[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (counters->fds[i] < 0) {
+            last_error = errno;
+        } else {
+            counters->any_available = true;
+        }
+    }
+    if (!counters->any_available) {
+        fprintf(stderr, "Performance counters unavailable: %s\n", strerror(last_error));
+    }
+    return counters->any_available;
+}
+
+void close_perf_counters(Perf_counters* counters) {
+    for (int i = 0; i < PERF_COUNTER_AMOUNT; i++) {
+        if (counters->fds[i] >= 0) {
+            close(counters->fds[i]);
+            counters->fds[i] = -1;
+        }
+    }
+    counters->any_available = false;
+}
+
+void start_perf_counters(Perf_counters* counters) {
+    if (counters == NULL) return;
+    for (int i = 0; i < PERF_COUNTER_AMOUNT; i++) {
+        if (counters->fds[i] < 0) continue;
+        Counter_reading reading;
+        if (read(counters->fds[i], &reading, sizeof(reading)) == sizeof(reading)) {
+            counters->time_enabled[i] = reading.time_enabled;
+            counters->time_running[i] = reading.time_running;
+        }
+        ioctl(counters->fds[i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(counters->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+void stop_perf_counters(Perf_counters* counters, Perf_sample* sample) {
+    if (counters == NULL) return;
+    // Stop everything first so reading one counter is not counted by the others
+    for (int i = 0; i < PERF_COUNTER_AMOUNT; i++) {
+        if (counters->fds[i] >= 0) {
+            ioctl(counters->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+        }
+    }
+    for (int i = 0; i < PERF_COUNTER_AMOUNT; i++) {
+        Counter_reading reading;
+        if (counters->fds[i] < 0 || read(counters->fds[i], &reading, sizeof(reading)) != sizeof(reading)) continue;
+        const unsigned long long enabled = reading.time_enabled - counters->time_enabled[i];
+        const unsigned long long running = reading.time_running - counters->time_running[i];
+        // A counter that never got a slot during the interval counted nothing it could be scaled from
+        if (running == 0) continue;
+        long long count = (long long)reading.value;
+        if (running < enabled) {
+            count = (long long)((double)reading.value * (double)enabled / (double)running);
+            sample->scaled[i] = true;
+        }
+        sample->values[i] = (sample->values[i] < 0 ? 0 : sample->values[i]) + count;
+    }
+}
+
+#else
+
+bool open_perf_counters(Perf_counters* counters) {
+    for (int i = 0; i < PERF_COUNTER_AMOUNT; i++) {
+        counters->fds[i] = -1;
+    }
+    counters->any_available = false;
+    fprintf(stderr, "Performance counters unavailable: perf_event_open needs Linux\n");
+    return false;
+}
+
+void close_perf_counters(Perf_counters* counters) {
+    (void)counters;
+}
+
+void start_perf_counters(Perf_counters* counters) {
+    (void)counters;
+}
+
+void stop_perf_counters(Perf_counters* counters, Perf_sample* sample) {
+    (void)counters;
+    (void)sample;
+}
+
+#endif
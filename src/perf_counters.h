@@ -0,0 +1,74 @@
+#ifndef CELL_DETECTION_PERF_COUNTERS_H
+#define CELL_DETECTION_PERF_COUNTERS_H
+
+#include <stdbool.h>
+
+typedef enum {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_L1D_MISSES,
+    PERF_LLC_MISSES,
+    PERF_BRANCH_MISSES,
+    PERF_COUNTER_AMOUNT
+} Perf_counter;
+
+// Hardware counters of the calling thread, opened with perf_event_open.
+// A counter the kernel or the machine does not offer stays closed and reads as unavailable.
+typedef struct {
+    int fds[PERF_COUNTER_AMOUNT];
+    bool any_available;
+    // How long each counter had been enabled and running when it was last started, in nanoseconds.
+    // The kernel keeps these running across resets, so intervals are measured from them.
+    unsigned long long time_enabled[PERF_COUNTER_AMOUNT];
+    unsigned long long time_running[PERF_COUNTER_AMOUNT];
+} Perf_counters;
+
+// Counts accumulated over one or more measured intervals, -1 where the counter is unavailable
+typedef struct {
+    long long values[PERF_COUNTER_AMOUNT];
+    // Set where the kernel multiplexed the counter with others for part of an interval. Its count is then
+    // scaled up from the time it was running to the whole interval, so it is an estimate.
+    bool scaled[PERF_COUNTER_AMOUNT];
+} Perf_sample;
+
+/**
+ * @brief Opens every counter that is available. Prints why if none of them is.
+ *
+ * @param counters The counters to open.
+ * @return True if at least one counter could be opened, false otherwise.
+ */
+bool open_perf_counters(Perf_counters* counters);
+
+/**
+ * @brief Closes the counters that were opened.
+ * @param counters The counters to close.
+ */
+void close_perf_counters(Perf_counters* counters);
+
+/**
+ * @brief Clears a sample so measurements can be accumulated into it.
+ * @param sample The sample to clear.
+ */
+void clear_perf_sample(Perf_sample* sample);
+
+/**
+ * @brief Resets and starts the counters.
+ * @param counters The counters to start, or NULL to do nothing.
+ */
+void start_perf_counters(Perf_counters* counters);
+
+/**
+ * @brief Stops the counters and adds their counts to a sample.
+ * Counts of counters that only ran for part of the interval are scaled up to all of it and marked as scaled.
+ *
+ * @param counters The counters to stop, or NULL to do nothing.
+ * @param sample The sample to add to.
+ */
+void stop_perf_counters(Perf_counters* counters, Perf_sample* sample);
+
+/**
+ * @brief Returns the column name of a counter.
+ */
+const char* perf_counter_name(Perf_counter counter);
+
+#endif // CELL_DETECTION_PERF_COUNTERS_H
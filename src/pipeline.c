@@ -0,0 +1,929 @@
+#include "pipeline.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+
+#define CONFIG_LINE_SIZE 256
+
+static const char* blur_names[] = {"none", "gaussian3x3", "gaussian5x5", "sharpen", "median", "guided"};
+static const char* threshold_names[] = {"otsu", "fixed", "tiled"};
+static const char* detector_names[] = {"quick", "window"};
+static const char* engine_names[] = {"dense", "rle"};
+static const char* stage_names[] = {"blur", "threshold", "erosion", "detection"};
+static const char* roi_threshold_names[] = {"global", "local"};
+
+static bool parse_int(const char* value, int* result) {
+    char* end;
+    const long parsed = strtol(value, &end, 10);
+    if (end == value || *end != '\0') {
+        return false;
+    }
+    *result = (int)parsed;
+    return true;
+}
+
+static bool parse_name(const char* value, const char** names, const int name_amount, int* result) {
+    for (int i = 0; i < name_amount; i++) {
+        if (strcmp(value, names[i]) == 0) {
+            *result = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+void default_pipeline_config(Pipeline_config* config) {
+    config->blur = BLUR_GAUSSIAN_3X3;
+    config->blur_passes = 2;
+    config->filter_radius = 2;
+    config->guided_epsilon = 1000;
+    config->threshold_method = THRESHOLD_OTSU;
+    config->threshold_value = 128;
+    config->threshold_offset = 0;
+    config->threshold_tile_size = 128;
+    config->threshold_min_separation = 32;
+    config->detector = DETECTOR_QUICK;
+    config->frame_radius = 6;
+    config->detection_area_size = 12;
+    config->exclusion_frame_thickness = 1;
+    config->engine = ENGINE_DENSE;
+    config->fused = true;
+    config->pyramid_factor = 0;
+    config->pyramid_compare = false;
+    config->debug_images = true;
+    config->roi_amount = 0;
+    config->roi_local_threshold = false;
+    config->roi_margin = 32;
+    config->deadline_ms = 0;
+}
+
+/**
+ * @brief Parses a region of interest written as x,y,width,height, which must lie inside the image.
+ */
+static bool parse_roi(const char* value, Image_region* region) {
+    int x, y, width, height;
+    char end;
+    if (sscanf(value, "%d,%d,%d,%d%c", &x, &y, &width, &height, &end) != 4) {
+        return false;
+    }
+    if (x < 0 || y < 0 || width < 1 || height < 1 || x + width > BMP_WIDTH || y + height > BMP_HEIGHT) {
+        return false;
+    }
+    region->x0 = x;
+    region->x1 = x + width;
+    region->y0 = y;
+    region->y1 = y + height;
+    return true;
+}
+
+bool set_pipeline_option(Pipeline_config* config, const char* key, const char* value) {
+    int parsed;
+    if (strcmp(key, "blur") == 0) {
+        if (!parse_name(value, blur_names, 6, &parsed)) return false;
+        config->blur = (Blur_type)parsed;
+    } else if (strcmp(key, "blur_passes") == 0) {
+        if (!parse_int(value, &parsed) || parsed < 0) return false;
+        config->blur_passes = parsed;
+    } else if (strcmp(key, "filter_radius") == 0) {
+        if (!parse_int(value, &parsed) || parsed < 1 || parsed > DENOISE_MAX_RADIUS) return false;
+        config->filter_radius = parsed;
+    } else if (strcmp(key, "guided_epsilon") == 0) {
+        if (!parse_int(value, &parsed) || parsed < 1) return false;
+        config->guided_epsilon = parsed;
+    } else if (strcmp(key, "threshold") == 0) {
+        if (!parse_name(value, threshold_names, 3, &parsed)) return false;
+        config->threshold_method = (Threshold_method)parsed;
+    } else if (strcmp(key, "threshold_value") == 0) {
+        if (!parse_int(value, &parsed) || parsed < 0 || parsed > 255) return false;
+        config->threshold_value = parsed;
+    } else if (strcmp(key, "threshold_offset") == 0) {
+        if (!parse_int(value, &parsed)) return false;
+        config->threshold_offset = parsed;
+    } else if (strcmp(key, "threshold_tile") == 0) {
+        if (!parse_int(value, &parsed) || parsed < THRESHOLD_MIN_TILE_SIZE) return false;
+        config->threshold_tile_size = parsed;
+    } else if (strcmp(key, "threshold_separation") == 0) {
+        if (!parse_int(value, &parsed) || parsed < 0) return false;
+        config->threshold_min_separation = parsed;
+    } else if (strcmp(key, "detector") == 0) {
+        if (!parse_name(value, detector_names, 2, &parsed)) return false;
+        config->detector = (Detector_type)parsed;
+    } else if (strcmp(key, "frame_radius") == 0) {
+        if (!parse_int(value, &parsed) || parsed < 1) return false;
+        config->frame_radius = parsed;
+    } else if (strcmp(key, "detection_area") == 0) {
+        if (!parse_int(value, &parsed) || parsed < 1) return false;
+        config->detection_area_size = parsed;
+    } else if (strcmp(key, "exclusion_frame") == 0) {
+        if (!parse_int(value, &parsed) || parsed < 0) return false;
+        config->exclusion_frame_thickness = parsed;
+    } else if (strcmp(key, "engine") == 0) {
+        if (!parse_name(value, engine_names, 2, &parsed)) return false;
+        config->engine = (Binary_engine)parsed;
+    } else if (strcmp(key, "fused") == 0) {
+        if (!parse_int(value, &parsed)) return false;
+        config->fused = parsed != 0;
+    } else if (strcmp(key, "pyramid") == 0) {
+        if (!parse_int(value, &parsed) || (parsed != 0 && parsed != 2 && parsed != 4)) return false;
+        config->pyramid_factor = parsed;
+    } else if (strcmp(key, "pyramid_compare") == 0) {
+        if (!parse_int(value, &parsed)) return false;
+        config->pyramid_compare = parsed != 0;
+    } else if (strcmp(key, "debug_images") == 0) {
+        if (!parse_int(value, &parsed)) return false;
+        config->debug_images = parsed != 0;
+    } else if (strcmp(key, "roi") == 0) {
+        // Every roi option adds a region, so a configuration file lists one per line
+        if (strcmp(value, "none") == 0) {
+            config->roi_amount = 0;
+            return true;
+        }
+        if (config->roi_amount == PIPELINE_MAX_ROIS || !parse_roi(value, &config->rois[config->roi_amount])) {
+            return false;
+        }
+        config->roi_amount++;
+    } else if (strcmp(key, "roi_threshold") == 0) {
+        if (!parse_name(value, roi_threshold_names, 2, &parsed)) return false;
+        config->roi_local_threshold = parsed == 1;
+    } else if (strcmp(key, "roi_margin") == 0) {
+        if (!parse_int(value, &parsed) || parsed < 0) return false;
+        config->roi_margin = parsed;
+    } else if (strcmp(key, "deadline") == 0) {
+        if (!parse_int(value, &parsed) || parsed < 0) return false;
+        config->deadline_ms = parsed;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+bool load_pipeline_config(Pipeline_config* config, const char* file_path) {
+    FILE* fp = fopen(file_path, "r");
+    if (fp == NULL) {
+        perror("Error opening config file");
+        return false;
+    }
+
+    char line[CONFIG_LINE_SIZE];
+    int line_number = 0;
+    bool valid = true;
+    while (fgets(line, sizeof(line), fp)) {
+        line_number++;
+        char* text = trim(line);
+        if (*text == '\0' || *text == '#') continue;
+
+        char* separator = strchr(text, '=');
+        if (separator == NULL) {
+            fprintf(stderr, "%s:%d: expected key = value\n", file_path, line_number);
+            valid = false;
+            continue;
+        }
+        *separator = '\0';
+        const char* key = trim(text);
+        const char* value = trim(separator + 1);
+        if (!set_pipeline_option(config, key, value)) {
+            fprintf(stderr, "%s:%d: invalid option %s = %s\n", file_path, line_number, key, value);
+            valid = false;
+        }
+    }
+    fclose(fp);
+    return valid;
+}
+
+void build_pipeline(const Pipeline_config* config, Pipeline* pipeline) {
+    pipeline->config = *config;
+
+    switch (config->blur) {
+        case BLUR_GAUSSIAN_3X3:
+            pipeline->blur = gaussian_blur_3x3_into;
+            pipeline->region_blur = gaussian_blur_3x3_region_into;
+            break;
+        case BLUR_GAUSSIAN_5X5:
+            pipeline->blur = gaussian_blur_5x5_into;
+            pipeline->region_blur = gaussian_blur_5x5_region_into;
+            break;
+        case BLUR_SHARPEN:
+            pipeline->blur = sharpen_image_into;
+            pipeline->region_blur = sharpen_image_region_into;
+            break;
+        default:
+            pipeline->blur = NULL;
+            pipeline->region_blur = NULL;
+            break;
+    }
+
+    if (config->detector == DETECTOR_QUICK) {
+        pipeline->detector = get_quick_detector(config->frame_radius);
+        pipeline->fused_sweep = get_fused_sweep(config->frame_radius);
+    } else {
+        pipeline->fused_sweep = NULL;
+        pipeline->detector = get_window_detector(config->detection_area_size, config->exclusion_frame_thickness);
+    }
+    pipeline->counters = NULL;
+}
+
+const char* pipeline_stage_name(const Pipeline_stage stage) {
+    return stage_names[stage];
+}
+
+void describe_pipeline(const Pipeline* pipeline, char* buffer, const size_t buffer_size) {
+    const Pipeline_config* config = &pipeline->config;
+    char blur[32];
+    char threshold[32];
+    char detector[48];
+
+    if (config->blur == BLUR_MEDIAN || config->blur == BLUR_GUIDED) {
+        snprintf(blur, sizeof(blur), "%s(%d)", blur_names[config->blur], config->filter_radius);
+    } else {
+        snprintf(blur, sizeof(blur), "%s", blur_names[config->blur]);
+    }
+
+    if (config->threshold_method == THRESHOLD_FIXED) {
+        snprintf(threshold, sizeof(threshold), "fixed(%d)", config->threshold_value);
+    } else if (config->threshold_method == THRESHOLD_TILED) {
+        snprintf(threshold, sizeof(threshold), "tiled(%d,%d)%+d", config->threshold_tile_size,
+                 config->threshold_min_separation, config->threshold_offset);
+    } else {
+        snprintf(threshold, sizeof(threshold), "otsu%+d", config->threshold_offset);
+    }
+    if (config->pyramid_factor > 1) {
+        snprintf(detector, sizeof(detector), "pyramid(x%d,%d)", config->pyramid_factor, config->frame_radius);
+    } else if (config->detector == DETECTOR_QUICK) {
+        snprintf(detector, sizeof(detector), "quick(%d)", config->frame_radius);
+    } else {
+        snprintf(detector, sizeof(detector), "window(%d,%d)", config->detection_area_size,
+                 config->exclusion_frame_thickness);
+    }
+    snprintf(buffer, buffer_size, "blur=%s x%d threshold=%s detector=%s%s%s", blur,
+             config->blur_passes, threshold, detector, pipeline->detector ? "" : " (generic)",
+             config->engine == ENGINE_RLE ? " engine=rle" : (config->fused ? "" : " unfused"));
+    if (config->roi_amount > 0) {
+        const size_t length = strlen(buffer);
+        snprintf(buffer + length, buffer_size - length, " rois=%d(%s,+%d)", config->roi_amount,
+                 roi_threshold_names[config->roi_local_threshold], config->roi_margin);
+    }
+    if (config->deadline_ms > 0) {
+        const size_t length = strlen(buffer);
+        snprintf(buffer + length, buffer_size - length, " deadline=%dms", config->deadline_ms);
+    }
+}
+
+Scratch_arena* create_scratch_arena(void) {
+    Scratch_arena* arena = malloc(sizeof(Scratch_arena));
+    if (arena == NULL) {
+        fprintf(stderr, "Failed to allocate scratch arena\n");
+        return NULL;
+    }
+    arena->front = arena->planes[0];
+    arena->back = arena->planes[1];
+    // Unknown until the first pass is measured, so the first pass always runs
+    memset(&arena->erosion_cost, 0, sizeof(arena->erosion_cost));
+    memset(&arena->rle_cost, 0, sizeof(arena->rle_cost));
+    return arena;
+}
+
+void destroy_scratch_arena(Scratch_arena* arena) {
+    free(arena);
+}
+
+void swap_scratch_buffers(Scratch_arena* arena) {
+    unsigned char (*front)[BMP_HEIGHT] = arena->front;
+    arena->front = arena->back;
+    arena->back = front;
+}
+
+void run_blur_stages(const Pipeline* pipeline, Scratch_arena* arena) {
+    const Pipeline_config* config = &pipeline->config;
+    if (config->blur == BLUR_NONE) {
+        return;
+    }
+    for (int i = 0; i < config->blur_passes; i++) {
+        // The denoise filters take a radius, the convolutions are resolved to a fixed stage
+        if (config->blur == BLUR_MEDIAN) {
+            median_filter_into(arena->front, arena->back, config->filter_radius, &arena->denoise);
+        } else if (config->blur == BLUR_GUIDED) {
+            guided_filter_into(arena->front, arena->back, config->filter_radius, config->guided_epsilon,
+                               &arena->denoise);
+        } else {
+            pipeline->blur(arena->front, arena->back);
+        }
+        swap_scratch_buffers(arena);
+    }
+}
+
+int run_threshold_stage(const Pipeline* pipeline, unsigned char image[BMP_WIDTH][BMP_HEIGHT]) {
+    const Pipeline_config* config = &pipeline->config;
+    if (config->threshold_method == THRESHOLD_FIXED) {
+        return config->threshold_value;
+    }
+
+    const int threshold = otsu_threshold_value(image) + config->threshold_offset;
+    return threshold < 0 ? 0 : (threshold > 255 ? 255 : threshold);
+}
+
+int threshold_from_histogram(const Pipeline_config* config, const int histogram[256]) {
+    if (config->threshold_method == THRESHOLD_FIXED) {
+        return config->threshold_value;
+    }
+
+    const int threshold = otsu_threshold_from_histogram(histogram) + config->threshold_offset;
+    return threshold < 0 ? 0 : (threshold > 255 ? 255 : threshold);
+}
+
+int run_binarize_stage(const Pipeline* pipeline, Scratch_arena* arena, Pipeline_stats* stats) {
+    const Pipeline_config* config = &pipeline->config;
+    if (config->threshold_method != THRESHOLD_TILED) {
+        const int threshold = run_threshold_stage(pipeline, arena->front);
+        binary_threshold(arena->front, threshold);
+        return threshold;
+    }
+
+    Threshold_map* map = &arena->threshold_map;
+    compute_threshold_map(arena->front, config->threshold_tile_size, config->threshold_min_separation,
+                          config->threshold_offset, map);
+    binary_threshold_map_into(arena->front, arena->back, map);
+    swap_scratch_buffers(arena);
+    if (stats != NULL) {
+        stats->threshold_tiles = map->tiles_x * map->tiles_y;
+        stats->fallback_tiles = map->fallback_tiles;
+        stats->tile_threshold_min = 255;
+        stats->tile_threshold_max = 0;
+        for (int tile_x = 0; tile_x < map->tiles_x; tile_x++) {
+            for (int tile_y = 0; tile_y < map->tiles_y; tile_y++) {
+                const int threshold = map->thresholds[tile_x][tile_y];
+                if (threshold < stats->tile_threshold_min) stats->tile_threshold_min = threshold;
+                if (threshold > stats->tile_threshold_max) stats->tile_threshold_max = threshold;
+            }
+        }
+    }
+    return map->global_threshold;
+}
+
+int run_detection_stage(const Pipeline* pipeline, unsigned char image[BMP_WIDTH][BMP_HEIGHT],
+                        bool tile_mask[TILES_X][TILES_Y], Cell_list* cell_list) {
+    if (pipeline->detector != NULL) {
+        return pipeline->detector(image, tile_mask, cell_list);
+    }
+
+    const Pipeline_config* config = &pipeline->config;
+    if (config->detector == DETECTOR_QUICK) {
+        return detect_cells_quick_with_radius(image, tile_mask, config->frame_radius, cell_list);
+    }
+    const int before = cell_list->cell_amount;
+    detect_cells(image, config->detection_area_size, config->exclusion_frame_thickness, cell_list);
+    return cell_list->cell_amount - before;
+}
+
+int detection_reach(const Pipeline_config* config) {
+    // A quick detection clears the box one pixel past its outer frame, a window detection reads its frame.
+    // The pyramid scales the radius down, so its frames are one coarse pixel wide.
+    if (config->pyramid_factor > 1) {
+        return config->frame_radius + 2 * config->pyramid_factor;
+    }
+    if (config->detector == DETECTOR_QUICK) {
+        return config->frame_radius + 2;
+    }
+    return config->detection_area_size / 2 + config->exclusion_frame_thickness;
+}
+
+static void write_debug_image(unsigned char image[BMP_WIDTH][BMP_HEIGHT], const char* output_path,
+                              const char* suffix) {
+    char output_filename[256];
+    construct_output_path(output_filename, sizeof(output_filename), output_path, suffix);
+    write_bitmap_grayscale(image, output_filename);
+}
+
+static long count_tile_pixels(bool tile_mask[TILES_X][TILES_Y]) {
+    long pixels = 0;
+    int x0, x1, y0, y1;
+    for (int tile_x = 0; tile_x < TILES_X; tile_x++) {
+        for (int tile_y = 0; tile_y < TILES_Y; tile_y++) {
+            if (!tile_mask[tile_x][tile_y]) continue;
+            get_tile_bounds(tile_x, tile_y, &x0, &x1, &y0, &y1);
+            pixels += (long)(x1 - x0) * (y1 - y0);
+        }
+    }
+    return pixels;
+}
+
+// How much every measured pass weighs less once another one is added
+#define PASS_COST_DECAY 0.98
+
+static void add_pass_cost(Pass_cost_model* model, const double work, const double seconds) {
+    model->weight = model->weight * PASS_COST_DECAY + 1;
+    model->work = model->work * PASS_COST_DECAY + work;
+    model->seconds = model->seconds * PASS_COST_DECAY + seconds;
+    model->work_squared = model->work_squared * PASS_COST_DECAY + work * work;
+    model->work_seconds = model->work_seconds * PASS_COST_DECAY + work * seconds;
+}
+
+/**
+ * @brief Predicts the seconds a pass over some work takes, 0 before any pass was measured.
+ */
+static double predict_pass_cost(const Pass_cost_model* model, const double work) {
+    if (model->weight == 0) return 0;
+    const double mean_work = model->work / model->weight;
+    const double mean_seconds = model->seconds / model->weight;
+    const double variance = model->work_squared / model->weight - mean_work * mean_work;
+    // Until passes of different sizes were seen, the cost is taken as proportional to the work
+    if (variance <= mean_work * mean_work * 1e-6) {
+        return mean_work > 0 ? mean_seconds * work / mean_work : mean_seconds;
+    }
+    const double per_unit = (model->work_seconds / model->weight - mean_work * mean_seconds) / variance;
+    if (per_unit <= 0) {
+        return mean_seconds;
+    }
+    const double fixed = mean_seconds - per_unit * mean_work;
+    if (fixed < 0) {
+        // A line through few, noisy passes can cross zero, a line through the origin cannot overshoot like that
+        return model->work_seconds / model->work_squared * work;
+    }
+    return fixed + per_unit * work;
+}
+
+/**
+ * @brief Checks whether a pass predicted to take some time still ends before the deadline, 0 for none.
+ */
+static bool pass_fits_deadline(const double deadline, const double predicted_seconds) {
+    return deadline <= 0 || now_seconds() + predicted_seconds <= deadline;
+}
+
+/**
+ * @brief The erosion and detection loop on the run-length engine. Its cost follows the number of runs.
+ * The fully eroded image is decoded back to the front buffer at the end.
+ * Stops early, with the image as far as it got, when the next pass is not predicted to end before the deadline.
+ * @return The number of runs read by erosion.
+ */
+static long run_rle_erosion_loop(const Pipeline* pipeline, Scratch_arena* arena, Cell_list* cell_list,
+                                 const char* debug_output_path, const double deadline, Pipeline_stats* stats) {
+    Rle_image* front = &arena->rle[0];
+    Rle_image* back = &arena->rle[1];
+    rle_encode(arena->front, front);
+
+    long run_visits = rle_run_amount(front);
+    int i = 0;
+    while (true) {
+        const long pass_runs = rle_run_amount(front);
+        if (!pass_fits_deadline(deadline, predict_pass_cost(&arena->rle_cost, pass_runs))) {
+            stats->deadline_expired = true;
+            break;
+        }
+        const double pass_started = now_seconds();
+        start_perf_counters(pipeline->counters);
+        const bool has_eroded = rle_erode(front, back);
+        stop_perf_counters(pipeline->counters, &stats->stage_counters[STAGE_EROSION]);
+        if (!has_eroded) break;
+
+        Rle_image* swap = front;
+        front = back;
+        back = swap;
+        start_perf_counters(pipeline->counters);
+        rle_detect_cells(front, pipeline->config.frame_radius, cell_list);
+        stop_perf_counters(pipeline->counters, &stats->stage_counters[STAGE_DETECTION]);
+        add_pass_cost(&arena->rle_cost, pass_runs, now_seconds() - pass_started);
+        run_visits += rle_run_amount(front);
+        if (debug_output_path != NULL) {
+            char suffix[32];
+            snprintf(suffix, sizeof(suffix), "_erode%d", i);
+            rle_decode(front, arena->back);
+            write_debug_image(arena->back, debug_output_path, suffix);
+        }
+        i++;
+    }
+    rle_decode(front, arena->front);
+    stats->erosion_passes = stats->deadline_expired ? i : i + 1;
+    return run_visits;
+}
+
+/**
+ * @brief Erodes the binary image in the front buffer until nothing changes, detecting after every pass.
+ * Stops early, with the cells found so far, when the next pass is not predicted to end before the deadline.
+ * @return The number of pixels read by erosion and detection.
+ */
+static long run_erosion_loop(const Pipeline* pipeline, Scratch_arena* arena, bool tile_mask[TILES_X][TILES_Y],
+                             Cell_list* cell_list, const char* debug_output_path, const double deadline,
+                             Pipeline_stats* stats) {
+    // Each erosion pass narrows the tiles down to those still holding white pixels,
+    // so late passes only touch the few remaining blobs
+    bool active_tiles[TILES_X][TILES_Y];
+    if (tile_mask != NULL) {
+        memcpy(active_tiles, tile_mask, sizeof(active_tiles));
+    } else {
+        memset(active_tiles, true, sizeof(active_tiles));
+    }
+    const bool fused = pipeline->config.fused && pipeline->config.detector == DETECTOR_QUICK;
+
+    long visits = 0;
+    int i = 0;
+    while (true) {
+        // A pass costs about the same per pixel of its active tiles, whatever the tiles hold
+        const long pass_pixels = count_tile_pixels(active_tiles);
+        if (!pass_fits_deadline(deadline, predict_pass_cost(&arena->erosion_cost, pass_pixels))) {
+            stats->deadline_expired = true;
+            break;
+        }
+        visits += pass_pixels;
+        const double pass_started = now_seconds();
+        bool has_eroded;
+        start_perf_counters(pipeline->counters);
+        if (fused) {
+            // Detection happens inside the sweep, so its counts are part of the erosion stage
+            has_eroded = pipeline->fused_sweep != NULL
+                ? pipeline->fused_sweep(arena->front, arena->back, active_tiles, active_tiles, cell_list)
+                : erode_and_detect_tiles_into(arena->front, arena->back, active_tiles, active_tiles,
+                                              pipeline->config.frame_radius, cell_list);
+        } else {
+            has_eroded = erode_image_tiles_into(arena->front, arena->back, active_tiles, active_tiles);
+        }
+        stop_perf_counters(pipeline->counters, &stats->stage_counters[STAGE_EROSION]);
+        if (!has_eroded) break;
+
+        swap_scratch_buffers(arena);
+        if (!fused) {
+            visits += count_tile_pixels(active_tiles);
+            start_perf_counters(pipeline->counters);
+            run_detection_stage(pipeline, arena->front, active_tiles, cell_list);
+            stop_perf_counters(pipeline->counters, &stats->stage_counters[STAGE_DETECTION]);
+        }
+        add_pass_cost(&arena->erosion_cost, pass_pixels, now_seconds() - pass_started);
+        if (debug_output_path != NULL) {
+            char suffix[32];
+            snprintf(suffix, sizeof(suffix), "_erode%d", i);
+            write_debug_image(arena->front, debug_output_path, suffix);
+        }
+        i++;
+    }
+    stats->erosion_passes = stats->deadline_expired ? i : i + 1;
+    return visits;
+}
+
+static void clear_pipeline_stats(Pipeline_stats* stats) {
+    memset(stats, 0, sizeof(*stats));
+    for (int stage = 0; stage < PIPELINE_STAGE_AMOUNT; stage++) {
+        clear_perf_sample(&stats->stage_counters[stage]);
+    }
+}
+
+/**
+ * @brief The erosion and detection stages of run_cell_stages, adding to stats.
+ * The dense loop starts from the tiles in tile_mask, NULL for all, the other engines always read the whole image.
+ * The loops stop at the deadline, 0 for none. The pyramid is a single step and always completes.
+ */
+static void run_cell_stages_into(const Pipeline* pipeline, Scratch_arena* arena, bool tile_mask[TILES_X][TILES_Y],
+                                 Cell_list* cell_list, const char* debug_output_path, const double deadline,
+                                 Pipeline_stats* run_stats) {
+    const Pipeline_config* config = &pipeline->config;
+    if (config->pyramid_factor > 1) {
+        // The pyramid only reads the binary image, so the full-resolution loop can still run on it afterwards
+        start_perf_counters(pipeline->counters);
+        run_stats->pixel_visits += detect_cells_pyramid(arena->front, &arena->pyramid, config->pyramid_factor,
+                                                       config->frame_radius, cell_list);
+        stop_perf_counters(pipeline->counters, &run_stats->stage_counters[STAGE_DETECTION]);
+        if (config->pyramid_compare) {
+            Cell_list* reference = create_cell_list();
+            Pipeline_stats reference_stats;
+            clear_pipeline_stats(&reference_stats);
+            run_stats->reference_pixel_visits += run_erosion_loop(pipeline, arena, NULL, reference, NULL, 0,
+                                                                  &reference_stats);
+            run_stats->reference_cells = reference->cell_amount;
+            run_stats->matched_cells = match_cell_lists(cell_list, reference, 2 * config->pyramid_factor + 2,
+                                                        &run_stats->mean_offset);
+            destroy_cell_list(reference);
+        }
+    } else if (config->engine == ENGINE_RLE && config->detector == DETECTOR_QUICK) {
+        run_stats->pixel_visits += BMP_WIDTH * BMP_HEIGHT;
+        run_stats->run_visits += run_rle_erosion_loop(pipeline, arena, cell_list, debug_output_path, deadline,
+                                                      run_stats);
+    } else {
+        run_stats->pixel_visits += run_erosion_loop(pipeline, arena, tile_mask, cell_list, debug_output_path,
+                                                    deadline, run_stats);
+    }
+}
+
+void run_cell_stages(const Pipeline* pipeline, Scratch_arena* arena, Cell_list* cell_list, Pipeline_stats* stats) {
+    Pipeline_stats run_stats;
+    clear_pipeline_stats(&run_stats);
+    const Pipeline_config* config = &pipeline->config;
+    const double deadline = config->deadline_ms > 0 ? now_seconds() + config->deadline_ms * 1e-3 : 0;
+    run_cell_stages_into(pipeline, arena, NULL, cell_list, NULL, deadline, &run_stats);
+    if (stats != NULL) {
+        *stats = run_stats;
+    }
+}
+
+static int clamp_threshold(const int threshold) {
+    return threshold < 0 ? 0 : (threshold > 255 ? 255 : threshold);
+}
+
+static Image_region expand_region(const Image_region* region, const int margin) {
+    Image_region expanded;
+    expanded.x0 = region->x0 - margin > 0 ? region->x0 - margin : 0;
+    expanded.x1 = region->x1 + margin < BMP_WIDTH ? region->x1 + margin : BMP_WIDTH;
+    expanded.y0 = region->y0 - margin > 0 ? region->y0 - margin : 0;
+    expanded.y1 = region->y1 + margin < BMP_HEIGHT ? region->y1 + margin : BMP_HEIGHT;
+    return expanded;
+}
+
+static long region_area(const Image_region* region) {
+    return (long)(region->x1 - region->x0) * (region->y1 - region->y0);
+}
+
+static bool is_in_region(const Image_region* region, const int x, const int y) {
+    return x >= region->x0 && x < region->x1 && y >= region->y0 && y < region->y1;
+}
+
+static void copy_region(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT],
+                        unsigned char output_image[BMP_WIDTH][BMP_HEIGHT], const Image_region* region) {
+    for (int x = region->x0; x < region->x1; x++) {
+        memcpy(&output_image[x][region->y0], &input_image[x][region->y0], region->y1 - region->y0);
+    }
+}
+
+/**
+ * @brief Sets the tiles a region overlaps, and tile_margin more tiles around them.
+ */
+static void mark_region_tiles(const Image_region* region, const int tile_margin, bool tiles[TILES_X][TILES_Y]) {
+    const int first_x = region->x0 / TILE_SIZE - tile_margin;
+    const int last_x = (region->x1 - 1) / TILE_SIZE + tile_margin;
+    const int first_y = region->y0 / TILE_SIZE - tile_margin;
+    const int last_y = (region->y1 - 1) / TILE_SIZE + tile_margin;
+    memset(tiles, false, sizeof(bool) * TILES_X * TILES_Y);
+    for (int tile_x = first_x > 0 ? first_x : 0; tile_x <= last_x && tile_x < TILES_X; tile_x++) {
+        for (int tile_y = first_y > 0 ? first_y : 0; tile_y <= last_y && tile_y < TILES_Y; tile_y++) {
+            tiles[tile_x][tile_y] = true;
+        }
+    }
+}
+
+/**
+ * @brief Clears the tiles of a region and tile_margin tiles around them in both planes of the arena.
+ * With a margin covering the detector's reach, the cleared tiles are all erosion and detection see.
+ */
+static void clear_region_tiles(Scratch_arena* arena, const Image_region* region, const int tile_margin) {
+    bool tiles[TILES_X][TILES_Y];
+    mark_region_tiles(region, tile_margin, tiles);
+    int x0, x1, y0, y1;
+    for (int tile_x = 0; tile_x < TILES_X; tile_x++) {
+        for (int tile_y = 0; tile_y < TILES_Y; tile_y++) {
+            if (!tiles[tile_x][tile_y]) continue;
+            get_tile_bounds(tile_x, tile_y, &x0, &x1, &y0, &y1);
+            for (int x = x0; x < x1; x++) {
+                memset(&arena->front[x][y0], 0, y1 - y0);
+                memset(&arena->back[x][y0], 0, y1 - y0);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Blurs the processed regions into the arena's blurred plane, pass by pass over all of them.
+ * Each pass writes its regions a kernel radius wider than the next one reads, so the last pass is exact
+ * inside the processed regions. Overlapping regions write the same values, so their order does not matter.
+ */
+static void run_roi_blur_stages(const Pipeline* pipeline, Scratch_arena* arena, const Image_region* processed,
+                                Pipeline_stats* stats) {
+    const Pipeline_config* config = &pipeline->config;
+    const int amount = config->roi_amount;
+
+    if (config->blur != BLUR_NONE && pipeline->region_blur == NULL) {
+        // The denoise filters have no region variant, so they blur the whole image and share its cost
+        const double started = now_seconds();
+        run_blur_stages(pipeline, arena);
+        const double seconds = (now_seconds() - started) / amount;
+        for (int i = 0; i < amount; i++) {
+            stats->rois[i].blurred_pixels += (long)config->blur_passes * BMP_WIDTH * BMP_HEIGHT;
+            stats->rois[i].seconds += seconds;
+        }
+    } else if (config->blur != BLUR_NONE) {
+        const int reach = config->blur == BLUR_GAUSSIAN_5X5 ? 2 : 1;
+        for (int pass = 0; pass < config->blur_passes; pass++) {
+            const int margin = reach * (config->blur_passes - 1 - pass);
+            for (int i = 0; i < amount; i++) {
+                const double started = now_seconds();
+                const Image_region region = expand_region(&processed[i], margin);
+                pipeline->region_blur(arena->front, arena->back, &region);
+                stats->rois[i].blurred_pixels += region_area(&region);
+                stats->rois[i].seconds += now_seconds() - started;
+            }
+            swap_scratch_buffers(arena);
+        }
+    }
+    for (int i = 0; i < amount; i++) {
+        copy_region(arena->front, arena->blurred, &processed[i]);
+    }
+}
+
+/**
+ * @brief Computes the threshold of every region, from its own histogram or from that of all regions together.
+ */
+static void run_roi_threshold_stage(const Pipeline* pipeline, Scratch_arena* arena, int* thresholds,
+                                    Pipeline_stats* stats) {
+    const Pipeline_config* config = &pipeline->config;
+    const int amount = config->roi_amount;
+    if (config->threshold_method == THRESHOLD_FIXED) {
+        for (int i = 0; i < amount; i++) {
+            thresholds[i] = config->threshold_value;
+        }
+        return;
+    }
+
+    int pooled[256] = {0};
+    for (int i = 0; i < amount; i++) {
+        const double started = now_seconds();
+        if (config->roi_local_threshold) {
+            int histogram[256] = {0};
+            add_to_histogram(arena->blurred, &config->rois[i], histogram);
+            thresholds[i] = clamp_threshold(otsu_threshold_from_histogram(histogram) + config->threshold_offset);
+        } else {
+            add_to_histogram(arena->blurred, &config->rois[i], pooled);
+        }
+        stats->rois[i].seconds += now_seconds() - started;
+    }
+    if (!config->roi_local_threshold) {
+        const int threshold = clamp_threshold(otsu_threshold_from_histogram(pooled) + config->threshold_offset);
+        for (int i = 0; i < amount; i++) {
+            thresholds[i] = threshold;
+        }
+    }
+}
+
+/**
+ * @brief Moves the cells inside a region and outside all earlier ones to the front of cell_list and frees the rest.
+ * Cells in the margin belong to no region, and cells where regions overlap to the first of them.
+ * @return The number of cells moved.
+ */
+static int keep_region_cells(const Pipeline_config* config, const int roi, Cell_list* found, Cell_list* cell_list) {
+    Cell* kept_head = NULL;
+    Cell* kept_tail = NULL;
+    int kept = 0;
+    Cell* cell = found->head;
+    while (cell != NULL) {
+        Cell* next = cell->next;
+        bool keep = is_in_region(&config->rois[roi], cell->x, cell->y);
+        for (int i = 0; keep && i < roi; i++) {
+            keep = !is_in_region(&config->rois[i], cell->x, cell->y);
+        }
+        if (keep) {
+            // Appended, so the kept cells stay in the order the detector added them
+            cell->next = NULL;
+            if (kept_tail != NULL) {
+                kept_tail->next = cell;
+            } else {
+                kept_head = cell;
+            }
+            kept_tail = cell;
+            kept++;
+        } else {
+            free(cell);
+        }
+        cell = next;
+    }
+    found->head = NULL;
+    found->cell_amount = 0;
+
+    if (kept_tail != NULL) {
+        kept_tail->next = cell_list->head;
+        cell_list->head = kept_head;
+        cell_list->cell_amount += kept;
+    }
+    return kept;
+}
+
+/**
+ * @brief run_pipeline for a configuration with regions of interest.
+ *
+ * The regions are blurred together, thresholded, then binarized, eroded and scanned one at a time with their
+ * margins. The dense quick detector starts from the tiles of the region, so everything but the denoise filters
+ * follows the area of the regions. The run-length engine, the pyramid and the window detector read the whole
+ * image and are only correct, not faster.
+ * @return The threshold of the first region.
+ */
+static int run_roi_pipeline(const Pipeline* pipeline, Scratch_arena* arena, Cell_list* cell_list,
+                            const double deadline, Pipeline_stats* run_stats) {
+    const Pipeline_config* config = &pipeline->config;
+    const int amount = config->roi_amount;
+    const bool tiled = config->detector == DETECTOR_QUICK && config->engine == ENGINE_DENSE &&
+                       config->pyramid_factor <= 1;
+    // Erosion reads one pixel past the tiles it scans, the detector reads and clears further for a large radius
+    const int reach = detection_reach(config);
+    const int context_tiles = reach > 1 ? (reach + TILE_SIZE - 1) / TILE_SIZE : 1;
+
+    Image_region processed[PIPELINE_MAX_ROIS];
+    run_stats->roi_amount = amount;
+    for (int i = 0; i < amount; i++) {
+        processed[i] = expand_region(&config->rois[i], config->roi_margin);
+        run_stats->rois[i].processed_pixels = region_area(&processed[i]);
+    }
+
+    start_perf_counters(pipeline->counters);
+    run_roi_blur_stages(pipeline, arena, processed, run_stats);
+    stop_perf_counters(pipeline->counters, &run_stats->stage_counters[STAGE_BLUR]);
+
+    int thresholds[PIPELINE_MAX_ROIS];
+    start_perf_counters(pipeline->counters);
+    run_roi_threshold_stage(pipeline, arena, thresholds, run_stats);
+    stop_perf_counters(pipeline->counters, &run_stats->stage_counters[STAGE_THRESHOLD]);
+
+    if (!tiled) {
+        // These read the whole image, so everything but the region has to be black
+        memset(arena->planes, 0, sizeof(arena->planes));
+    }
+    Cell_list* found = create_cell_list();
+    for (int i = 0; i < amount; i++) {
+        const double started = now_seconds();
+        clear_region_tiles(arena, &processed[i], context_tiles);
+
+        start_perf_counters(pipeline->counters);
+        binary_threshold_region_into(arena->blurred, arena->front, &processed[i], thresholds[i]);
+        stop_perf_counters(pipeline->counters, &run_stats->stage_counters[STAGE_THRESHOLD]);
+
+        bool tile_mask[TILES_X][TILES_Y];
+        mark_region_tiles(&processed[i], 0, tile_mask);
+        run_cell_stages_into(pipeline, arena, tile_mask, found, NULL, deadline, run_stats);
+        // The pyramid leaves the binary region behind
+        clear_region_tiles(arena, &processed[i], context_tiles);
+
+        run_stats->rois[i].threshold = thresholds[i];
+        run_stats->rois[i].cells = keep_region_cells(config, i, found, cell_list);
+        run_stats->rois[i].seconds += now_seconds() - started;
+    }
+    destroy_cell_list(found);
+    return thresholds[0];
+}
+
+int run_pipeline(const Pipeline* pipeline, Scratch_arena* arena, Cell_list* cell_list,
+                 const char* debug_output_path, Pipeline_stats* stats) {
+    const Pipeline_config* config = &pipeline->config;
+    const bool debug = debug_output_path != NULL && config->debug_images;
+    // The budget covers the whole run, but only the erosion loop can end early
+    const double deadline = config->deadline_ms > 0 ? now_seconds() + config->deadline_ms * 1e-3 : 0;
+    Pipeline_stats run_stats;
+    clear_pipeline_stats(&run_stats);
+
+    if (config->roi_amount > 0) {
+        run_stats.threshold = run_roi_pipeline(pipeline, arena, cell_list, deadline, &run_stats);
+        if (stats != NULL) {
+            *stats = run_stats;
+        }
+        return run_stats.threshold;
+    }
+
+    start_perf_counters(pipeline->counters);
+    run_blur_stages(pipeline, arena);
+    stop_perf_counters(pipeline->counters, &run_stats.stage_counters[STAGE_BLUR]);
+    if (debug) {
+        write_debug_image(arena->front, debug_output_path, "_gaussian");
+    }
+
+    start_perf_counters(pipeline->counters);
+    const int threshold = run_binarize_stage(pipeline, arena, &run_stats);
+    stop_perf_counters(pipeline->counters, &run_stats.stage_counters[STAGE_THRESHOLD]);
+    if (debug) {
+        write_debug_image(arena->front, debug_output_path, "_binary");
+    }
+
+    run_cell_stages_into(pipeline, arena, NULL, cell_list, debug ? debug_output_path : NULL, deadline, &run_stats);
+
+    run_stats.threshold = threshold;
+    if (stats != NULL) {
+        *stats = run_stats;
+    }
+    return threshold;
+}
+
+bool same_blur_stage(const Pipeline_config* a, const Pipeline_config* b) {
+    if (a->blur != b->blur) return false;
+    if (a->blur == BLUR_NONE) return true;
+    if (a->blur_passes != b->blur_passes) return false;
+    if (a->blur != BLUR_MEDIAN && a->blur != BLUR_GUIDED) return true;
+    return a->filter_radius == b->filter_radius && (a->blur != BLUR_GUIDED || a->guided_epsilon == b->guided_epsilon);
+}
+
+bool same_threshold_stage(const Pipeline_config* a, const Pipeline_config* b) {
+    if (a->threshold_method != b->threshold_method) return false;
+    if (a->threshold_method == THRESHOLD_FIXED) return a->threshold_value == b->threshold_value;
+    if (a->threshold_offset != b->threshold_offset) return false;
+    return a->threshold_method != THRESHOLD_TILED || (a->threshold_tile_size == b->threshold_tile_size &&
+                                                      a->threshold_min_separation == b->threshold_min_separation);
+}
+
+void construct_output_path(char* output_buffer, const size_t buffer_size,
+                           const char* base_path, const char* suffix) {
+    const char* extension = strrchr(base_path, '.');
+    if (extension != NULL) {
+        const int basename_len = extension - base_path;
+        snprintf(output_buffer, buffer_size, "%.*s%s%s", basename_len, base_path, suffix, extension);
+    } else {
+        snprintf(output_buffer, buffer_size, "%s%s", base_path, suffix);
+    }
+}
+
+void construct_report_path(char* output_buffer, const size_t buffer_size,
+                           const char* base_path, const char* suffix_with_extension) {
+    const char* extension = strrchr(base_path, '.');
+    const int basename_len = extension != NULL ? extension - base_path : (int)strlen(base_path);
+    snprintf(output_buffer, buffer_size, "%.*s%s", basename_len, base_path, suffix_with_extension);
+}
@@ -0,0 +1,384 @@
+#ifndef CELL_DETECTION_PIPELINE_H
+#define CELL_DETECTION_PIPELINE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "adaptive_threshold.h"
+#include "cbmp.h"
+#include "denoise.h"
+#include "image_processing.h"
+#include "perf_counters.h"
+#include "pyramid.h"
+#include "rle.h"
+
+// Regions of interest a configuration can hold
+#define PIPELINE_MAX_ROIS 16
+
+typedef enum {
+    BLUR_NONE,
+    BLUR_GAUSSIAN_3X3,
+    BLUR_GAUSSIAN_5X5,
+    BLUR_SHARPEN,
+    // Histogram median of a square window
+    BLUR_MEDIAN,
+    // Edge-preserving guided filter
+    BLUR_GUIDED
+} Blur_type;
+
+typedef enum {
+    THRESHOLD_OTSU,
+    THRESHOLD_FIXED,
+    // One Otsu threshold per tile, bilinearly interpolated across the tiles
+    THRESHOLD_TILED
+} Threshold_method;
+
+typedef enum {
+    DETECTOR_QUICK,
+    DETECTOR_WINDOW
+} Detector_type;
+
+// How the binary image is stored during erosion and detection
+typedef enum {
+    ENGINE_DENSE,
+    ENGINE_RLE
+} Binary_engine;
+
+// Which stages the pipeline runs and with which parameters
+typedef struct {
+    Blur_type blur;
+    int blur_passes;
+    // Window radius of the median and guided filters
+    int filter_radius;
+    // Used by BLUR_GUIDED: windows with a lower variance, in squared gray levels, are smoothed out
+    int guided_epsilon;
+
+    Threshold_method threshold_method;
+    // Used by THRESHOLD_FIXED
+    int threshold_value;
+    // Added to the computed threshold
+    int threshold_offset;
+    // Used by THRESHOLD_TILED: the approximate tile size, and how many gray levels apart a tile's classes must be
+    // for it to keep its own threshold instead of the global one
+    int threshold_tile_size;
+    int threshold_min_separation;
+
+    Detector_type detector;
+    // Used by DETECTOR_QUICK
+    int frame_radius;
+    // Used by DETECTOR_WINDOW
+    int detection_area_size;
+    int exclusion_frame_thickness;
+
+    // The run-length engine only implements the quick detector, the window detector always runs dense
+    Binary_engine engine;
+    // Erode and run the quick detector in one sweep per pass instead of two
+    bool fused;
+
+    // Downsampling factor of the pyramid detector (2 or 4), 0 for the full-resolution loop.
+    // The pyramid always uses the quick detector.
+    int pyramid_factor;
+    // Also run the full-resolution loop and compare the pyramid's cells against it
+    bool pyramid_compare;
+
+    // Write the _gaussian, _binary and _erodeN images next to the output
+    bool debug_images;
+
+    // Regions of interest. When there are any, only they and their margins are processed and only cells
+    // inside them are reported. They are thresholded with Otsu as roi_threshold says, also when the method is tiled.
+    Image_region rois[PIPELINE_MAX_ROIS];
+    int roi_amount;
+    // Threshold every region on its own histogram instead of all of them on their pooled histogram
+    bool roi_local_threshold;
+    // Pixels around each region that are binarized and eroded too, so cells on its edge erode as in the full image
+    int roi_margin;
+
+    // Latency budget of a run in milliseconds, 0 for none. The erosion loop stops before a pass that is not
+    // predicted to end within it and the run returns the cells found so far.
+    int deadline_ms;
+} Pipeline_config;
+
+// The stages measured by the performance counters
+typedef enum {
+    STAGE_BLUR,
+    STAGE_THRESHOLD,
+    STAGE_EROSION,
+    STAGE_DETECTION,
+    PIPELINE_STAGE_AMOUNT
+} Pipeline_stage;
+
+// What a pipeline run cost inside one region of interest
+typedef struct {
+    int threshold;
+    int cells;
+    // Pixels written by all blur passes, which reach further out than the margin
+    long blurred_pixels;
+    // Pixels binarized, eroded and scanned for cells, the region with its margin
+    long processed_pixels;
+    double seconds;
+} Roi_stats;
+
+// What happened during a pipeline run
+typedef struct {
+    int threshold;
+    // Filled by the tiled threshold: the tiles, how many use the global threshold and the range of all
+    int threshold_tiles;
+    int fallback_tiles;
+    int tile_threshold_min;
+    int tile_threshold_max;
+    // The erosion passes run, which is how far the loop got when the deadline stopped it
+    int erosion_passes;
+    bool deadline_expired;
+    // Pixels read by erosion and detection
+    long pixel_visits;
+    // Runs read by erosion with the run-length engine
+    long run_visits;
+
+    // Filled in pyramid mode when pyramid_compare is set
+    int reference_cells;
+    int matched_cells;
+    double mean_offset;
+    long reference_pixel_visits;
+
+    // Hardware counts per stage, all unavailable unless the pipeline has counters
+    Perf_sample stage_counters[PIPELINE_STAGE_AMOUNT];
+
+    // Filled when the configuration has regions of interest
+    Roi_stats rois[PIPELINE_MAX_ROIS];
+    int roi_amount;
+} Pipeline_stats;
+
+// A stage that reads one image and writes the full result to another
+typedef void (*Image_stage)(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT],
+                            unsigned char output_image[BMP_WIDTH][BMP_HEIGHT]);
+
+// A stage that reads one image and writes one region of another
+typedef void (*Region_stage)(unsigned char input_image[BMP_WIDTH][BMP_HEIGHT],
+                             unsigned char output_image[BMP_WIDTH][BMP_HEIGHT], const Image_region* region);
+
+// What an erosion and detection pass costs, as a least-squares line through the measured passes: a fixed cost
+// plus a cost per unit of work, pixels of the active tiles or runs. Older passes weigh less and less.
+typedef struct {
+    double weight;
+    double work;
+    double seconds;
+    double work_squared;
+    double work_seconds;
+} Pass_cost_model;
+
+// Working memory of a pipeline run, allocated once and reused for every image.
+// Stages read the front buffer, write the back buffer and swap the two pointers.
+typedef struct {
+    unsigned char planes[2][BMP_WIDTH][BMP_HEIGHT];
+    unsigned char (*front)[BMP_HEIGHT];
+    unsigned char (*back)[BMP_HEIGHT];
+    Pyramid_buffers pyramid;
+    Denoise_buffers denoise;
+    Rle_image rle[2];
+    // The blurred regions of interest, binarized from one region at a time
+    unsigned char blurred[BMP_WIDTH][BMP_HEIGHT];
+    Threshold_map threshold_map;
+    // The cost of the dense and the run-length erosion passes, carried from image to image to predict
+    // whether the next pass fits the deadline
+    Pass_cost_model erosion_cost;
+    Pass_cost_model rle_cost;
+} Scratch_arena;
+
+// A configuration resolved to the functions that implement it
+typedef struct {
+    Pipeline_config config;
+    // The convolution blur, or NULL for none and for the denoise filters, which take a radius
+    Image_stage blur;
+    // The same convolution restricted to a region, or NULL
+    Region_stage region_blur;
+    // Specialized detector, or NULL if the configuration falls back to the generic loops
+    Cell_detector detector;
+    // Specialized fused erosion and detection sweep, or NULL for the generic one
+    Fused_sweep fused_sweep;
+    // Counters measuring each stage, or NULL
+    Perf_counters* counters;
+} Pipeline;
+
+/**
+ * @brief Fills a configuration with the default pipeline: two 3x3 Gaussian blurs, Otsu and the quick detector.
+ * @param config The configuration to fill.
+ */
+void default_pipeline_config(Pipeline_config* config);
+
+/**
+ * @brief Sets a single configuration option.
+ *
+ * Known keys are blur (none, gaussian3x3, gaussian5x5, sharpen, median, guided), blur_passes, filter_radius,
+ * guided_epsilon, threshold (otsu, fixed, tiled),
+ * threshold_value, threshold_offset, threshold_tile, threshold_separation, detector (quick, window), frame_radius, detection_area,
+ * exclusion_frame, engine (dense, rle), fused (0 or 1), pyramid (0, 2 or 4), pyramid_compare (0 or 1), debug_images (0 or 1),
+ * roi (x,y,width,height, added to the regions, or none to clear them), roi_threshold (local, global), roi_margin
+ * and deadline.
+ *
+ * @param config The configuration to modify.
+ * @param key The option name.
+ * @param value The option value.
+ * @return True if the option was recognised and valid, false otherwise.
+ */
+bool set_pipeline_option(Pipeline_config* config, const char* key, const char* value);
+
+/**
+ * @brief Reads options from a file with one "key = value" per line. Lines starting with '#' are ignored.
+ *
+ * @param config The configuration to modify.
+ * @param file_path The path of the configuration file.
+ * @return True if the file was read and every option was valid, false otherwise.
+ */
+bool load_pipeline_config(Pipeline_config* config, const char* file_path);
+
+/**
+ * @brief Returns the name of a measured stage.
+ */
+const char* pipeline_stage_name(Pipeline_stage stage);
+
+/**
+ * @brief Resolves a configuration to its stage functions, picking compile-time specialized variants.
+ * The pipeline starts without performance counters.
+ *
+ * @param config The configuration to resolve.
+ * @param pipeline The pipeline to fill.
+ */
+void build_pipeline(const Pipeline_config* config, Pipeline* pipeline);
+
+/**
+ * @brief Writes a one line description of the pipeline.
+ *
+ * @param pipeline The pipeline to describe.
+ * @param buffer The output buffer.
+ * @param buffer_size The size of the output buffer.
+ */
+void describe_pipeline(const Pipeline* pipeline, char* buffer, size_t buffer_size);
+
+/**
+ * @brief Allocates the scratch arena for one pipeline run at a time.
+ * @return A pointer to the new arena, or NULL if it could not be allocated.
+ */
+Scratch_arena* create_scratch_arena(void);
+
+/**
+ * @brief Frees a scratch arena.
+ * @param arena A pointer to the arena to destroy.
+ */
+void destroy_scratch_arena(Scratch_arena* arena);
+
+/**
+ * @brief Swaps the front and back buffers of the arena.
+ * @param arena The arena to swap.
+ */
+void swap_scratch_buffers(Scratch_arena* arena);
+
+/**
+ * @brief Runs the configured blur passes on the grayscale image in the arena's front buffer.
+ *
+ * @param pipeline The pipeline to run.
+ * @param arena The arena, with the blurred image in the front buffer afterwards.
+ */
+void run_blur_stages(const Pipeline* pipeline, Scratch_arena* arena);
+
+/**
+ * @brief Computes the threshold the pipeline binarizes with.
+ *
+ * @param pipeline The pipeline to run.
+ * @param image The blurred grayscale image.
+ * @return The threshold, clamped to 0-255. For the tiled method, the global Otsu threshold.
+ */
+int run_threshold_stage(const Pipeline* pipeline, unsigned char image[BMP_WIDTH][BMP_HEIGHT]);
+
+/**
+ * @brief Same as run_threshold_stage, from a histogram of the blurred image the caller keeps up to date.
+ *
+ * @param config The pipeline's configuration.
+ * @param histogram The number of pixels at every gray level.
+ * @return The threshold, clamped to 0-255. For the tiled method, the global Otsu threshold.
+ */
+int threshold_from_histogram(const Pipeline_config* config, const int histogram[256]);
+
+/**
+ * @brief Thresholds the blurred image in the arena's front buffer, with one threshold or the tiled ones.
+ *
+ * @param pipeline The pipeline to run.
+ * @param arena The arena, with the binary image in the front buffer afterwards.
+ * @param stats Filled with the threshold statistics, or NULL.
+ * @return The threshold, as run_threshold_stage returns it.
+ */
+int run_binarize_stage(const Pipeline* pipeline, Scratch_arena* arena, Pipeline_stats* stats);
+
+/**
+ * @brief Runs one detection pass of the configured detector.
+ *
+ * @param pipeline The pipeline to run.
+ * @param image The binary image to detect in.
+ * @param tile_mask The tiles holding white pixels, or NULL to scan the whole image.
+ * @param cell_list The list to store coordinates of detected cells.
+ * @return The number of cells detected.
+ */
+int run_detection_stage(const Pipeline* pipeline, unsigned char image[BMP_WIDTH][BMP_HEIGHT],
+                        bool tile_mask[TILES_X][TILES_Y], Cell_list* cell_list);
+
+/**
+ * @brief How far from the pixel it tests the configured detector reads or clears pixels.
+ * Erosion and detection on part of the image need at least this much context around it.
+ *
+ * @param config The pipeline's configuration.
+ * @return The distance in pixels.
+ */
+int detection_reach(const Pipeline_config* config);
+
+/**
+ * @brief Runs the erosion and detection stages on a binary image, everything run_pipeline does after thresholding.
+ * A deadline is counted from the start of this call.
+ *
+ * @param pipeline The pipeline to run.
+ * @param arena The arena, with the binary image in the front buffer. It is left fully eroded, unless the deadline
+ * stopped the loop.
+ * @param cell_list The list to store coordinates of detected cells.
+ * @param stats Filled with statistics about the run, without the threshold, or NULL.
+ */
+void run_cell_stages(const Pipeline* pipeline, Scratch_arena* arena, Cell_list* cell_list, Pipeline_stats* stats);
+
+/**
+ * @brief Runs the whole pipeline from the grayscale image to the cell list.
+ *
+ * With regions of interest, every stage only runs on the regions and their margins, so the cost follows
+ * their area. Debug images are not written then.
+ *
+ * With a deadline, the erosion loop stops before the first pass its cost estimate says would end past it.
+ * The cells found until then are returned and stats tells how many passes ran.
+ *
+ * @param pipeline The pipeline to run.
+ * @param arena The arena, with the grayscale image in the front buffer. It is left fully eroded.
+ * @param cell_list The list to store coordinates of detected cells.
+ * @param debug_output_path The output path the debug image names are derived from, or NULL for none.
+ * @param stats Filled with statistics about the run, or NULL.
+ * @return The threshold that was used, that of the first region when every region has its own.
+ */
+int run_pipeline(const Pipeline* pipeline, Scratch_arena* arena, Cell_list* cell_list,
+                 const char* debug_output_path, Pipeline_stats* stats);
+
+/**
+ * @brief Checks whether two configurations blur the same way, so one's blurred image can stand in for the other's.
+ */
+bool same_blur_stage(const Pipeline_config* a, const Pipeline_config* b);
+
+/**
+ * @brief Checks whether two configurations threshold the same blurred image the same way.
+ */
+bool same_threshold_stage(const Pipeline_config* a, const Pipeline_config* b);
+
+/**
+ * @brief Builds a path by inserting a suffix before the extension of base_path.
+ */
+void construct_output_path(char* output_buffer, size_t buffer_size, const char* base_path, const char* suffix);
+
+/**
+ * @brief Builds a path by replacing the extension of base_path with a suffix that has its own extension.
+ */
+void construct_report_path(char* output_buffer, size_t buffer_size, const char* base_path,
+                           const char* suffix_with_extension);
+
+#endif // CELL_DETECTION_PIPELINE_H
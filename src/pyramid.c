@@ -0,0 +1,312 @@
+#include "pyramid.h"
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Side of the square tiles the coarse loop tracks white pixels in, in coarse pixels
+#define COARSE_TILE 16
+#define COARSE_TILES (((BMP_WIDTH + 1) / 2 + COARSE_TILE - 1) / COARSE_TILE)
+
+// Refined cells closer than this to an already accepted cell are the same cell
+#define DUPLICATE_DISTANCE 3
+
+// Coarse images are stored like the full-resolution ones: index = x * height + y.
+// Pixels outside them count as black.
+
+static bool is_white(const unsigned char* image, const int width, const int height, const int x, const int y) {
+    return x >= 0 && x < width && y >= 0 && y < height && image[x * height + y];
+}
+
+/**
+ * @brief Gets the pixel range covered by a coarse tile. The upper bounds are exclusive.
+ */
+static void get_coarse_tile_bounds(const int tile_x, const int tile_y, const int width, const int height,
+                                   int* x0, int* x1, int* y0, int* y1) {
+    *x0 = tile_x * COARSE_TILE;
+    *y0 = tile_y * COARSE_TILE;
+    *x1 = *x0 + COARSE_TILE < width ? *x0 + COARSE_TILE : width;
+    *y1 = *y0 + COARSE_TILE < height ? *y0 + COARSE_TILE : height;
+}
+
+static long count_coarse_pixels(bool tiles[COARSE_TILES][COARSE_TILES], const int width, const int height) {
+    int x0, x1, y0, y1;
+    long pixels = 0;
+    for (int tile_x = 0; tile_x * COARSE_TILE < width; tile_x++) {
+        for (int tile_y = 0; tile_y * COARSE_TILE < height; tile_y++) {
+            if (!tiles[tile_x][tile_y]) continue;
+            get_coarse_tile_bounds(tile_x, tile_y, width, height, &x0, &x1, &y0, &y1);
+            pixels += (long)(x1 - x0) * (y1 - y0);
+        }
+    }
+    return pixels;
+}
+
+/**
+ * @brief One erosion pass over the active tiles, the coarse counterpart of erode_image_tiles_into.
+ * Both images are black outside the active tiles. Tiles left without white pixels drop out of active and
+ * are cleared in the input too, so the two images stay black outside the tiles that are still active.
+ */
+static bool erode_flat_tiles(unsigned char* input, unsigned char* output, const int width, const int height,
+                             bool active[COARSE_TILES][COARSE_TILES]) {
+    int x0, x1, y0, y1;
+    bool has_eroded = false;
+    for (int tile_x = 0; tile_x * COARSE_TILE < width; tile_x++) {
+        for (int tile_y = 0; tile_y * COARSE_TILE < height; tile_y++) {
+            if (!active[tile_x][tile_y]) continue;
+            get_coarse_tile_bounds(tile_x, tile_y, width, height, &x0, &x1, &y0, &y1);
+
+            bool has_white = false;
+            for (int x = x0; x < x1; x++) {
+                for (int y = y0; y < y1; y++) {
+                    const int index = x * height + y;
+                    unsigned char value = input[index];
+                    if (!value) {
+                        output[index] = 0;
+                        continue;
+                    }
+                    // Only pixels on the image border need their neighbours bounds checked
+                    const bool inside = x > 0 && x < width - 1 && y > 0 && y < height - 1;
+                    const bool eroded = inside
+                        ? !input[index - height] || !input[index + height] || !input[index - 1] || !input[index + 1]
+                        : !is_white(input, width, height, x - 1, y) || !is_white(input, width, height, x + 1, y) ||
+                          !is_white(input, width, height, x, y - 1) || !is_white(input, width, height, x, y + 1);
+                    if (eroded) {
+                        value = 0;
+                        has_eroded = true;
+                    }
+                    output[index] = value;
+                    has_white |= value != 0;
+                }
+            }
+            if (!has_white) {
+                for (int x = x0; x < x1; x++) {
+                    memset(&input[x * height + y0], 0, y1 - y0);
+                }
+            }
+            active[tile_x][tile_y] = has_white;
+        }
+    }
+    return has_eroded;
+}
+
+static bool is_isolated_flat(const unsigned char* image, const int width, const int height, const int x, const int y,
+                             const int frame_radius) {
+    for (int r = frame_radius; r <= frame_radius + 1; ++r) {
+        for (int i = -r; i < r; ++i) {
+            if (is_white(image, width, height, x + i, y - r) || is_white(image, width, height, x + i, y + r) ||
+                is_white(image, width, height, x - r, y + i) || is_white(image, width, height, x + r, y + i)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief One detection pass of the quick detector over the active tiles of a coarse image.
+ * Detected cells are cleared. Only active tiles hold white pixels, so no cell is missed outside them.
+ * @return The number of cells written to xs and ys.
+ */
+static int detect_flat_tiles(unsigned char* image, const int width, const int height,
+                             bool active[COARSE_TILES][COARSE_TILES], const int frame_radius,
+                             int* xs, int* ys, const int max_cells) {
+    const int clear_radius = frame_radius + 2;
+    int x0, x1, y0, y1;
+    int found = 0;
+    for (int tile_x = 0; tile_x * COARSE_TILE < width; tile_x++) {
+        for (int tile_y = 0; tile_y * COARSE_TILE < height; tile_y++) {
+            if (!active[tile_x][tile_y]) continue;
+            get_coarse_tile_bounds(tile_x, tile_y, width, height, &x0, &x1, &y0, &y1);
+            for (int x = x0; x < x1; x++) {
+                for (int y = y0; y < y1; y++) {
+                    if (!image[x * height + y] || !is_isolated_flat(image, width, height, x, y, frame_radius)) continue;
+                    if (found < max_cells) {
+                        xs[found] = x;
+                        ys[found] = y;
+                        found++;
+                    }
+                    for (int i = -clear_radius; i < clear_radius; i++) {
+                        for (int j = -clear_radius; j < clear_radius; j++) {
+                            if (x + i >= 0 && x + i < width && y + j >= 0 && y + j < height) {
+                                image[(x + i) * height + y + j] = 0;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return found;
+}
+
+/**
+ * @brief Halves an image in both directions. A coarse pixel is white if at least half of its block is.
+ * Marks the coarse tiles that hold white pixels in active.
+ */
+static void downsample(const unsigned char* input, const int width, const int height, unsigned char* output,
+                       bool active[COARSE_TILES][COARSE_TILES]) {
+    const int coarse_width = (width + 1) / 2;
+    const int coarse_height = (height + 1) / 2;
+    memset(active, false, sizeof(bool) * COARSE_TILES * COARSE_TILES);
+    for (int x = 0; x < coarse_width; x++) {
+        for (int y = 0; y < coarse_height; y++) {
+            const int white = is_white(input, width, height, 2 * x, 2 * y) +
+                              is_white(input, width, height, 2 * x + 1, 2 * y) +
+                              is_white(input, width, height, 2 * x, 2 * y + 1) +
+                              is_white(input, width, height, 2 * x + 1, 2 * y + 1);
+            output[x * coarse_height + y] = white >= 2 ? 255 : 0;
+            if (white >= 2) {
+                active[x / COARSE_TILE][y / COARSE_TILE] = true;
+            }
+        }
+    }
+}
+
+static bool is_duplicate(const Cell_list* cell_list, const Cell* first_new, const int x, const int y) {
+    for (const Cell* current = cell_list->head; current != first_new; current = current->next) {
+        const int dx = current->x - x;
+        const int dy = current->y - y;
+        if (dx * dx + dy * dy <= DUPLICATE_DISTANCE * DUPLICATE_DISTANCE) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Moves a candidate to the centroid of the full-resolution white pixels around it.
+ * One read of a small window replaces a full-resolution erosion loop in it.
+ *
+ * @return True if the window held white pixels, with the centroid in x and y.
+ */
+static bool refine_candidate(unsigned char binary_image[BMP_WIDTH][BMP_HEIGHT], const int radius,
+                             int* x, int* y, long* visits) {
+    const int x0 = *x - radius > 0 ? *x - radius : 0;
+    const int x1 = *x + radius < BMP_WIDTH - 1 ? *x + radius : BMP_WIDTH - 1;
+    const int y0 = *y - radius > 0 ? *y - radius : 0;
+    const int y1 = *y + radius < BMP_HEIGHT - 1 ? *y + radius : BMP_HEIGHT - 1;
+
+    long sum_x = 0;
+    long sum_y = 0;
+    long white = 0;
+    for (int fx = x0; fx <= x1; fx++) {
+        for (int fy = y0; fy <= y1; fy++) {
+            if (binary_image[fx][fy]) {
+                sum_x += fx;
+                sum_y += fy;
+                white++;
+            }
+        }
+    }
+    if (x1 >= x0 && y1 >= y0) {
+        *visits += (long)(x1 - x0 + 1) * (y1 - y0 + 1);
+    }
+    if (white == 0) {
+        return false;
+    }
+    *x = (int)((2 * sum_x + white) / (2 * white));
+    *y = (int)((2 * sum_y + white) / (2 * white));
+    return true;
+}
+
+long detect_cells_pyramid(unsigned char binary_image[BMP_WIDTH][BMP_HEIGHT], Pyramid_buffers* buffers,
+    const int factor, const int frame_radius, Cell_list* cell_list) {
+    const int width_2 = (BMP_WIDTH + 1) / 2;
+    const int height_2 = (BMP_HEIGHT + 1) / 2;
+    bool active[COARSE_TILES][COARSE_TILES];
+    long visits = 0;
+
+    // Build the levels down to the requested factor
+    downsample(&binary_image[0][0], BMP_WIDTH, BMP_HEIGHT, buffers->level_2, active);
+    visits += BMP_WIDTH * BMP_HEIGHT;
+
+    unsigned char* level = buffers->level_2;
+    int width = width_2;
+    int height = height_2;
+    if (factor >= 4) {
+        downsample(buffers->level_2, width_2, height_2, buffers->level_4, active);
+        visits += width_2 * height_2;
+        level = buffers->level_4;
+        width = (width_2 + 1) / 2;
+        height = (height_2 + 1) / 2;
+    }
+    const int scale = factor >= 4 ? 4 : 2;
+
+    // The isolation frame shrinks with the image, rounded to the nearest coarse pixel
+    int coarse_radius = (frame_radius + scale / 2) / scale;
+    if (coarse_radius < 1) {
+        coarse_radius = 1;
+    }
+
+    // Find candidates with the usual loop, on the coarse level and only in the tiles still holding white pixels.
+    // The work image is written in the active tiles only, so it starts black.
+    int* candidate_x = buffers->candidate_x;
+    int* candidate_y = buffers->candidate_y;
+    int candidates = 0;
+    unsigned char* input = level;
+    unsigned char* output = buffers->work;
+    memset(output, 0, (size_t)width * height);
+    while (true) {
+        visits += count_coarse_pixels(active, width, height);
+        if (!erode_flat_tiles(input, output, width, height, active)) break;
+        unsigned char* swap = input;
+        input = output;
+        output = swap;
+        visits += count_coarse_pixels(active, width, height);
+        candidates += detect_flat_tiles(input, width, height, active, coarse_radius, candidate_x + candidates,
+                                        candidate_y + candidates, PYRAMID_MAX_CANDIDATES - candidates);
+    }
+
+    // Refine each candidate at full resolution, keeping its coarse position if the window is empty.
+    // The candidate is the last remnant of its blob, within a coarse pixel or two of where the full-resolution
+    // loop would find it. A wider window would pull the centroid towards the rest of the blob and, past the
+    // frame radius, towards the neighbouring cells.
+    const int refine_radius = frame_radius < 2 * scale ? frame_radius : 2 * scale;
+    const Cell* first_new = cell_list->head;
+    for (int i = 0; i < candidates; i++) {
+        int x = candidate_x[i] * scale + scale / 2;
+        int y = candidate_y[i] * scale + scale / 2;
+        refine_candidate(binary_image, refine_radius, &x, &y, &visits);
+        if (x < 0 || x >= BMP_WIDTH || y < 0 || y >= BMP_HEIGHT || is_duplicate(cell_list, first_new, x, y)) {
+            continue;
+        }
+        add_to_cell_list(cell_list, x, y);
+    }
+    return visits;
+}
+
+int match_cell_lists(const Cell_list* list, const Cell_list* reference, const int max_distance, double* mean_offset) {
+    bool* taken = calloc(reference->cell_amount > 0 ? reference->cell_amount : 1, sizeof(bool));
+    if (taken == NULL) {
+        *mean_offset = 0;
+        return 0;
+    }
+
+    int matched = 0;
+    double total_offset = 0;
+    for (const Cell* current = list->head; current; current = current->next) {
+        int best = -1;
+        int best_distance_squared = max_distance * max_distance + 1;
+        int index = 0;
+        for (const Cell* other = reference->head; other; other = other->next, index++) {
+            if (taken[index]) continue;
+            const int dx = other->x - current->x;
+            const int dy = other->y - current->y;
+            if (dx * dx + dy * dy < best_distance_squared) {
+                best = index;
+                best_distance_squared = dx * dx + dy * dy;
+            }
+        }
+        if (best >= 0) {
+            taken[best] = true;
+            matched++;
+            total_offset += sqrt(best_distance_squared);
+        }
+    }
+    free(taken);
+
+    *mean_offset = matched > 0 ? total_offset / matched : 0;
+    return matched;
+}
@@ -0,0 +1,48 @@
+#ifndef CELL_DETECTION_PYRAMID_H
+#define CELL_DETECTION_PYRAMID_H
+
+#include "cbmp.h"
+#include "image_processing.h"
+
+// Size of the largest coarse level, the one downsampled by 2
+#define PYRAMID_LEVEL_SIZE (((BMP_WIDTH + 1) / 2) * ((BMP_HEIGHT + 1) / 2))
+
+#define PYRAMID_MAX_CANDIDATES 4000
+
+// Scratch memory for the coarse levels, allocated together with the pipeline's arena
+typedef struct {
+    unsigned char level_2[PYRAMID_LEVEL_SIZE];
+    unsigned char level_4[PYRAMID_LEVEL_SIZE];
+    unsigned char work[PYRAMID_LEVEL_SIZE];
+    int candidate_x[PYRAMID_MAX_CANDIDATES];
+    int candidate_y[PYRAMID_MAX_CANDIDATES];
+} Pyramid_buffers;
+
+/**
+ * @brief Detects cells by running the erosion and detection loop on a downsampled binary image,
+ * then moving every candidate to the centroid of the full-resolution pixels in a small window around it.
+ * The coarse loop only visits the coarse tiles that still hold white pixels.
+ *
+ * @param binary_image The full-resolution binary image. It is not modified.
+ * @param buffers Scratch memory for the coarse levels.
+ * @param factor The downsampling factor, 2 or 4.
+ * @param frame_radius The full-resolution isolation frame radius, scaled down for the coarse level.
+ * @param cell_list The list to store coordinates of detected cells.
+ * @return The number of pixels read by erosion and detection, coarse and refinement together.
+ */
+long detect_cells_pyramid(unsigned char binary_image[BMP_WIDTH][BMP_HEIGHT], Pyramid_buffers* buffers,
+                          int factor, int frame_radius, Cell_list* cell_list);
+
+/**
+ * @brief Counts how many cells of one list have a cell of the other within a distance.
+ * Each cell is matched at most once.
+ *
+ * @param list The cells to match.
+ * @param reference The cells to match against.
+ * @param max_distance The largest distance two matched cells can be apart.
+ * @param mean_offset Set to the mean distance between matched cells.
+ * @return The number of matched cells.
+ */
+int match_cell_lists(const Cell_list* list, const Cell_list* reference, int max_distance, double* mean_offset);
+
+#endif // CELL_DETECTION_PYRAMID_H
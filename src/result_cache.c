@@ -0,0 +1,262 @@
+#include "result_cache.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Bump when the pipeline's results change, so old cache files stop matching
+#define CACHE_FORMAT_VERSION 1
+#define CACHE_EXTENSION ".cells"
+// Suffix of the file a store writes before renaming it, after the cache file name and the writer's pid
+#define TEMPORARY_EXTENSION ".tmp"
+
+// A cache file seen while trimming the directory
+typedef struct {
+    char name[64];
+    long size;
+    struct timespec used;
+} Cache_file;
+
+static unsigned long long mix(unsigned long long value) {
+    value ^= value >> 33;
+    value *= 0xff51afd7ed558ccdULL;
+    value ^= value >> 33;
+    value *= 0xc4ceb9fe1a85ec53ULL;
+    value ^= value >> 33;
+    return value;
+}
+
+static unsigned long long combine(const unsigned long long hash, const long long value) {
+    return mix(hash ^ (unsigned long long)value) + 0x9e3779b97f4a7c15ULL;
+}
+
+unsigned long long result_cache_key(unsigned char image[BMP_WIDTH][BMP_HEIGHT], const Pipeline_config* config) {
+    // Four independent lanes of 8-byte words keep the multiplies from waiting on each other
+    const unsigned char* pixels = &image[0][0];
+    const size_t size = (size_t)BMP_WIDTH * BMP_HEIGHT;
+    unsigned long long lanes[4] = {1, 2, 3, 4};
+    size_t offset = 0;
+    for (; offset + 32 <= size; offset += 32) {
+        for (int lane = 0; lane < 4; lane++) {
+            unsigned long long word;
+            memcpy(&word, pixels + offset + 8 * lane, sizeof(word));
+            lanes[lane] = (lanes[lane] ^ word) * 0x100000001b3ULL;
+            lanes[lane] = (lanes[lane] << 29) | (lanes[lane] >> 35);
+        }
+    }
+    unsigned long long hash = CACHE_FORMAT_VERSION;
+    for (int lane = 0; lane < 4; lane++) {
+        hash = combine(hash, (long long)lanes[lane]);
+    }
+    for (; offset < size; offset++) {
+        hash = combine(hash, pixels[offset]);
+    }
+
+    hash = combine(hash, config->blur);
+    hash = combine(hash, config->blur_passes);
+    hash = combine(hash, config->filter_radius);
+    hash = combine(hash, config->guided_epsilon);
+    hash = combine(hash, config->threshold_method);
+    hash = combine(hash, config->threshold_value);
+    hash = combine(hash, config->threshold_offset);
+    if (config->threshold_method == THRESHOLD_TILED) {
+        hash = combine(hash, config->threshold_tile_size);
+        hash = combine(hash, config->threshold_min_separation);
+    }
+    hash = combine(hash, config->detector);
+    hash = combine(hash, config->frame_radius);
+    hash = combine(hash, config->detection_area_size);
+    hash = combine(hash, config->exclusion_frame_thickness);
+    hash = combine(hash, config->pyramid_factor);
+    hash = combine(hash, config->roi_amount);
+    for (int i = 0; i < config->roi_amount; i++) {
+        const Image_region* roi = &config->rois[i];
+        hash = combine(hash, ((long long)roi->x0 << 48) | ((long long)roi->x1 << 32) | (roi->y0 << 16) | roi->y1);
+    }
+    if (config->roi_amount > 0) {
+        hash = combine(hash, config->roi_local_threshold);
+        hash = combine(hash, config->roi_margin);
+    }
+    return hash;
+}
+
+static void cache_file_path(const Result_cache* cache, const unsigned long long key, char* path, const size_t size) {
+    snprintf(path, size, "%s/%016llx%s", cache->directory, key, CACHE_EXTENSION);
+}
+
+static int compare_by_use(const void* a, const void* b) {
+    const struct timespec* first = &((const Cache_file*)a)->used;
+    const struct timespec* second = &((const Cache_file*)b)->used;
+    if (first->tv_sec != second->tv_sec) return first->tv_sec < second->tv_sec ? -1 : 1;
+    if (first->tv_nsec != second->tv_nsec) return first->tv_nsec < second->tv_nsec ? -1 : 1;
+    return 0;
+}
+
+/**
+ * @brief Checks whether a directory entry is a store's temporary file whose writer is gone, which happens
+ * when a process dies between writing and renaming it. Nothing would ever rename or delete such a file.
+ */
+static bool is_abandoned_temporary(const char* name) {
+    const char* extension = strstr(name, CACHE_EXTENSION ".");
+    if (extension == NULL) return false;
+    char* end;
+    const long pid = strtol(extension + strlen(CACHE_EXTENSION "."), &end, 10);
+    if (pid <= 0 || strcmp(end, TEMPORARY_EXTENSION) != 0) return false;
+    return kill((pid_t)pid, 0) != 0 && errno == ESRCH;
+}
+
+/**
+ * @brief Adds up the size of the cache files and deletes the least recently used ones until the rest fit
+ * in max_bytes. Temporary files left behind by stores that never finished are deleted on the way.
+ */
+static void trim_result_cache(Result_cache* cache) {
+    DIR* directory = opendir(cache->directory);
+    if (directory == NULL) return;
+
+    Cache_file* files = NULL;
+    int file_amount = 0;
+    int capacity = 0;
+    long total = 0;
+    char path[RESULT_CACHE_PATH_SIZE + 80];
+    struct dirent* entry;
+    while ((entry = readdir(directory)) != NULL) {
+        if (is_abandoned_temporary(entry->d_name)) {
+            snprintf(path, sizeof(path), "%s/%s", cache->directory, entry->d_name);
+            unlink(path);
+            continue;
+        }
+        const size_t length = strlen(entry->d_name);
+        const size_t extension_length = strlen(CACHE_EXTENSION);
+        if (length <= extension_length || length >= sizeof(files[0].name) ||
+            strcmp(entry->d_name + length - extension_length, CACHE_EXTENSION) != 0) {
+            continue;
+        }
+        struct stat status;
+        snprintf(path, sizeof(path), "%s/%s", cache->directory, entry->d_name);
+        if (stat(path, &status) != 0) continue;
+
+        if (file_amount == capacity) {
+            capacity = capacity ? 2 * capacity : 64;
+            Cache_file* grown = realloc(files, sizeof(Cache_file) * capacity);
+            if (grown == NULL) break;
+            files = grown;
+        }
+        snprintf(files[file_amount].name, sizeof(files[file_amount].name), "%s", entry->d_name);
+        files[file_amount].size = (long)status.st_size;
+        files[file_amount].used = status.st_mtim;
+        total += files[file_amount].size;
+        file_amount++;
+    }
+    closedir(directory);
+
+    if (total > cache->max_bytes) {
+        qsort(files, file_amount, sizeof(Cache_file), compare_by_use);
+        for (int i = 0; i < file_amount && total > cache->max_bytes; i++) {
+            snprintf(path, sizeof(path), "%s/%s", cache->directory, files[i].name);
+            if (unlink(path) == 0) {
+                total -= files[i].size;
+                cache->evictions++;
+            }
+        }
+    }
+    cache->total_bytes = total;
+    free(files);
+}
+
+bool open_result_cache(Result_cache* cache, const char* directory, const long max_bytes) {
+    if (mkdir(directory, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Failed to create cache directory %s: %s\n", directory, strerror(errno));
+        return false;
+    }
+    snprintf(cache->directory, sizeof(cache->directory), "%s", directory);
+    cache->max_bytes = max_bytes;
+    cache->total_bytes = 0;
+    cache->hits = 0;
+    cache->misses = 0;
+    cache->evictions = 0;
+    trim_result_cache(cache);
+    return true;
+}
+
+bool lookup_result_cache(Result_cache* cache, const unsigned long long key, Cell_list* cell_list, int* threshold) {
+    char path[RESULT_CACHE_PATH_SIZE + 32];
+    cache_file_path(cache, key, path, sizeof(path));
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        cache->misses++;
+        return false;
+    }
+
+    int cell_amount;
+    int* coordinates = NULL;
+    bool valid = fscanf(file, "cells %d threshold %d\n", &cell_amount, threshold) == 2 && cell_amount >= 0;
+    if (valid) {
+        coordinates = malloc(sizeof(int) * 2 * (cell_amount > 0 ? cell_amount : 1));
+        valid = coordinates != NULL;
+    }
+    for (int i = 0; valid && i < cell_amount; i++) {
+        valid = fscanf(file, "%d %d\n", &coordinates[2 * i], &coordinates[2 * i + 1]) == 2;
+    }
+    fclose(file);
+    if (!valid) {
+        // A truncated or foreign file is dropped and recomputed
+        fprintf(stderr, "Ignoring invalid cache file %s\n", path);
+        struct stat status;
+        if (stat(path, &status) == 0 && unlink(path) == 0) {
+            cache->total_bytes -= (long)status.st_size;
+        }
+        free(coordinates);
+        cache->misses++;
+        return false;
+    }
+
+    // The file lists the cells head first, and adding prepends
+    for (int i = cell_amount - 1; i >= 0; i--) {
+        add_to_cell_list(cell_list, coordinates[2 * i], coordinates[2 * i + 1]);
+    }
+    free(coordinates);
+    // Mark the file as just used for the LRU order
+    utimensat(AT_FDCWD, path, NULL, 0);
+    cache->hits++;
+    return true;
+}
+
+void store_result_cache(Result_cache* cache, const unsigned long long key, const Cell_list* cell_list,
+                        const int threshold) {
+    char path[RESULT_CACHE_PATH_SIZE + 32];
+    char temporary_path[RESULT_CACHE_PATH_SIZE + 64];
+    cache_file_path(cache, key, path, sizeof(path));
+    // Written under a private name and renamed, so a concurrent reader never sees half a file
+    snprintf(temporary_path, sizeof(temporary_path), "%s.%ld" TEMPORARY_EXTENSION, path, (long)getpid());
+
+    FILE* file = fopen(temporary_path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Failed to write cache file %s: %s\n", temporary_path, strerror(errno));
+        return;
+    }
+    fprintf(file, "cells %d threshold %d\n", cell_list->cell_amount, threshold);
+    for (const Cell* cell = cell_list->head; cell != NULL; cell = cell->next) {
+        fprintf(file, "%d %d\n", cell->x, cell->y);
+    }
+    const long size = ftell(file);
+    const bool written = fclose(file) == 0;
+    // A file another process stored under the same key meanwhile is replaced
+    struct stat replaced;
+    const long replaced_size = stat(path, &replaced) == 0 ? (long)replaced.st_size : 0;
+    if (!written || rename(temporary_path, path) != 0) {
+        fprintf(stderr, "Failed to store cache file %s\n", path);
+        unlink(temporary_path);
+        return;
+    }
+    // Only a store that takes the cache over its size pays for a scan of the directory
+    cache->total_bytes += size - replaced_size;
+    if (cache->total_bytes > cache->max_bytes) {
+        trim_result_cache(cache);
+    }
+}
@@ -0,0 +1,69 @@
+#ifndef CELL_DETECTION_RESULT_CACHE_H
+#define CELL_DETECTION_RESULT_CACHE_H
+
+#include <stdbool.h>
+
+#include "cbmp.h"
+#include "image_processing.h"
+#include "pipeline.h"
+
+#define RESULT_CACHE_PATH_SIZE 256
+
+// An on-disk cache of cell lists, one file per decoded image and configuration.
+// Files are touched on every hit, so their modification time orders them for LRU eviction.
+typedef struct {
+    char directory[RESULT_CACHE_PATH_SIZE];
+    // Total size of the cache files the directory is trimmed to once a store takes it over
+    long max_bytes;
+    // Size of the cache files as of the last scan, plus what this process stored and dropped since.
+    // Files other processes store are only counted at the next scan.
+    long total_bytes;
+    int hits;
+    int misses;
+    int evictions;
+} Result_cache;
+
+/**
+ * @brief Opens a cache directory, creating it if needed, and adds up the size of its files.
+ * A directory already over max_bytes is trimmed.
+ *
+ * @param cache The cache to set up.
+ * @param directory The directory holding the cache files.
+ * @param max_bytes The size the cache is trimmed to.
+ * @return True on success, false if the directory could not be created.
+ */
+bool open_result_cache(Result_cache* cache, const char* directory, long max_bytes);
+
+/**
+ * @brief Hashes the decoded pixels together with every configuration option that changes the cells found.
+ * Options that only change how the cells are found, like the engine, are left out.
+ *
+ * @param image The grayscale image, before any stage has run.
+ * @param config The pipeline configuration.
+ * @return The cache key.
+ */
+unsigned long long result_cache_key(unsigned char image[BMP_WIDTH][BMP_HEIGHT], const Pipeline_config* config);
+
+/**
+ * @brief Looks a key up and fills the cell list and threshold on a hit, in the order the pipeline produced them.
+ *
+ * @param cache The cache.
+ * @param key The key from result_cache_key.
+ * @param cell_list The list to add the stored cells to.
+ * @param threshold Set to the stored threshold.
+ * @return True on a hit, false on a miss.
+ */
+bool lookup_result_cache(Result_cache* cache, unsigned long long key, Cell_list* cell_list, int* threshold);
+
+/**
+ * @brief Stores a result. If that takes the cache over its size, the directory is scanned and the least recently
+ * used files are evicted until it fits again.
+ *
+ * @param cache The cache.
+ * @param key The key from result_cache_key.
+ * @param cell_list The cells the pipeline found.
+ * @param threshold The threshold the pipeline used.
+ */
+void store_result_cache(Result_cache* cache, unsigned long long key, const Cell_list* cell_list, int threshold);
+
+#endif // CELL_DETECTION_RESULT_CACHE_H
@@ -0,0 +1,232 @@
+#include "rle.h"
+
+#include <string.h>
+
+void rle_encode(unsigned char binary_image[BMP_WIDTH][BMP_HEIGHT], Rle_image* rle) {
+    for (int x = 0; x < BMP_WIDTH; x++) {
+        Rle_line* line = &rle->lines[x];
+        line->run_amount = 0;
+        int y = 0;
+        while (y < BMP_HEIGHT) {
+            while (y < BMP_HEIGHT && !binary_image[x][y]) y++;
+            if (y == BMP_HEIGHT) break;
+            const int start = y;
+            while (y < BMP_HEIGHT && binary_image[x][y]) y++;
+            line->runs[line->run_amount].start = (unsigned short)start;
+            line->runs[line->run_amount].end = (unsigned short)y;
+            line->run_amount++;
+        }
+    }
+}
+
+void rle_decode(const Rle_image* rle, unsigned char binary_image[BMP_WIDTH][BMP_HEIGHT]) {
+    for (int x = 0; x < BMP_WIDTH; x++) {
+        const Rle_line* line = &rle->lines[x];
+        memset(binary_image[x], 0, BMP_HEIGHT);
+        for (int i = 0; i < line->run_amount; i++) {
+            memset(&binary_image[x][line->runs[i].start], 255, line->runs[i].end - line->runs[i].start);
+        }
+    }
+}
+
+/**
+ * @brief Intersects two sorted run lists.
+ * @return The number of runs written to output.
+ */
+static int intersect_runs(const Rle_run* a, const int a_amount, const Rle_run* b, const int b_amount,
+                          Rle_run* output) {
+    int amount = 0;
+    int i = 0;
+    int j = 0;
+    while (i < a_amount && j < b_amount) {
+        const int start = a[i].start > b[j].start ? a[i].start : b[j].start;
+        const int end = a[i].end < b[j].end ? a[i].end : b[j].end;
+        if (start < end) {
+            output[amount].start = (unsigned short)start;
+            output[amount].end = (unsigned short)end;
+            amount++;
+        }
+        // Advance whichever run ends first, it cannot overlap anything further along the other list
+        if (a[i].end < b[j].end) {
+            i++;
+        } else {
+            j++;
+        }
+    }
+    return amount;
+}
+
+bool rle_erode(const Rle_image* input, Rle_image* output) {
+    Rle_run shrunk[RLE_MAX_RUNS];
+    Rle_run partial[RLE_MAX_RUNS];
+    bool has_eroded = false;
+
+    for (int x = 0; x < BMP_WIDTH; x++) {
+        const Rle_line* line = &input->lines[x];
+        Rle_line* result = &output->lines[x];
+        long input_pixels = 0;
+
+        // The neighbours along the line: a pixel needs both, except where they are outside the image
+        int amount = 0;
+        for (int i = 0; i < line->run_amount; i++) {
+            const int start = line->runs[i].start == 0 ? 0 : line->runs[i].start + 1;
+            const int end = line->runs[i].end == BMP_HEIGHT ? BMP_HEIGHT : line->runs[i].end - 1;
+            input_pixels += line->runs[i].end - line->runs[i].start;
+            if (start < end) {
+                shrunk[amount].start = (unsigned short)start;
+                shrunk[amount].end = (unsigned short)end;
+                amount++;
+            }
+        }
+
+        // The neighbours across lines
+        if (x > 0) {
+            const Rle_line* previous = &input->lines[x - 1];
+            amount = intersect_runs(shrunk, amount, previous->runs, previous->run_amount, partial);
+            memcpy(shrunk, partial, amount * sizeof(Rle_run));
+        }
+        if (x < BMP_WIDTH - 1) {
+            const Rle_line* next = &input->lines[x + 1];
+            amount = intersect_runs(shrunk, amount, next->runs, next->run_amount, result->runs);
+        } else {
+            memcpy(result->runs, shrunk, amount * sizeof(Rle_run));
+        }
+        result->run_amount = amount;
+
+        long output_pixels = 0;
+        for (int i = 0; i < amount; i++) {
+            output_pixels += result->runs[i].end - result->runs[i].start;
+        }
+        if (output_pixels != input_pixels) {
+            has_eroded = true;
+        }
+    }
+    return has_eroded;
+}
+
+/**
+ * @brief Finds the first run of a line that ends after y.
+ * @return Its index, or run_amount if there is none.
+ */
+static int find_run(const Rle_line* line, const int y) {
+    int low = 0;
+    int high = line->run_amount;
+    while (low < high) {
+        const int middle = (low + high) / 2;
+        if (line->runs[middle].end <= y) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+/**
+ * @brief Checks if any pixel of [start, end) on line x is white. Lines outside the image are black.
+ */
+static bool is_range_white(const Rle_image* rle, const int x, const int start, const int end) {
+    if (x < 0 || x >= BMP_WIDTH || start >= end) {
+        return false;
+    }
+    const Rle_line* line = &rle->lines[x];
+    const int i = find_run(line, start);
+    return i < line->run_amount && line->runs[i].start < end;
+}
+
+/**
+ * @brief The isolation test of check_for_cell: both frames of radius r and r + 1 must be black.
+ * The frame sides along the lines are ranges, the sides across them are single pixels.
+ */
+static bool is_isolated_rle(const Rle_image* rle, const int x, const int y, const int frame_radius) {
+    for (int r = frame_radius; r <= frame_radius + 1; ++r) {
+        if (is_range_white(rle, x - r, y - r, y + r) || is_range_white(rle, x + r, y - r, y + r)) {
+            return false;
+        }
+        for (int i = -r; i < r; ++i) {
+            if (is_range_white(rle, x + i, y - r, y - r + 1) || is_range_white(rle, x + i, y + r, y + r + 1)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Removes [start, end) from a line, splitting the run that contains it if needed.
+ */
+static void clear_range(Rle_line* line, const int start, const int end) {
+    int i = find_run(line, start);
+    if (i == line->run_amount || line->runs[i].start >= end) {
+        return;
+    }
+
+    // A run sticking out on both sides is split in two
+    if (line->runs[i].start < start && line->runs[i].end > end) {
+        memmove(&line->runs[i + 1], &line->runs[i], (line->run_amount - i) * sizeof(Rle_run));
+        line->run_amount++;
+        line->runs[i].end = (unsigned short)start;
+        line->runs[i + 1].start = (unsigned short)end;
+        return;
+    }
+
+    if (line->runs[i].start < start) {
+        line->runs[i].end = (unsigned short)start;
+        i++;
+    }
+    int last = i;
+    while (last < line->run_amount && line->runs[last].end <= end) last++;
+    if (last < line->run_amount && line->runs[last].start < end) {
+        line->runs[last].start = (unsigned short)end;
+    }
+    memmove(&line->runs[i], &line->runs[last], (line->run_amount - last) * sizeof(Rle_run));
+    line->run_amount -= last - i;
+}
+
+int rle_detect_cells(Rle_image* rle, const int frame_radius, Cell_list* cell_list) {
+    const int clear_radius = frame_radius + 2;
+    // A run this long always reaches one of the frame pixels on its own line
+    const int longest_cell_run = 2 * frame_radius - 1;
+    int cells_detected = 0;
+
+    for (int x = 0; x < BMP_WIDTH; x++) {
+        Rle_line* line = &rle->lines[x];
+        int y = 0;
+        // Clearing a cell rewrites this line, so the next run is looked up again after every detection
+        int i = find_run(line, y);
+        while (i < line->run_amount) {
+            const Rle_run run = line->runs[i];
+            if (run.end - run.start > longest_cell_run) {
+                i++;
+                continue;
+            }
+
+            bool detected = false;
+            for (int cy = run.start > y ? run.start : y; cy < run.end; cy++) {
+                if (!is_isolated_rle(rle, x, cy, frame_radius)) continue;
+
+                cells_detected++;
+                add_to_cell_list(cell_list, x, cy);
+                const int y0 = cy - clear_radius < 0 ? 0 : cy - clear_radius;
+                const int y1 = cy + clear_radius > BMP_HEIGHT ? BMP_HEIGHT : cy + clear_radius;
+                for (int cx = x - clear_radius; cx < x + clear_radius; cx++) {
+                    if (cx < 0 || cx >= BMP_WIDTH) continue;
+                    clear_range(&rle->lines[cx], y0, y1);
+                }
+                y = cy + 1;
+                detected = true;
+                break;
+            }
+            i = detected ? find_run(line, y) : i + 1;
+        }
+    }
+    return cells_detected;
+}
+
+long rle_run_amount(const Rle_image* rle) {
+    long amount = 0;
+    for (int x = 0; x < BMP_WIDTH; x++) {
+        amount += rle->lines[x].run_amount;
+    }
+    return amount;
+}
@@ -0,0 +1,71 @@
+#ifndef CELL_DETECTION_RLE_H
+#define CELL_DETECTION_RLE_H
+
+#include <stdbool.h>
+
+#include "cbmp.h"
+#include "image_processing.h"
+
+// White runs are separated by at least one black pixel, so a line never holds more than this
+#define RLE_MAX_RUNS ((BMP_HEIGHT + 1) / 2)
+
+// The white pixels [start, end) of a line
+typedef struct {
+    unsigned short start;
+    unsigned short end;
+} Rle_run;
+
+// One line of constant x, the direction the dense images are contiguous in. Runs are sorted by start.
+typedef struct {
+    int run_amount;
+    Rle_run runs[RLE_MAX_RUNS];
+} Rle_line;
+
+// A binary image stored as the white runs of every line
+typedef struct {
+    Rle_line lines[BMP_WIDTH];
+} Rle_image;
+
+/**
+ * @brief Encodes a binary image. Any non-zero pixel counts as white.
+ *
+ * @param binary_image The image to encode.
+ * @param rle The run-length image to fill.
+ */
+void rle_encode(unsigned char binary_image[BMP_WIDTH][BMP_HEIGHT], Rle_image* rle);
+
+/**
+ * @brief Decodes a run-length image to a binary image with white pixels of 255.
+ *
+ * @param rle The run-length image to decode.
+ * @param binary_image The image to fill.
+ */
+void rle_decode(const Rle_image* rle, unsigned char binary_image[BMP_WIDTH][BMP_HEIGHT]);
+
+/**
+ * @brief Erodes a run-length image with the same cross-shaped element and borders as erode_image.
+ * Every run is shrunk by one pixel and intersected with the runs of the neighbouring lines.
+ *
+ * @param input The image to erode.
+ * @param output The eroded image. It must not be the input.
+ * @return True if any pixel was eroded, false otherwise.
+ */
+bool rle_erode(const Rle_image* input, Rle_image* output);
+
+/**
+ * @brief One pass of the quick detector on a run-length image, with the same scan order and results.
+ * The isolation frame is tested with interval-overlap queries and detected cells are cleared.
+ *
+ * @param rle The image to detect in.
+ * @param frame_radius The radius of the frame that has to be black around a cell.
+ * @param cell_list The list to store coordinates of detected cells.
+ * @return The number of cells detected.
+ */
+int rle_detect_cells(Rle_image* rle, int frame_radius, Cell_list* cell_list);
+
+/**
+ * @brief Counts the runs of a run-length image.
+ */
+long rle_run_amount(const Rle_image* rle);
+
+#endif // CELL_DETECTION_RLE_H
@@ -0,0 +1,303 @@
+#include "sequence.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static unsigned char binary_value(const unsigned char value, const int threshold, const int x, const int y) {
+    // Same rule as binary_threshold, including the black border
+    if (x < BORDER || x >= BMP_WIDTH - BORDER || y < BORDER || y >= BMP_HEIGHT - BORDER) {
+        return 0;
+    }
+    return value > threshold ? 255 : 0;
+}
+
+static void dilate_tile_mask(bool input_mask[TILES_X][TILES_Y], bool output_mask[TILES_X][TILES_Y]) {
+    for (int tile_x = 0; tile_x < TILES_X; tile_x++) {
+        for (int tile_y = 0; tile_y < TILES_Y; tile_y++) {
+            output_mask[tile_x][tile_y] = false;
+            for (int i = -1; i <= 1 && !output_mask[tile_x][tile_y]; i++) {
+                for (int j = -1; j <= 1; j++) {
+                    const int nx = tile_x + i;
+                    const int ny = tile_y + j;
+                    if (nx >= 0 && nx < TILES_X && ny >= 0 && ny < TILES_Y && input_mask[nx][ny]) {
+                        output_mask[tile_x][tile_y] = true;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+}
+
+static bool is_in_tile_mask(bool tile_mask[TILES_X][TILES_Y], const int x, const int y) {
+    return tile_mask[x / TILE_SIZE][y / TILE_SIZE];
+}
+
+static Track* find_track(Sequence_state* state, const int track_id) {
+    // Track IDs are handed out in order, so the ID is the index
+    if (track_id < 0 || track_id >= state->track_amount) {
+        return NULL;
+    }
+    return &state->tracks[track_id];
+}
+
+static int start_track(Sequence_state* state, const int x, const int y) {
+    if (state->track_amount == state->track_capacity) {
+        const int new_capacity = state->track_capacity ? state->track_capacity * 2 : 256;
+        Track* tracks = realloc(state->tracks, new_capacity * sizeof(Track));
+        if (tracks == NULL) {
+            return -1;
+        }
+        state->tracks = tracks;
+        state->track_capacity = new_capacity;
+    }
+    Track* track = &state->tracks[state->track_amount];
+    track->id = state->track_amount;
+    track->x = x;
+    track->y = y;
+    track->first_frame = state->frame_index;
+    track->last_frame = state->frame_index;
+    track->frames_seen = 0;
+    return state->track_amount++;
+}
+
+Sequence_state* create_sequence_state(const int tile_tolerance, const int link_distance) {
+    Sequence_state* state = malloc(sizeof(Sequence_state));
+    if (state == NULL) {
+        fprintf(stderr, "Failed to allocate sequence state\n");
+        return NULL;
+    }
+    memset(state->work, 0, sizeof(state->work));
+    memset(state->tile_difference, 0, sizeof(state->tile_difference));
+    memset(state->histogram, 0, sizeof(state->histogram));
+    state->threshold = 0;
+    state->frame_index = 0;
+    state->tile_tolerance = tile_tolerance;
+    state->link_distance = link_distance;
+    state->cell_amount = 0;
+    state->tracks = NULL;
+    state->track_amount = 0;
+    state->track_capacity = 0;
+    return state;
+}
+
+void destroy_sequence_state(Sequence_state* state) {
+    if (state == NULL) {
+        return;
+    }
+    free(state->tracks);
+    free(state);
+}
+
+void process_sequence_frame(Sequence_state* state, const Pipeline* pipeline,
+    unsigned char grayscale_image[BMP_WIDTH][BMP_HEIGHT], Frame_report* report) {
+    const bool first_frame = state->frame_index == 0;
+    bool changed[TILES_X][TILES_Y];
+    bool dirty[TILES_X][TILES_Y];
+    bool core[TILES_X][TILES_Y];
+    bool work[TILES_X][TILES_Y];
+    int x0, x1, y0, y1;
+
+    memset(report, 0, sizeof(Frame_report));
+
+    // Find the tiles whose grayscale changed and move the histogram along with them
+    if (first_frame) {
+        for (int x = 0; x < BMP_WIDTH; x++) {
+            for (int y = 0; y < BMP_HEIGHT; y++) {
+                state->histogram[grayscale_image[x][y]]++;
+            }
+        }
+        memcpy(state->grayscale, grayscale_image, BMP_WIDTH * BMP_HEIGHT);
+        memset(changed, true, sizeof(changed));
+        report->changed_tiles = TILES_X * TILES_Y;
+    } else {
+        for (int tile_x = 0; tile_x < TILES_X; tile_x++) {
+            for (int tile_y = 0; tile_y < TILES_Y; tile_y++) {
+                get_tile_bounds(tile_x, tile_y, &x0, &x1, &y0, &y1);
+                changed[tile_x][tile_y] = false;
+                for (int x = x0; x < x1; x++) {
+                    if (memcmp(&grayscale_image[x][y0], &state->grayscale[x][y0], y1 - y0) != 0) {
+                        changed[tile_x][tile_y] = true;
+                        break;
+                    }
+                }
+                if (!changed[tile_x][tile_y]) continue;
+
+                report->changed_tiles++;
+                for (int x = x0; x < x1; x++) {
+                    for (int y = y0; y < y1; y++) {
+                        state->histogram[state->grayscale[x][y]]--;
+                        state->histogram[grayscale_image[x][y]]++;
+                    }
+                    memcpy(&state->grayscale[x][y0], &grayscale_image[x][y0], y1 - y0);
+                }
+            }
+        }
+    }
+
+    // The histogram is kept up to date tile by tile, so the Otsu search needs no pass over the frame
+    const int threshold = threshold_from_histogram(&pipeline->config, state->histogram);
+    const bool threshold_changed = first_frame || threshold != state->threshold;
+    state->threshold = threshold;
+
+    // A tile is dirty once its binary content has drifted too far from what was last detected on
+    for (int tile_x = 0; tile_x < TILES_X; tile_x++) {
+        for (int tile_y = 0; tile_y < TILES_Y; tile_y++) {
+            if (first_frame) {
+                dirty[tile_x][tile_y] = true;
+                continue;
+            }
+            if (threshold_changed || changed[tile_x][tile_y]) {
+                get_tile_bounds(tile_x, tile_y, &x0, &x1, &y0, &y1);
+                int difference = 0;
+                for (int x = x0; x < x1; x++) {
+                    for (int y = y0; y < y1; y++) {
+                        difference += binary_value(grayscale_image[x][y], threshold, x, y) != state->binary[x][y];
+                    }
+                }
+                state->tile_difference[tile_x][tile_y] = difference;
+            }
+            dirty[tile_x][tile_y] = state->tile_difference[tile_x][tile_y] > state->tile_tolerance;
+        }
+    }
+
+    // Detection is redone in the dirty tiles plus a margin, with enough rings of tiles around them as context
+    // for the detector to see what it would see in the full frame
+    dilate_tile_mask(dirty, core);
+    memcpy(work, core, sizeof(work));
+    const int reach = detection_reach(&pipeline->config);
+    for (int ring = 0; ring * TILE_SIZE < reach; ring++) {
+        bool grown[TILES_X][TILES_Y];
+        dilate_tile_mask(work, grown);
+        memcpy(work, grown, sizeof(work));
+    }
+
+    for (int tile_x = 0; tile_x < TILES_X; tile_x++) {
+        for (int tile_y = 0; tile_y < TILES_Y; tile_y++) {
+            report->dirty_tiles += dirty[tile_x][tile_y];
+            if (!work[tile_x][tile_y]) continue;
+
+            get_tile_bounds(tile_x, tile_y, &x0, &x1, &y0, &y1);
+            for (int x = x0; x < x1; x++) {
+                for (int y = y0; y < y1; y++) {
+                    state->work[0][x][y] = binary_value(grayscale_image[x][y], threshold, x, y);
+                }
+            }
+            if (core[tile_x][tile_y]) {
+                for (int x = x0; x < x1; x++) {
+                    memcpy(&state->binary[x][y0], &state->work[0][x][y0], y1 - y0);
+                }
+                state->tile_difference[tile_x][tile_y] = 0;
+            }
+        }
+    }
+
+    // The active tiles shrink as the blobs erode away, work keeps the full set for the cleanup below
+    bool active[TILES_X][TILES_Y];
+    memcpy(active, work, sizeof(active));
+
+    Cell_list* found = create_cell_list();
+    unsigned char (*front)[BMP_HEIGHT] = state->work[0];
+    unsigned char (*back)[BMP_HEIGHT] = state->work[1];
+    while (erode_image_tiles_into(front, back, active, active)) {
+        unsigned char (*eroded)[BMP_HEIGHT] = back;
+        back = front;
+        front = eroded;
+        run_detection_stage(pipeline, front, active, found);
+    }
+
+    // Leave both work images black for the next frame
+    for (int tile_x = 0; tile_x < TILES_X; tile_x++) {
+        for (int tile_y = 0; tile_y < TILES_Y; tile_y++) {
+            if (!work[tile_x][tile_y]) continue;
+            get_tile_bounds(tile_x, tile_y, &x0, &x1, &y0, &y1);
+            for (int x = x0; x < x1; x++) {
+                memset(&state->work[0][x][y0], 0, y1 - y0);
+                memset(&state->work[1][x][y0], 0, y1 - y0);
+            }
+        }
+    }
+
+    // Cells outside the core keep their place, cells inside it are replaced by the new detections
+    Tracked_cell lost[SEQUENCE_MAX_CELLS];
+    int lost_amount = 0;
+    int kept_amount = 0;
+    for (int i = 0; i < state->cell_amount; i++) {
+        const Tracked_cell cell = state->cells[i];
+        if (is_in_tile_mask(core, cell.x, cell.y)) {
+            lost[lost_amount++] = cell;
+        } else {
+            state->cells[kept_amount++] = cell;
+        }
+    }
+    state->cell_amount = kept_amount;
+
+    // Link each new cell to the closest lost cell within reach, or start a new track
+    bool taken[SEQUENCE_MAX_CELLS] = {false};
+    const int max_distance_squared = state->link_distance * state->link_distance;
+    for (const Cell* current = found->head; current; current = current->next) {
+        if (!is_in_tile_mask(core, current->x, current->y)) continue;
+        if (state->cell_amount == SEQUENCE_MAX_CELLS) {
+            fprintf(stderr, "Error: Too many cells in frame %d.\n", state->frame_index);
+            break;
+        }
+
+        int best = -1;
+        int best_distance_squared = max_distance_squared + 1;
+        for (int i = 0; i < lost_amount; i++) {
+            if (taken[i]) continue;
+            const int dx = lost[i].x - current->x;
+            const int dy = lost[i].y - current->y;
+            const int distance_squared = dx * dx + dy * dy;
+            if (distance_squared < best_distance_squared) {
+                best = i;
+                best_distance_squared = distance_squared;
+            }
+        }
+
+        int track_id;
+        if (best >= 0) {
+            taken[best] = true;
+            track_id = lost[best].track_id;
+        } else {
+            track_id = start_track(state, current->x, current->y);
+            if (track_id < 0) {
+                // Without a track the cell could not be followed, so it is left out rather than stored untracked
+                report->untracked_cells++;
+                continue;
+            }
+            report->new_tracks++;
+        }
+
+        Tracked_cell* cell = &state->cells[state->cell_amount++];
+        cell->x = current->x;
+        cell->y = current->y;
+        cell->track_id = track_id;
+    }
+    destroy_cell_list(found);
+
+    for (int i = 0; i < lost_amount; i++) {
+        report->lost_cells += !taken[i];
+    }
+
+    // Bring the tracks up to date with this frame
+    for (int i = 0; i < state->cell_amount; i++) {
+        Track* track = find_track(state, state->cells[i].track_id);
+        if (track == NULL) continue;
+        track->x = state->cells[i].x;
+        track->y = state->cells[i].y;
+        track->last_frame = state->frame_index;
+        track->frames_seen++;
+    }
+
+    report->threshold = threshold;
+    report->cells = state->cell_amount;
+    state->frame_index++;
+}
+
+void sequence_cells_to_list(const Sequence_state* state, Cell_list* cell_list) {
+    for (int i = 0; i < state->cell_amount; i++) {
+        add_to_cell_list(cell_list, state->cells[i].x, state->cells[i].y);
+    }
+}
@@ -0,0 +1,108 @@
+#ifndef CELL_DETECTION_SEQUENCE_H
+#define CELL_DETECTION_SEQUENCE_H
+
+#include <stdbool.h>
+
+#include "cbmp.h"
+#include "image_processing.h"
+#include "pipeline.h"
+
+#define SEQUENCE_MAX_CELLS 4000
+
+// A detected cell together with the track it belongs to
+typedef struct {
+    int x;
+    int y;
+    int track_id;
+} Tracked_cell;
+
+// A cell followed across several frames, at its last position
+typedef struct {
+    int id;
+    int x;
+    int y;
+    int first_frame;
+    int last_frame;
+    int frames_seen;
+} Track;
+
+// State carried from one frame of a time-lapse sequence to the next
+typedef struct {
+    // Blurred grayscale of the previous frame, used to find the tiles that changed
+    unsigned char grayscale[BMP_WIDTH][BMP_HEIGHT];
+    // Binary content of each tile at the time it was last detected on
+    unsigned char binary[BMP_WIDTH][BMP_HEIGHT];
+    // Ping-pong work images for erosion, read from one and written to the other like the arena's planes.
+    // Everything outside the tiles being processed stays black in both.
+    unsigned char work[2][BMP_WIDTH][BMP_HEIGHT];
+    // Number of binary pixels in each tile that differ from the reference binary
+    int tile_difference[TILES_X][TILES_Y];
+    // Histogram of the previous frame, updated tile by tile
+    int histogram[256];
+    int threshold;
+
+    int frame_index;
+    int tile_tolerance;
+    int link_distance;
+
+    Tracked_cell cells[SEQUENCE_MAX_CELLS];
+    int cell_amount;
+
+    Track* tracks;
+    int track_amount;
+    int track_capacity;
+} Sequence_state;
+
+// What happened while processing one frame
+typedef struct {
+    int threshold;
+    int changed_tiles;
+    int dirty_tiles;
+    int cells;
+    int new_tracks;
+    int lost_cells;
+    // New cells dropped because no track could be allocated for them
+    int untracked_cells;
+} Frame_report;
+
+/**
+ * @brief Creates the state for a new time-lapse sequence.
+ *
+ * @param tile_tolerance The number of binary pixels that may change in a tile before it is detected on again.
+ * @param link_distance The maximum distance a cell may move between frames and keep its track.
+ * @return A pointer to the new state, or NULL if it could not be allocated.
+ */
+Sequence_state* create_sequence_state(int tile_tolerance, int link_distance);
+
+/**
+ * @brief Frees the sequence state and its tracks.
+ * @param state A pointer to the state to destroy.
+ */
+void destroy_sequence_state(Sequence_state* state);
+
+/**
+ * @brief Processes the next frame of the sequence.
+ *
+ * The first frame is processed in full. Later frames only update the histogram for tiles that
+ * changed before searching it for the Otsu threshold, and only erode and detect in tiles whose
+ * binary content changed by more than the tolerance. The threshold and the detector are the pipeline's,
+ * its engine and pyramid settings are not used.
+ * Cells in the other tiles are carried over with their track IDs.
+ *
+ * @param state The sequence state.
+ * @param pipeline The pipeline whose threshold and detector settings are used.
+ * @param grayscale_image The blurred grayscale image of the frame. It is not modified.
+ * @param report Filled with statistics about the frame.
+ */
+void process_sequence_frame(Sequence_state* state, const Pipeline* pipeline,
+                            unsigned char grayscale_image[BMP_WIDTH][BMP_HEIGHT], Frame_report* report);
+
+/**
+ * @brief Copies the cells of the last processed frame into a cell list, for drawing.
+ *
+ * @param state The sequence state.
+ * @param cell_list The list to add the cells to.
+ */
+void sequence_cells_to_list(const Sequence_state* state, Cell_list* cell_list);
+
+#endif // CELL_DETECTION_SEQUENCE_H
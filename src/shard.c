@@ -0,0 +1,553 @@
+#include "shard.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "batch_io.h"
+#include "util.h"
+
+// Cells one record carries. An image with more spans several records.
+#define SHARD_RECORD_CELLS 1024
+// Records the ring holds before the workers wait for the parent to drain it
+#define SHARD_RING_RECORDS 32
+// How often the parent looks for workers that died while it waits on an empty ring
+#define SHARD_POLL_MILLISECONDS 100
+
+// One image's result, or part of its cells, on its way from a worker to the parent
+typedef struct {
+    int image;
+    int worker;
+    // False if the image could not be read, the record then carries no cells
+    bool valid;
+    int threshold;
+    // The image's cells, of which this record holds record_cells starting at first_cell
+    int cell_amount;
+    int first_cell;
+    int record_cells;
+    bool cached;
+    // Set when the deadline stopped the erosion loop, after erosion_passes passes
+    bool deadline_expired;
+    int erosion_passes;
+    double read_seconds;
+    double compute_seconds;
+    // Processor time the worker spent on the image, which unlike the wall time excludes the other workers' turns
+    double cpu_seconds;
+    // Cache files the worker evicted when storing this image's cells
+    int cache_evictions;
+    // Only the first record_cells are copied through the ring
+    int cells[SHARD_RECORD_CELLS][2];
+} Shard_record;
+
+// Mapped shared before the workers are forked, so the lock and conditions are process-shared
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    // First image no worker has claimed yet
+    int next_image;
+    int head;
+    int count;
+    Shard_record records[SHARD_RING_RECORDS];
+} Shard_ring;
+
+typedef struct {
+    const Pipeline* pipeline;
+    Result_cache* cache;
+    char** input_paths;
+    int input_amount;
+    Shard_ring* ring;
+    // Process of every worker, 0 once it has been waited for
+    pid_t pids[SHARD_MAX_WORKERS];
+    int running;
+} Shard_run;
+
+// One image's result as the parent assembles it from the records
+typedef struct {
+    bool complete;
+    bool valid;
+    int worker;
+    int threshold;
+    int cell_amount;
+    int received;
+    // Head first, x and y of every cell
+    int* cells;
+    bool cached;
+    bool deadline_expired;
+    int erosion_passes;
+    double read_seconds;
+    double compute_seconds;
+    double cpu_seconds;
+} Shard_result;
+
+typedef struct {
+    int images;
+    int cells;
+    // Processor time spent reading and computing rather than claiming images or waiting on the ring
+    double busy;
+} Worker_load;
+
+// What a run with one worker count did
+typedef struct {
+    int workers;
+    double elapsed;
+    Worker_load loads[SHARD_MAX_WORKERS];
+    int failed;
+    int expired;
+    int cache_hits;
+    int cache_misses;
+    int cache_evictions;
+} Shard_pass;
+
+static double process_seconds(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &time);
+    return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+static Shard_ring* create_ring(void) {
+    Shard_ring* ring = mmap(NULL, sizeof(Shard_ring), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED) {
+        perror("Failed to map the shard ring");
+        return NULL;
+    }
+    pthread_mutexattr_t mutex_attributes;
+    pthread_mutexattr_init(&mutex_attributes);
+    pthread_mutexattr_setpshared(&mutex_attributes, PTHREAD_PROCESS_SHARED);
+    // A worker that dies holding the lock hands it on instead of hanging the run
+    pthread_mutexattr_setrobust(&mutex_attributes, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&ring->lock, &mutex_attributes);
+    pthread_mutexattr_destroy(&mutex_attributes);
+
+    pthread_condattr_t condition_attributes;
+    pthread_condattr_init(&condition_attributes);
+    pthread_condattr_setpshared(&condition_attributes, PTHREAD_PROCESS_SHARED);
+    pthread_condattr_setclock(&condition_attributes, CLOCK_MONOTONIC);
+    pthread_cond_init(&ring->not_empty, &condition_attributes);
+    pthread_cond_init(&ring->not_full, &condition_attributes);
+    pthread_condattr_destroy(&condition_attributes);
+
+    ring->next_image = 0;
+    ring->head = 0;
+    ring->count = 0;
+    return ring;
+}
+
+static void destroy_ring(Shard_ring* ring) {
+    pthread_cond_destroy(&ring->not_full);
+    pthread_cond_destroy(&ring->not_empty);
+    pthread_mutex_destroy(&ring->lock);
+    munmap(ring, sizeof(Shard_ring));
+}
+
+// A record is pushed or popped entirely under the lock, so a worker that died holding it
+// left the ring as it was before or after its last change
+static void recover_lock(Shard_ring* ring, const int status) {
+    if (status == EOWNERDEAD) {
+        pthread_mutex_consistent(&ring->lock);
+    }
+}
+
+static void lock_ring(Shard_ring* ring) {
+    recover_lock(ring, pthread_mutex_lock(&ring->lock));
+}
+
+static int claim_image(Shard_ring* ring, const int input_amount) {
+    lock_ring(ring);
+    const int image = ring->next_image < input_amount ? ring->next_image++ : -1;
+    pthread_mutex_unlock(&ring->lock);
+    return image;
+}
+
+static size_t record_size(const Shard_record* record) {
+    return offsetof(Shard_record, cells) + sizeof(record->cells[0]) * record->record_cells;
+}
+
+static void push_record(Shard_ring* ring, const Shard_record* record) {
+    lock_ring(ring);
+    while (ring->count == SHARD_RING_RECORDS) {
+        recover_lock(ring, pthread_cond_wait(&ring->not_full, &ring->lock));
+    }
+    memcpy(&ring->records[(ring->head + ring->count) % SHARD_RING_RECORDS], record, record_size(record));
+    ring->count++;
+    pthread_cond_signal(&ring->not_empty);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+/**
+ * @brief Waits for the workers that have exited, or for all of them if block is set, and reports
+ * the ones that did not exit cleanly.
+ */
+static void reap_workers(Shard_run* run, const bool block) {
+    for (int worker = 0; worker < SHARD_MAX_WORKERS && run->running > 0; worker++) {
+        int status;
+        if (run->pids[worker] <= 0 ||
+            waitpid(run->pids[worker], &status, block ? 0 : WNOHANG) != run->pids[worker]) {
+            continue;
+        }
+        if (WIFSIGNALED(status)) {
+            fprintf(stderr, "Worker %d was killed by signal %d\n", worker, WTERMSIG(status));
+        } else if (WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "Worker %d exited with status %d\n", worker, WEXITSTATUS(status));
+        }
+        run->pids[worker] = 0;
+        run->running--;
+    }
+}
+
+/**
+ * @brief Takes the oldest record off the ring, waiting for one if it is empty.
+ * @return False once the ring is empty and every worker has exited.
+ */
+static bool pop_record(Shard_run* run, Shard_record* record) {
+    Shard_ring* ring = run->ring;
+    lock_ring(ring);
+    while (ring->count == 0) {
+        if (run->running == 0) {
+            pthread_mutex_unlock(&ring->lock);
+            return false;
+        }
+        struct timespec until;
+        clock_gettime(CLOCK_MONOTONIC, &until);
+        until.tv_nsec += SHARD_POLL_MILLISECONDS * 1000000L;
+        if (until.tv_nsec >= 1000000000L) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000L;
+        }
+        const int status = pthread_cond_timedwait(&ring->not_empty, &ring->lock, &until);
+        recover_lock(ring, status);
+        if (status == ETIMEDOUT) {
+            reap_workers(run, false);
+        }
+    }
+    const Shard_record* oldest = &ring->records[ring->head];
+    memcpy(record, oldest, record_size(oldest));
+    ring->head = (ring->head + 1) % SHARD_RING_RECORDS;
+    ring->count--;
+    pthread_cond_signal(&ring->not_full);
+    pthread_mutex_unlock(&ring->lock);
+    return true;
+}
+
+// Sends the cells head first, in as many records as they need
+static void push_cells(Shard_ring* ring, Shard_record* record, const Cell_list* cell_list) {
+    record->cell_amount = cell_list->cell_amount;
+    record->first_cell = 0;
+    record->record_cells = 0;
+    for (const Cell* cell = cell_list->head; cell != NULL; cell = cell->next) {
+        if (record->record_cells == SHARD_RECORD_CELLS) {
+            push_record(ring, record);
+            record->first_cell += record->record_cells;
+            record->record_cells = 0;
+        }
+        record->cells[record->record_cells][0] = cell->x;
+        record->cells[record->record_cells][1] = cell->y;
+        record->record_cells++;
+    }
+    push_record(ring, record);
+}
+
+// Runs in the forked process until no image is left to claim
+static int run_worker(const Shard_run* run, const int worker) {
+    Scratch_arena* arena = create_scratch_arena();
+    unsigned char* file_bytes = malloc(BATCH_IO_BUFFER_SIZE);
+    Shard_record* record = malloc(sizeof(Shard_record));
+    if (arena == NULL || file_bytes == NULL || record == NULL) {
+        fprintf(stderr, "Worker %d failed to allocate its buffers\n", worker);
+        destroy_scratch_arena(arena);
+        free(file_bytes);
+        free(record);
+        return 1;
+    }
+
+    int image;
+    while ((image = claim_image(run->ring, run->input_amount)) >= 0) {
+        const char* input_path = run->input_paths[image];
+        const double started = now_seconds();
+        const double cpu_started = process_seconds();
+        *record = (Shard_record){.image = image, .worker = worker};
+        record->valid = read_bitmap_file(input_path, file_bytes, arena->front, NULL);
+        const double compute_started = now_seconds();
+        record->read_seconds = compute_started - started;
+        if (!record->valid) {
+            fprintf(stderr, "Skipping %s\n", input_path);
+            record->cpu_seconds = process_seconds() - cpu_started;
+            push_record(run->ring, record);
+            continue;
+        }
+
+        Cell_list* cell_list = create_cell_list();
+        Result_cache* cache = run->cache;
+        const unsigned long long cache_key = cache != NULL ? result_cache_key(arena->front, &run->pipeline->config) : 0;
+        record->cached = cache != NULL && lookup_result_cache(cache, cache_key, cell_list, &record->threshold);
+        if (!record->cached) {
+            Pipeline_stats stats;
+            record->threshold = run_pipeline(run->pipeline, arena, cell_list, NULL, &stats);
+            record->deadline_expired = stats.deadline_expired;
+            record->erosion_passes = stats.erosion_passes;
+            if (cache != NULL && !stats.deadline_expired) {
+                const int evictions = cache->evictions;
+                store_result_cache(cache, cache_key, cell_list, record->threshold);
+                record->cache_evictions = cache->evictions - evictions;
+            }
+        }
+        record->compute_seconds = now_seconds() - compute_started;
+        record->cpu_seconds = process_seconds() - cpu_started;
+        push_cells(run->ring, record, cell_list);
+        destroy_cell_list(cell_list);
+    }
+
+    destroy_scratch_arena(arena);
+    free(file_bytes);
+    free(record);
+    return 0;
+}
+
+/**
+ * @brief Adds a record to its image's result.
+ * @return True if the record completed the image.
+ */
+static bool merge_record(Shard_result* results, const Shard_record* record) {
+    Shard_result* result = &results[record->image];
+    if (record->first_cell == 0) {
+        result->valid = record->valid;
+        result->worker = record->worker;
+        result->threshold = record->threshold;
+        result->cell_amount = record->cell_amount;
+        result->received = 0;
+        result->cached = record->cached;
+        result->deadline_expired = record->deadline_expired;
+        result->erosion_passes = record->erosion_passes;
+        result->read_seconds = record->read_seconds;
+        result->compute_seconds = record->compute_seconds;
+        result->cpu_seconds = record->cpu_seconds;
+        result->cells = record->valid ? malloc(sizeof(int) * 2 * (record->cell_amount > 0 ? record->cell_amount : 1))
+                                      : NULL;
+        if (record->valid && result->cells == NULL) {
+            fprintf(stderr, "Failed to allocate the cells of image %d\n", record->image);
+            result->valid = false;
+        }
+    }
+    if (result->cells != NULL) {
+        memcpy(result->cells + 2 * record->first_cell, record->cells, sizeof(record->cells[0]) * record->record_cells);
+    }
+    result->received += record->record_cells;
+    result->complete = result->received >= result->cell_amount;
+    return result->complete;
+}
+
+static void free_results(Shard_result* results, const int input_amount) {
+    for (int i = 0; i < input_amount; i++) {
+        free(results[i].cells);
+        results[i] = (Shard_result){.worker = -1};
+    }
+}
+
+/**
+ * @brief Forks the workers, merges their records as they arrive and waits for them to exit.
+ * @return False if no worker could be started.
+ */
+static bool run_shard_pass(const Pipeline* pipeline, Result_cache* cache, const int workers, char** input_paths,
+                           const int input_amount, Shard_result* results, Shard_pass* pass) {
+    Shard_run run = {
+        .pipeline = pipeline,
+        .cache = cache,
+        .input_paths = input_paths,
+        .input_amount = input_amount,
+    };
+    Shard_record* record = malloc(sizeof(Shard_record));
+    run.ring = record != NULL ? create_ring() : NULL;
+    if (run.ring == NULL) {
+        fprintf(stderr, "Failed to set up the shard ring\n");
+        free(record);
+        return false;
+    }
+    memset(pass, 0, sizeof(*pass));
+
+    // Whatever waits in the stdio buffers would otherwise be written again by every worker
+    fflush(stdout);
+    fflush(stderr);
+    const double started = now_seconds();
+    for (int worker = 0; worker < workers; worker++) {
+        const pid_t pid = fork();
+        if (pid == 0) {
+            _exit(run_worker(&run, worker));
+        }
+        if (pid < 0) {
+            perror("Failed to fork a worker");
+            break;
+        }
+        run.pids[worker] = pid;
+        run.running++;
+    }
+    pass->workers = run.running;
+
+    int outstanding = input_amount;
+    while (outstanding > 0 && pop_record(&run, record)) {
+        if (!merge_record(results, record)) {
+            continue;
+        }
+        outstanding--;
+        const Shard_result* result = &results[record->image];
+        Worker_load* load = &pass->loads[result->worker];
+        load->images++;
+        load->cells += result->cell_amount;
+        load->busy += result->cpu_seconds;
+        pass->expired += result->deadline_expired;
+        pass->cache_hits += result->valid && result->cached;
+        pass->cache_misses += result->valid && !result->cached;
+        pass->cache_evictions += record->cache_evictions;
+    }
+    // The workers exit once no image is left to claim
+    reap_workers(&run, true);
+    pass->elapsed = now_seconds() - started;
+
+    // Images whose worker died before sending all of them are lost
+    for (int i = 0; i < input_amount; i++) {
+        if (!results[i].complete || !results[i].valid) {
+            pass->failed++;
+        }
+    }
+    destroy_ring(run.ring);
+    free(record);
+    return pass->workers > 0;
+}
+
+// Relative amount the busiest worker worked longer than the mean
+static double load_imbalance(const Shard_pass* pass) {
+    double total = 0;
+    double busiest = 0;
+    for (int worker = 0; worker < pass->workers; worker++) {
+        total += pass->loads[worker].busy;
+        busiest = pass->loads[worker].busy > busiest ? pass->loads[worker].busy : busiest;
+    }
+    return total > 0 ? busiest * pass->workers / total - 1 : 0;
+}
+
+static void print_scaling_row(const Shard_pass* pass, const int input_amount, const double single_throughput) {
+    const double throughput = pass->elapsed > 0 ? input_amount / pass->elapsed : 0;
+    const double speedup = single_throughput > 0 ? throughput / single_throughput : 0;
+    printf("%8d %10.3f %10.1f %8.2f %9.0f%% %9.0f%%\n", pass->workers, pass->elapsed, throughput, speedup,
+           100 * speedup / pass->workers, 100 * load_imbalance(pass));
+}
+
+static bool write_results(const char* result_path, char** input_paths, const Shard_result* results,
+                          const int input_amount) {
+    FILE* file = fopen(result_path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Failed to create %s: %s\n", result_path, strerror(errno));
+        return false;
+    }
+    for (int i = 0; i < input_amount; i++) {
+        const Shard_result* result = &results[i];
+        if (!result->complete || !result->valid) {
+            fprintf(file, "image %d %s failed\n", i, input_paths[i]);
+            continue;
+        }
+        fprintf(file, "image %d %s threshold %d cells %d worker %d read %.3f ms compute %.3f ms", i, input_paths[i],
+                result->threshold, result->cell_amount, result->worker, 1000 * result->read_seconds,
+                1000 * result->compute_seconds);
+        if (result->cached) {
+            fprintf(file, " cached");
+        } else if (result->deadline_expired) {
+            fprintf(file, " expired %d", result->erosion_passes);
+        }
+        fprintf(file, "\n");
+        for (int cell = 0; cell < result->cell_amount; cell++) {
+            fprintf(file, "%d %d\n", result->cells[2 * cell], result->cells[2 * cell + 1]);
+        }
+    }
+    const bool written = !ferror(file);
+    if (fclose(file) != 0 || !written) {
+        fprintf(stderr, "Failed to write %s\n", result_path);
+        return false;
+    }
+    return true;
+}
+
+int run_sharded(const Pipeline* pipeline, const Shard_options* options, const char* result_path,
+                char** input_paths, const int input_amount) {
+    if (options->workers < 1 || options->workers > SHARD_MAX_WORKERS) {
+        fprintf(stderr, "The worker count must be from 1 to %d\n", SHARD_MAX_WORKERS);
+        return 1;
+    }
+    Shard_result* results = malloc(sizeof(Shard_result) * input_amount);
+    Shard_pass* pass = malloc(sizeof(Shard_pass));
+    if (results == NULL || pass == NULL) {
+        fprintf(stderr, "Failed to allocate the results of %d images\n", input_amount);
+        free(results);
+        free(pass);
+        return 1;
+    }
+    for (int i = 0; i < input_amount; i++) {
+        results[i] = (Shard_result){.worker = -1};
+    }
+
+    double single_throughput = 0;
+    if (options->scaling) {
+        printf("%8s %10s %10s %8s %10s %10s\n", "workers", "seconds", "images/s", "speedup", "efficiency",
+               "imbalance");
+        // Without the cache, which would turn every run after the first into a run of hits
+        for (int workers = 1; workers < options->workers; workers *= 2) {
+            const bool started = run_shard_pass(pipeline, NULL, workers, input_paths, input_amount, results, pass);
+            free_results(results, input_amount);
+            if (!started) {
+                free(results);
+                free(pass);
+                return 1;
+            }
+            if (workers == 1) {
+                single_throughput = pass->elapsed > 0 ? input_amount / pass->elapsed : 0;
+            }
+            print_scaling_row(pass, input_amount, single_throughput);
+        }
+    }
+
+    if (!run_shard_pass(pipeline, options->cache, options->workers, input_paths, input_amount, results, pass)) {
+        free(results);
+        free(pass);
+        return 1;
+    }
+    if (options->scaling) {
+        if (pass->workers == 1) {
+            single_throughput = pass->elapsed > 0 ? input_amount / pass->elapsed : 0;
+        }
+        print_scaling_row(pass, input_amount, single_throughput);
+    }
+
+    for (int worker = 0; worker < pass->workers; worker++) {
+        const Worker_load* load = &pass->loads[worker];
+        printf("Worker %d: %d images, %d cells, busy %.3f s (%.0f%%)\n", worker, load->images, load->cells,
+               load->busy, pass->elapsed > 0 ? 100 * load->busy / pass->elapsed : 0);
+    }
+    printf("Processed %d images in %.3f s (%.1f images/s) with %d worker processes, %.0f%% load imbalance\n",
+           input_amount, pass->elapsed, pass->elapsed > 0 ? input_amount / pass->elapsed : 0, pass->workers,
+           100 * load_imbalance(pass));
+    if (pipeline->config.deadline_ms > 0) {
+        printf("The %d ms deadline cut %d of %d images short\n", pipeline->config.deadline_ms, pass->expired,
+               input_amount - pass->failed);
+    }
+    if (options->cache != NULL) {
+        // The workers counted in their own copies of the cache
+        options->cache->hits += pass->cache_hits;
+        options->cache->misses += pass->cache_misses;
+        options->cache->evictions += pass->cache_evictions;
+    }
+
+    const bool written = write_results(result_path, input_paths, results, input_amount);
+    if (pass->failed > 0) {
+        fprintf(stderr, "%d of %d images could not be processed\n", pass->failed, input_amount);
+    }
+    const int result = written && pass->failed == 0 ? 0 : 1;
+    free_results(results, input_amount);
+    free(results);
+    free(pass);
+    return result;
+}
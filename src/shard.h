@@ -0,0 +1,49 @@
+#ifndef CELL_DETECTION_SHARD_H
+#define CELL_DETECTION_SHARD_H
+
+#include <stdbool.h>
+
+#include "pipeline.h"
+#include "result_cache.h"
+
+// Most worker processes a sharded run forks
+#define SHARD_MAX_WORKERS 256
+
+// How a sharded run splits the images over worker processes
+typedef struct {
+    // Worker processes, each with its own address space, arena and cbmp write template
+    int workers;
+    // Run with 1, 2, 4, ... workers first and report how the throughput scales, before the run that counts
+    bool scaling;
+    // Cache the workers look images up in before running the pipeline, or NULL
+    Result_cache* cache;
+} Shard_options;
+
+/**
+ * @brief Processes many images in forked worker processes and merges their results into one file.
+ *
+ * Workers claim the next unprocessed image from a counter in shared memory, so a worker that drew fast images
+ * takes on more of them. Each one reads, decodes and runs the pipeline on its image and pushes the threshold,
+ * the cells and the timings into a ring of fixed-size records in shared memory, one image spanning several
+ * records when it has many cells. The parent drains the ring while the workers run and writes the results
+ * in input order once all are in.
+ *
+ * Nothing is shared between the workers but the ring, so cbmp's write template and main's static buffers are
+ * never touched by two of them. A worker that dies loses only the image it was on, which is reported.
+ *
+ * The result file holds an "image N <path> threshold T cells C worker W read R ms compute P ms" line per image,
+ * with " cached" or " expired E" appended when the cells came from the cache or the deadline cut the erosion
+ * short after E passes, followed by one "x y" line per cell. An image that could not be processed gets
+ * "image N <path> failed".
+ *
+ * @param pipeline The pipeline to run on every image.
+ * @param options The worker count, scaling report and cache.
+ * @param result_path The file the merged results are written to.
+ * @param input_paths The images to process.
+ * @param input_amount The number of images.
+ * @return 0 on success, 1 if the run could not be set up or an image could not be processed.
+ */
+int run_sharded(const Pipeline* pipeline, const Shard_options* options, const char* result_path,
+                char** input_paths, int input_amount);
+
+#endif // CELL_DETECTION_SHARD_H
@@ -0,0 +1,85 @@
+#include "stream.h"
+
+#include <stdlib.h>
+
+static bool write_cell_record(FILE* output, const int image, const int threshold, const Cell_list* cell_list,
+                              const Pipeline_stats* stats) {
+    fprintf(output, "image %d threshold %d cells %d", image, threshold, cell_list->cell_amount);
+    if (stats != NULL && stats->deadline_expired) {
+        // The cells found before the deadline, after this many erosion passes
+        fprintf(output, " expired %d", stats->erosion_passes);
+    }
+    fprintf(output, "\n");
+    for (const Cell* cell = cell_list->head; cell != NULL; cell = cell->next) {
+        fprintf(output, "%d %d\n", cell->x, cell->y);
+    }
+    return fflush(output) == 0 && !ferror(output);
+}
+
+int run_stream(const Pipeline* pipeline, const Stream_output format, Result_cache* cache, FILE* input,
+               FILE* output) {
+    Scratch_arena* arena = create_scratch_arena();
+    // The RGB copy is only decoded when the marked image is written
+    unsigned char(*rgb)[BMP_HEIGHT][BMP_CHANNELS] =
+        format == STREAM_BITMAPS ? malloc(sizeof(unsigned char[BMP_WIDTH][BMP_HEIGHT][BMP_CHANNELS])) : NULL;
+    if (arena == NULL || (format == STREAM_BITMAPS && rgb == NULL)) {
+        fprintf(stderr, "Failed to allocate the stream buffers\n");
+        destroy_scratch_arena(arena);
+        free(rgb);
+        return 1;
+    }
+
+    int result = 0;
+    int image = 0;
+    int expired = 0;
+    for (;; image++) {
+        const int status = read_bitmap_stream(input, arena->front, rgb);
+        if (status <= 0) {
+            if (status < 0) {
+                fprintf(stderr, "Stopped at image %d of the stream\n", image);
+                result = 1;
+            }
+            break;
+        }
+
+        Cell_list* cell_list = create_cell_list();
+        int threshold;
+        Pipeline_stats stats;
+        const Pipeline_stats* run_stats = NULL;
+        const unsigned long long cache_key = cache != NULL ? result_cache_key(arena->front, &pipeline->config) : 0;
+        if (cache == NULL || !lookup_result_cache(cache, cache_key, cell_list, &threshold)) {
+            threshold = run_pipeline(pipeline, arena, cell_list, NULL, &stats);
+            run_stats = &stats;
+            expired += stats.deadline_expired;
+            if (cache != NULL && !stats.deadline_expired) {
+                store_result_cache(cache, cache_key, cell_list, threshold);
+            }
+        }
+
+        bool written;
+        if (format == STREAM_BITMAPS) {
+            draw_points(rgb, cell_list);
+            written = write_bitmap_stream(rgb, output);
+        } else {
+            written = write_cell_record(output, image, threshold, cell_list, run_stats);
+        }
+        destroy_cell_list(cell_list);
+        if (!written) {
+            perror("Error writing the output stream");
+            result = 1;
+            break;
+        }
+    }
+
+    fprintf(stderr, "Streamed %d images\n", image);
+    if (pipeline->config.deadline_ms > 0) {
+        fprintf(stderr, "The %d ms deadline cut %d of them short\n", pipeline->config.deadline_ms, expired);
+    }
+    if (cache != NULL) {
+        fprintf(stderr, "Result cache: %d hits, %d misses, %d evicted\n", cache->hits, cache->misses,
+                cache->evictions);
+    }
+    destroy_scratch_arena(arena);
+    free(rgb);
+    return result;
+}
@@ -0,0 +1,34 @@
+#ifndef CELL_DETECTION_STREAM_H
+#define CELL_DETECTION_STREAM_H
+
+#include <stdio.h>
+
+#include "pipeline.h"
+#include "result_cache.h"
+
+// What the streaming mode writes for every image
+typedef enum {
+    // A text record per image: an "image N threshold T cells C" line followed by one "x y" line per cell.
+    // When the deadline stopped the erosion loop after P passes, " expired P" ends the first line.
+    STREAM_CELLS,
+    // The input with the detected cells marked, as a bitmap file
+    STREAM_BITMAPS
+} Stream_output;
+
+/**
+ * @brief Processes a stream of concatenated bitmap files and writes one result per image as soon as it is done,
+ * so the detector can sit in a shell pipeline without temporary files.
+ *
+ * The input is parsed header by header and never seeked, so it can be a pipe. Progress and errors go to stderr,
+ * leaving the output stream to the results.
+ *
+ * @param pipeline The pipeline to run on every image.
+ * @param format The result written per image.
+ * @param cache The cache to look images up in before running the pipeline, or NULL.
+ * @param input The stream the bitmaps are read from.
+ * @param output The stream the results are written to, flushed after every image.
+ * @return 0 if the whole input was processed, 1 if it held an invalid bitmap or the output could not be written.
+ */
+int run_stream(const Pipeline* pipeline, Stream_output format, Result_cache* cache, FILE* input, FILE* output);
+
+#endif // CELL_DETECTION_STREAM_H
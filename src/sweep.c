@@ -0,0 +1,243 @@
+#include "sweep.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+
+#define GRID_LINE_SIZE 1024
+
+// One configuration of the grid and what it measured over all images
+typedef struct {
+    Pipeline pipeline;
+    int value_index[SWEEP_MAX_AXES];
+    long cells;
+    double blur_seconds;
+    double threshold_seconds;
+    double detection_seconds;
+} Sweep_entry;
+
+// The cached prefixes: the decoded image, its blurred version and the binary image made from that
+typedef struct {
+    unsigned char grayscale[BMP_WIDTH][BMP_HEIGHT];
+    unsigned char blurred[BMP_WIDTH][BMP_HEIGHT];
+    unsigned char binary[BMP_WIDTH][BMP_HEIGHT];
+} Sweep_buffers;
+
+/**
+ * @brief The first stage an option changes the result of, which decides how much of a run can be reused.
+ */
+static Pipeline_stage option_stage(const char* key) {
+    if (strcmp(key, "blur") == 0 || strcmp(key, "blur_passes") == 0 || strcmp(key, "filter_radius") == 0 ||
+        strcmp(key, "guided_epsilon") == 0) {
+        return STAGE_BLUR;
+    }
+    if (strcmp(key, "threshold") == 0 || strcmp(key, "threshold_value") == 0 ||
+        strcmp(key, "threshold_offset") == 0 || strcmp(key, "threshold_tile") == 0 ||
+        strcmp(key, "threshold_separation") == 0) {
+        return STAGE_THRESHOLD;
+    }
+    return STAGE_EROSION;
+}
+
+static bool parse_axis(Sweep_axis* axis, char* key, char* values) {
+    Pipeline_config scratch;
+    default_pipeline_config(&scratch);
+    snprintf(axis->key, sizeof(axis->key), "%s", key);
+    axis->value_amount = 0;
+
+    for (char* value = strtok(values, ","); value != NULL; value = strtok(NULL, ",")) {
+        value = trim(value);
+        if (axis->value_amount == SWEEP_MAX_VALUES || !set_pipeline_option(&scratch, key, value)) {
+            return false;
+        }
+        snprintf(axis->values[axis->value_amount++], SWEEP_VALUE_SIZE, "%s", value);
+    }
+    return axis->value_amount > 0;
+}
+
+bool load_sweep_grid(Sweep_grid* grid, const char* file_path) {
+    FILE* fp = fopen(file_path, "r");
+    if (fp == NULL) {
+        perror("Error opening sweep grid");
+        return false;
+    }
+
+    char line[GRID_LINE_SIZE];
+    int line_number = 0;
+    bool valid = true;
+    grid->axis_amount = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        line_number++;
+        char* text = trim(line);
+        if (*text == '\0' || *text == '#') continue;
+
+        char* separator = strchr(text, '=');
+        if (separator == NULL || grid->axis_amount == SWEEP_MAX_AXES) {
+            fprintf(stderr, "%s:%d: expected key = value, value, ... (at most %d keys)\n", file_path, line_number,
+                    SWEEP_MAX_AXES);
+            valid = false;
+            continue;
+        }
+        *separator = '\0';
+        char* key = trim(text);
+        if (!parse_axis(&grid->axes[grid->axis_amount], key, separator + 1)) {
+            fprintf(stderr, "%s:%d: invalid values for %s\n", file_path, line_number, key);
+            valid = false;
+            continue;
+        }
+        grid->axis_amount++;
+    }
+    fclose(fp);
+
+    // Stable insertion sort by stage, so the earliest stages vary slowest
+    for (int i = 1; i < grid->axis_amount; i++) {
+        const Sweep_axis axis = grid->axes[i];
+        int j = i;
+        for (; j > 0 && option_stage(grid->axes[j - 1].key) > option_stage(axis.key); j--) {
+            grid->axes[j] = grid->axes[j - 1];
+        }
+        grid->axes[j] = axis;
+    }
+    return valid && grid->axis_amount > 0;
+}
+
+/**
+ * @brief Builds the configurations of the grid, the last axis varying fastest.
+ * @return The configurations, or NULL if there are more than SWEEP_MAX_CONFIGS or they could not be allocated.
+ */
+static Sweep_entry* expand_grid(const Pipeline_config* base, const Sweep_grid* grid, int* entry_amount) {
+    // Checked as the product grows, since 8 axes of 32 values would overflow an int
+    int amount = 1;
+    for (int axis = 0; axis < grid->axis_amount; axis++) {
+        amount *= grid->axes[axis].value_amount;
+        if (amount > SWEEP_MAX_CONFIGS) {
+            fprintf(stderr, "The sweep grid has more than %d configurations\n", SWEEP_MAX_CONFIGS);
+            return NULL;
+        }
+    }
+    Sweep_entry* entries = calloc(amount, sizeof(Sweep_entry));
+    if (entries == NULL) {
+        fprintf(stderr, "Failed to allocate %d sweep configurations\n", amount);
+        return NULL;
+    }
+
+    for (int i = 0; i < amount; i++) {
+        Pipeline_config config = *base;
+        int rest = i;
+        for (int axis = grid->axis_amount - 1; axis >= 0; axis--) {
+            const Sweep_axis* current = &grid->axes[axis];
+            entries[i].value_index[axis] = rest % current->value_amount;
+            rest /= current->value_amount;
+        }
+        for (int axis = 0; axis < grid->axis_amount; axis++) {
+            set_pipeline_option(&config, grid->axes[axis].key, grid->axes[axis].values[entries[i].value_index[axis]]);
+        }
+        // Debug images would be written once per configuration
+        config.debug_images = false;
+        build_pipeline(&config, &entries[i].pipeline);
+    }
+    *entry_amount = amount;
+    return entries;
+}
+
+static void write_report(FILE* file, const Sweep_grid* grid, const Sweep_entry* entries, const int entry_amount,
+                         const int input_amount) {
+    fprintf(file, "config");
+    for (int axis = 0; axis < grid->axis_amount; axis++) {
+        fprintf(file, ",%s", grid->axes[axis].key);
+    }
+    fprintf(file, ",cells,cells_per_image,blur_ms,threshold_ms,detection_ms\n");
+
+    for (int i = 0; i < entry_amount; i++) {
+        const Sweep_entry* entry = &entries[i];
+        fprintf(file, "%d", i);
+        for (int axis = 0; axis < grid->axis_amount; axis++) {
+            fprintf(file, ",%s", grid->axes[axis].values[entry->value_index[axis]]);
+        }
+        fprintf(file, ",%ld,%.1f,%.3f,%.3f,%.3f\n", entry->cells, (double)entry->cells / input_amount,
+                1000 * entry->blur_seconds / input_amount, 1000 * entry->threshold_seconds / input_amount,
+                1000 * entry->detection_seconds / input_amount);
+    }
+}
+
+int run_sweep(const Pipeline_config* base, const Sweep_grid* grid, const char* report_path,
+              char** input_paths, const int input_amount) {
+    int entry_amount;
+    Sweep_entry* entries = expand_grid(base, grid, &entry_amount);
+    Sweep_buffers* buffers = malloc(sizeof(Sweep_buffers));
+    Scratch_arena* arena = create_scratch_arena();
+    FILE* report_file = fopen(report_path, "w");
+    if (entries == NULL || buffers == NULL || arena == NULL || report_file == NULL) {
+        if (report_file == NULL) perror("Error opening sweep report");
+        if (report_file != NULL) fclose(report_file);
+        destroy_scratch_arena(arena);
+        free(buffers);
+        free(entries);
+        return 1;
+    }
+
+    const double started = now_seconds();
+    int blur_runs = 0;
+    int threshold_runs = 0;
+    for (int image = 0; image < input_amount; image++) {
+        read_bitmap_grayscale(input_paths[image], buffers->grayscale, NULL);
+
+        // The configurations the cached blurred and binary images were made for
+        const Pipeline_config* blurred_for = NULL;
+        const Pipeline_config* binary_for = NULL;
+        double blur_seconds = 0;
+        double threshold_seconds = 0;
+
+        for (int i = 0; i < entry_amount; i++) {
+            Sweep_entry* entry = &entries[i];
+            const Pipeline_config* config = &entry->pipeline.config;
+
+            if (blurred_for == NULL || !same_blur_stage(blurred_for, config)) {
+                const double blur_started = now_seconds();
+                memcpy(arena->front, buffers->grayscale, sizeof(buffers->grayscale));
+                run_blur_stages(&entry->pipeline, arena);
+                memcpy(buffers->blurred, arena->front, sizeof(buffers->blurred));
+                blur_seconds = now_seconds() - blur_started;
+                blurred_for = config;
+                binary_for = NULL;
+                blur_runs++;
+            }
+            if (binary_for == NULL || !same_threshold_stage(binary_for, config)) {
+                const double threshold_started = now_seconds();
+                memcpy(arena->front, buffers->blurred, sizeof(buffers->blurred));
+                run_binarize_stage(&entry->pipeline, arena, NULL);
+                memcpy(buffers->binary, arena->front, sizeof(buffers->binary));
+                threshold_seconds = now_seconds() - threshold_started;
+                binary_for = config;
+                threshold_runs++;
+            } else {
+                memcpy(arena->front, buffers->binary, sizeof(buffers->binary));
+            }
+            // Shared stages are charged to every configuration at what they cost when they ran
+            entry->blur_seconds += blur_seconds;
+            entry->threshold_seconds += threshold_seconds;
+
+            const double detection_started = now_seconds();
+            Cell_list* cell_list = create_cell_list();
+            run_cell_stages(&entry->pipeline, arena, cell_list, NULL);
+            entry->cells += cell_list->cell_amount;
+            destroy_cell_list(cell_list);
+            entry->detection_seconds += now_seconds() - detection_started;
+        }
+    }
+    const double elapsed = now_seconds() - started;
+
+    write_report(stdout, grid, entries, entry_amount, input_amount);
+    write_report(report_file, grid, entries, entry_amount, input_amount);
+    fclose(report_file);
+    printf("Evaluated %d configurations on %d images in %.3f s: %d decodes, %d blur and %d threshold runs "
+           "instead of %d each\n", entry_amount, input_amount, elapsed, input_amount, blur_runs, threshold_runs,
+           entry_amount * input_amount);
+
+    destroy_scratch_arena(arena);
+    free(buffers);
+    free(entries);
+    return 0;
+}
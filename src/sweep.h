@@ -0,0 +1,57 @@
+#ifndef CELL_DETECTION_SWEEP_H
+#define CELL_DETECTION_SWEEP_H
+
+#include <stdbool.h>
+
+#include "pipeline.h"
+
+#define SWEEP_MAX_AXES 8
+#define SWEEP_MAX_VALUES 32
+#define SWEEP_VALUE_SIZE 32
+// Most configurations a grid may expand to, every one of which runs on every image
+#define SWEEP_MAX_CONFIGS 65536
+
+// One swept pipeline option and the values it takes
+typedef struct {
+    char key[SWEEP_VALUE_SIZE];
+    char values[SWEEP_MAX_VALUES][SWEEP_VALUE_SIZE];
+    int value_amount;
+} Sweep_axis;
+
+// The grid of configurations a sweep evaluates: every combination of the axis values
+typedef struct {
+    Sweep_axis axes[SWEEP_MAX_AXES];
+    int axis_amount;
+} Sweep_grid;
+
+/**
+ * @brief Reads a sweep grid from a file with key = value, value, ... lines, using the pipeline option keys.
+ * Blank lines and lines starting with # are skipped.
+ *
+ * The axes are ordered by the stage their option belongs to, blur first, so configurations sharing a blur
+ * and threshold setting come out next to each other.
+ *
+ * @param grid The grid to fill.
+ * @param file_path The grid file.
+ * @return True if every line held a known key with valid values, false otherwise.
+ */
+bool load_sweep_grid(Sweep_grid* grid, const char* file_path);
+
+/**
+ * @brief Evaluates every configuration of the grid on every image and reports cell counts and timings.
+ *
+ * Each image is decoded once. Consecutive configurations reuse the blurred image while their blur setting
+ * is the same, and the binary image while their threshold setting is the same too, so only the erosion
+ * and detection stages run for every configuration.
+ *
+ * @param base The configuration the grid values are applied to.
+ * @param grid The swept options.
+ * @param report_path The CSV file the table is written to.
+ * @param input_paths The images to evaluate on.
+ * @param input_amount The number of images.
+ * @return 0 on success, 1 if the sweep could not be set up.
+ */
+int run_sweep(const Pipeline_config* base, const Sweep_grid* grid, const char* report_path,
+              char** input_paths, int input_amount);
+
+#endif // CELL_DETECTION_SWEEP_H
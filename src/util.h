@@ -0,0 +1,18 @@
+#ifndef CELL_DETECTION_UTIL_H
+#define CELL_DETECTION_UTIL_H
+
+/**
+ * @brief Reads the monotonic clock, for timing stages and checking deadlines.
+ * @return The time in seconds since an arbitrary fixed point, the same for every process.
+ */
+double now_seconds(void);
+
+/**
+ * @brief Strips the blanks around a line of text, and its line ending, in place.
+ *
+ * @param text The text to trim. Its trailing blanks are overwritten by the terminator.
+ * @return The first character that is not a blank.
+ */
+char* trim(char* text);
+
+#endif // CELL_DETECTION_UTIL_H